@@ -1191,6 +1191,14 @@ int xc_pcitopoinfo(xc_interface *xch, unsigned num_devs,
 int xc_sched_id(xc_interface *xch,
                 int *sched_id);
 
+/*
+ * Get scheduling statistics of a cpupool (XEN_SYSCTL_CPUPOOL_PAR_ANY for the
+ * whole host).
+ */
+typedef struct xen_sysctl_sched_stats xc_sched_stats_t;
+int xc_sched_stats(xc_interface *xch, uint32_t cpupool_id,
+                   xc_sched_stats_t *stats);
+
 int xc_machphys_mfn_list(xc_interface *xch,
                          unsigned long max_extents,
                          xen_pfn_t *extent_start);
@@ -2277,6 +2285,23 @@ int xc_memshr_range_share(xc_interface *xch,
                           uint64_t first_gfn,
                           uint64_t last_gfn);
 
+/* Nominates and shares a list of gfn pairs between two domains in a single
+ * hypercall, e.g. for pages a deduplication scanner found to be identical.
+ * The result for each pair is stored in its rc field.  With
+ * XENMEM_SHARING_BATCH_VERIFY in flags, pairs whose contents turn out to
+ * differ aren't shared, and get -EILSEQ.
+ *
+ * Fails with -ENOMEM if there isn't enough memory available to store the
+ * sharing metadata.  The failing pair then has its rc set to -ENOMEM, and
+ * pairs past it haven't been looked at (their rc is left untouched).
+ */
+int xc_memshr_batch_share(xc_interface *xch,
+                          uint32_t source_domain,
+                          uint32_t client_domain,
+                          xen_mem_sharing_pair_t *pairs,
+                          uint32_t nr,
+                          uint32_t flags);
+
 int xc_memshr_fork(xc_interface *xch,
                    uint32_t source_domain,
                    uint32_t client_domain,
@@ -2292,6 +2317,25 @@ int xc_memshr_fork(xc_interface *xch,
  */
 int xc_memshr_fork_reset(xc_interface *xch, uint32_t forked_domain);
 
+/*
+ * Like xc_memshr_fork_reset, but the pages the fork wrote to get their
+ * contents restored from the parent rather than being freed.  Faster for
+ * forks touching largely the same memory after each reset, as is typical
+ * for fuzzing.
+ */
+int xc_memshr_fork_reset_restore(xc_interface *xch, uint32_t forked_domain);
+
+/*
+ * Populate a range of a fork's memory from its parent up front, rather than
+ * lazily on first access: with shared entries, or with private copies if
+ * private is set.  Gfns already populated are left alone.
+ */
+int xc_memshr_fork_populate(xc_interface *xch,
+                            uint32_t forked_domain,
+                            uint64_t first_gfn,
+                            uint64_t last_gfn,
+                            bool private);
+
 /* Debug calls: return the number of pages referencing the shared frame backing
  * the input argument. Should be one or greater.
  *
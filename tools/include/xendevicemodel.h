@@ -51,6 +51,30 @@ int xendevicemodel_create_ioreq_server(
     xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
     ioservid_t *id);
 
+/**
+ * This function instantiates an IOREQ Server with a buffered ioreq ring
+ * of 2^bufioreq_order pages. The pages of such a ring can only be mapped
+ * using xenforeignmemory_map_resource(), at frame
+ * XENMEM_resource_ioreq_server_frame_bufioreq for the first page and
+ * XENMEM_resource_ioreq_server_frame_bufioreq_ext(n) for the n-th one
+ * following it. The latter aren't included in the size reported by
+ * xenforeignmemory_resource_size().
+ *
+ * @parm dmod a handle to an open devicemodel interface.
+ * @parm domid the domain id to be serviced
+ * @parm handle_bufioreq how should the IOREQ Server handle buffered
+ *                       requests (HVM_IOREQSRV_BUFIOREQ_*)?
+ * @parm bufioreq_order log2 of the number of pages of the buffered ring
+ *                      (at most XEN_DMOP_BUFIOREQ_MAX_ORDER).
+ * @parm flags XEN_DMOP_ioreq_* flags, e.g. XEN_DMOP_ioreq_multi_page if
+ *             the emulator can handle requests spanning several pages.
+ * @parm id pointer to an ioservid_t to receive the IOREQ Server id.
+ * @return 0 on success, -1 on failure.
+ */
+int xendevicemodel_create_ioreq_server_ext(
+    xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
+    unsigned int bufioreq_order, unsigned int flags, ioservid_t *id);
+
 /**
  * This function retrieves the necessary information to allow an
  * emulator to use an IOREQ Server.
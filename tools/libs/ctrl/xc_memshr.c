@@ -202,6 +202,40 @@ int xc_memshr_range_share(xc_interface *xch,
     return xc_memshr_memop(xch, source_domain, &mso);
 }
 
+int xc_memshr_batch_share(xc_interface *xch,
+                          uint32_t source_domain,
+                          uint32_t client_domain,
+                          xen_mem_sharing_pair_t *pairs,
+                          uint32_t nr,
+                          uint32_t flags)
+{
+    DECLARE_HYPERCALL_BOUNCE(pairs, nr * sizeof(*pairs),
+                             XC_HYPERCALL_BUFFER_BOUNCE_BOTH);
+    xen_mem_sharing_op_t mso;
+    int rc;
+
+    if ( xc_hypercall_bounce_pre(xch, pairs) )
+    {
+        PERROR("Could not bounce memory for XENMEM_sharing_op_batch_share");
+        return -1;
+    }
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = XENMEM_sharing_op_batch_share;
+
+    mso.u.batch.client_domain = client_domain;
+    mso.u.batch.nr = nr;
+    mso.u.batch.flags = flags;
+    set_xen_guest_handle(mso.u.batch.pairs, pairs);
+
+    rc = xc_memshr_memop(xch, source_domain, &mso);
+
+    xc_hypercall_bounce_post(xch, pairs);
+
+    return rc;
+}
+
 int xc_memshr_domain_resume(xc_interface *xch,
                             uint32_t domid)
 {
@@ -267,6 +301,34 @@ int xc_memshr_fork_reset(xc_interface *xch, uint32_t domid)
     return xc_memshr_memop(xch, domid, &mso);
 }
 
+int xc_memshr_fork_reset_restore(xc_interface *xch, uint32_t domid)
+{
+    xen_mem_sharing_op_t mso;
+
+    memset(&mso, 0, sizeof(mso));
+    mso.op = XENMEM_sharing_op_fork_reset;
+    mso.u.fork.flags = XENMEM_FORK_RESET_RESTORE;
+
+    return xc_memshr_memop(xch, domid, &mso);
+}
+
+int xc_memshr_fork_populate(xc_interface *xch, uint32_t domid,
+                            uint64_t first_gfn, uint64_t last_gfn,
+                            bool private)
+{
+    xen_mem_sharing_op_t mso;
+
+    memset(&mso, 0, sizeof(mso));
+    mso.op = XENMEM_sharing_op_fork_populate;
+    mso.u.populate.first_gfn = first_gfn;
+    mso.u.populate.last_gfn = last_gfn;
+
+    if ( private )
+        mso.u.populate.flags |= XENMEM_FORK_POPULATE_PRIVATE;
+
+    return xc_memshr_memop(xch, domid, &mso);
+}
+
 int xc_memshr_audit(xc_interface *xch)
 {
     xen_mem_sharing_op_t mso;
@@ -345,6 +345,23 @@ int xc_sched_id(xc_interface *xch,
     return 0;
 }
 
+int xc_sched_stats(xc_interface *xch, uint32_t cpupool_id,
+                   xc_sched_stats_t *stats)
+{
+    int ret;
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_sched_stats;
+    sysctl.u.sched_stats.cpupool_id = cpupool_id;
+
+    if ( (ret = do_sysctl(xch, &sysctl)) != 0 )
+        return ret;
+
+    *stats = sysctl.u.sched_stats;
+
+    return 0;
+}
+
 #if defined(__i386__) || defined(__x86_64__)
 int xc_mca_op(xc_interface *xch, struct xen_mc *mc)
 {
@@ -0,0 +1,167 @@
+/*
+ * Test of XENMEM_sharing_op_batch_share.  A fork of the given parent gets
+ * NR_PAGES pages populated with private copies of the parent's, which are
+ * then shared back with the parent's in a single batch.  One of the fork's
+ * pages gets modified beforehand, to check XENMEM_SHARING_BATCH_VERIFY, and
+ * a malformed pair is added at the end.  The parent needs to be an HVM guest
+ * using HAP, with RAM at the gfns used; it gets paused for the duration of
+ * the test.
+ */
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define XC_WANT_COMPAT_MAP_FOREIGN_API
+#include <xenctrl.h>
+
+#define FIRST_GFN 0x10
+#define NR_PAGES  16
+/* The fork's page modified before sharing. */
+#define DIRTY_IDX 3
+
+static xc_interface *xch;
+static unsigned int nr_failures;
+
+#define fail(fmt, ...)                                  \
+({                                                      \
+    nr_failures++;                                      \
+    printf("    Fail: " fmt "\n", ##__VA_ARGS__);       \
+})
+
+static int create_fork(const xc_dominfo_t *parent, uint32_t *domid)
+{
+    struct xen_domctl_createdomain create = {
+        .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+        .max_vcpus = parent->max_vcpu_id + 1,
+        .max_evtchn_port = -1,
+        .max_grant_frames = 64,
+        .max_maptrack_frames = 1024,
+        .arch = parent->arch_config,
+    };
+
+    *domid = 0;
+
+    if ( xc_domain_create(xch, domid, &create) )
+        return -1;
+
+    if ( xc_memshr_fork(xch, parent->domid, *domid, false, false) )
+    {
+        int e = errno;
+
+        xc_domain_destroy(xch, *domid);
+        errno = e;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void dirty_page(uint32_t domid, unsigned long gfn)
+{
+    unsigned char *p = xc_map_foreign_range(xch, domid, XC_PAGE_SIZE,
+                                            PROT_READ | PROT_WRITE, gfn);
+
+    if ( !p )
+        err(1, "map d%u gfn %#lx", domid, gfn);
+
+    p[0] ^= 0xff;
+
+    munmap(p, XC_PAGE_SIZE);
+}
+
+static void test_batch_share(const xc_dominfo_t *parent)
+{
+    xen_mem_sharing_pair_t pairs[NR_PAGES + 1] = {};
+    long freed;
+    uint32_t domid;
+    unsigned int i;
+
+    printf("Testing batched sharing with d%u\n", parent->domid);
+
+    if ( create_fork(parent, &domid) )
+        err(1, "fork");
+
+    if ( xc_memshr_fork_populate(xch, domid, FIRST_GFN,
+                                 FIRST_GFN + NR_PAGES - 1, true) )
+        err(1, "populate");
+
+    dirty_page(domid, FIRST_GFN + DIRTY_IDX);
+
+    for ( i = 0; i < NR_PAGES; i++ )
+    {
+        pairs[i].source_gfn = FIRST_GFN + i;
+        pairs[i].client_gfn = FIRST_GFN + i;
+        pairs[i].rc = 1;
+    }
+
+    /* Malformed pair. */
+    pairs[i].source_gfn = FIRST_GFN;
+    pairs[i].client_gfn = FIRST_GFN;
+    pairs[i]._pad = 1;
+    pairs[i].rc = 1;
+
+    freed = xc_sharing_freed_pages(xch);
+    if ( freed < 0 )
+        err(1, "freed pages");
+
+    if ( xc_memshr_batch_share(xch, parent->domid, domid, pairs,
+                               NR_PAGES + 1, XENMEM_SHARING_BATCH_VERIFY) )
+        fail("batch share: %d - %s", errno, strerror(errno));
+
+    for ( i = 0; i < NR_PAGES; i++ )
+    {
+        int expected = i == DIRTY_IDX ? -EILSEQ : 0;
+
+        if ( pairs[i].rc != expected )
+            fail("gfn %#lx: got rc %d, expected %d",
+                 FIRST_GFN + i + 0UL, pairs[i].rc, expected);
+    }
+
+    if ( pairs[i].rc != -EINVAL )
+        fail("malformed pair: got rc %d, expected %d",
+             pairs[i].rc, -EINVAL);
+
+    /* Every page shared successfully spares one. */
+    if ( xc_sharing_freed_pages(xch) - freed != NR_PAGES - 1 )
+        fail("%ld pages freed, expected %u",
+             xc_sharing_freed_pages(xch) - freed, NR_PAGES - 1);
+
+    xc_domain_destroy(xch, domid);
+}
+
+int main(int argc, char **argv)
+{
+    xc_dominfo_t info;
+    uint32_t parent;
+
+    if ( argc != 2 )
+    {
+        fprintf(stderr, "usage: %s <parent-domid>\n", argv[0]);
+        return 1;
+    }
+
+    parent = strtoul(argv[1], NULL, 0);
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+        err(1, "xc_interface_open");
+
+    if ( xc_domain_getinfo(xch, parent, 1, &info) != 1 ||
+         info.domid != parent )
+        errx(1, "no domain %u", parent);
+    if ( !info.hvm )
+        errx(1, "d%u is not an HVM guest", parent);
+
+    if ( xc_domain_pause(xch, parent) )
+        err(1, "pause d%u", parent);
+
+    test_batch_share(&info);
+
+    xc_domain_unpause(xch, parent);
+    xc_interface_close(xch);
+
+    return !!nr_failures;
+}
@@ -65,6 +65,71 @@ static void test_gnttab(uint32_t domid, unsigned int nr_frames)
         return fail("    Fail: Unmap %d - %s\n", errno, strerror(errno));
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+static void test_dirty_ring(uint32_t domid)
+{
+    xenforeignmemory_resource_handle *res;
+    struct xen_dirty_ring *ring = NULL;
+    size_t size;
+    int rc;
+
+    printf("  Test dirty ring\n");
+
+    rc = xenforeignmemory_resource_size(
+        fh, domid, XENMEM_resource_dirty_ring, 0, &size);
+    if ( rc )
+        return fail("    Fail: Get size: %d - %s\n", errno, strerror(errno));
+
+    res = xenforeignmemory_map_resource(
+        fh, domid, XENMEM_resource_dirty_ring, 0, 0, size >> XC_PAGE_SHIFT,
+        (void **)&ring, PROT_READ | PROT_WRITE, 0);
+    if ( !res )
+        return fail("    Fail: Map %d - %s\n", errno, strerror(errno));
+
+    if ( !ring->size || (ring->size & (ring->size - 1)) ||
+         ring->size > ((size >> XC_PAGE_SHIFT) - 1) *
+                      (XC_PAGE_SIZE / sizeof(uint64_t)) )
+        fail("    Fail: Bad ring size %u for %zu frames\n",
+             ring->size, size >> XC_PAGE_SHIFT);
+
+    rc = xc_shadow_control(xch, domid, XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
+                           NULL, 0);
+    if ( rc )
+    {
+        fail("    Fail: Enable log-dirty: %d - %s\n", errno, strerror(errno));
+        goto out;
+    }
+
+    if ( ring->prod || ring->cons )
+        fail("    Fail: Ring not empty: prod %u cons %u\n",
+             ring->prod, ring->cons);
+
+    /* Nothing consumed: only flushes pfns cached by hardware. */
+    rc = xc_shadow_control(xch, domid, XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET,
+                           NULL, 0);
+    if ( rc )
+        fail("    Fail: Reset: %d - %s\n", errno, strerror(errno));
+
+    /* Entries not produced yet can't be handed back. */
+    ring->cons = ring->prod + 1;
+    rc = xc_shadow_control(xch, domid, XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET,
+                           NULL, 0);
+    if ( !rc || errno != EINVAL )
+        fail("    Fail: Reset past prod: expected EINVAL, got %d - %s\n",
+             rc, rc ? strerror(errno) : "success");
+    ring->cons = ring->prod;
+
+    rc = xc_shadow_control(xch, domid, XEN_DOMCTL_SHADOW_OP_OFF, NULL, 0);
+    if ( rc )
+        fail("    Fail: Disable log-dirty: %d - %s\n", errno, strerror(errno));
+
+ out:
+    rc = xenforeignmemory_unmap_resource(fh, res);
+    if ( rc )
+        fail("    Fail: Unmap %d - %s\n", errno, strerror(errno));
+}
+#endif
+
 static void test_domain_configurations(void)
 {
     static struct test {
@@ -90,6 +155,17 @@ static void test_domain_configurations(void)
                 },
             },
         },
+        {
+            .name = "x86 PVH (HAP)",
+            .create = {
+                .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+                .max_vcpus = 2,
+                .max_grant_frames = 40,
+                .arch = {
+                    .emulation_flags = XEN_X86_EMU_LAPIC,
+                },
+            },
+        },
 #elif defined(__aarch64__) || defined(__arm__)
         {
             .name = "ARM",
@@ -124,6 +200,10 @@ static void test_domain_configurations(void)
         printf("  Created d%u\n", domid);
 
         test_gnttab(domid, t->create.max_grant_frames);
+#if defined(__x86_64__) || defined(__i386__)
+        if ( t->create.flags & XEN_DOMCTL_CDF_hap )
+            test_dirty_ring(domid);
+#endif
 
         rc = xc_domain_destroy(xch, domid);
         if ( rc )
@@ -0,0 +1,154 @@
+/*
+ * Benchmark of VM forking: forks per second, and fork resets per second with
+ * and without XENMEM_FORK_RESET_RESTORE.  The parent needs to be an HVM
+ * guest using HAP; it gets paused for the duration of the run.
+ */
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xenctrl.h>
+
+static xc_interface *xch;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int create_fork(const xc_dominfo_t *parent, uint32_t *domid)
+{
+    struct xen_domctl_createdomain create = {
+        .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+        .max_vcpus = parent->max_vcpu_id + 1,
+        .max_evtchn_port = -1,
+        .max_grant_frames = 64,
+        .max_maptrack_frames = 1024,
+        .arch = parent->arch_config,
+    };
+
+    *domid = 0;
+
+    if ( xc_domain_create(xch, domid, &create) )
+        return -1;
+
+    if ( xc_memshr_fork(xch, parent->domid, *domid, false, false) )
+    {
+        int e = errno;
+
+        xc_domain_destroy(xch, *domid);
+        errno = e;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void bench_forks(const xc_dominfo_t *parent, unsigned int nr)
+{
+    uint32_t *domids = calloc(nr, sizeof(*domids));
+    unsigned int i;
+    double t;
+
+    if ( !domids )
+        err(1, "calloc");
+
+    t = now();
+    for ( i = 0; i < nr; i++ )
+        if ( create_fork(parent, &domids[i]) )
+            err(1, "fork %u", i);
+    t = now() - t;
+
+    printf("  %u forks: %.3fs, %.1f forks/s\n", nr, t, nr / t);
+
+    for ( i = 0; i < nr; i++ )
+        xc_domain_destroy(xch, domids[i]);
+
+    free(domids);
+}
+
+/*
+ * Each iteration privately populates (as if written to by the fork) the
+ * first nr_pages pages, and then resets the fork.
+ */
+static void bench_resets(const xc_dominfo_t *parent, unsigned int nr,
+                         unsigned long nr_pages, bool restore)
+{
+    uint32_t domid;
+    unsigned int i;
+    double t;
+
+    if ( create_fork(parent, &domid) )
+        err(1, "fork");
+
+    t = now();
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( xc_memshr_fork_populate(xch, domid, 0, nr_pages - 1, true) )
+            err(1, "populate %u", i);
+
+        if ( restore ? xc_memshr_fork_reset_restore(xch, domid)
+                     : xc_memshr_fork_reset(xch, domid) )
+            err(1, "reset %u", i);
+    }
+    t = now() - t;
+
+    printf("  %u resets of %lu pages%s: %.3fs, %.1f resets/s\n",
+           nr, nr_pages, restore ? " (restore)" : "", t, nr / t);
+
+    xc_domain_destroy(xch, domid);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr = 1000;
+    unsigned long nr_pages = 256;
+    xc_dominfo_t info;
+    uint32_t parent;
+
+    if ( argc < 2 || argc > 4 )
+    {
+        fprintf(stderr, "usage: %s <parent-domid> [<iterations> [<pages>]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    parent = strtoul(argv[1], NULL, 0);
+    if ( argc > 2 )
+        nr = strtoul(argv[2], NULL, 0);
+    if ( argc > 3 )
+        nr_pages = strtoul(argv[3], NULL, 0);
+    if ( !nr || !nr_pages )
+        errx(1, "iterations and pages need to be non-zero");
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+        err(1, "xc_interface_open");
+
+    if ( xc_domain_getinfo(xch, parent, 1, &info) != 1 ||
+         info.domid != parent )
+        errx(1, "no domain %u", parent);
+    if ( !info.hvm )
+        errx(1, "d%u is not an HVM guest", parent);
+
+    if ( xc_domain_pause(xch, parent) )
+        err(1, "pause d%u", parent);
+
+    printf("VM fork benchmark, parent d%u\n", parent);
+
+    bench_forks(&info, nr);
+    bench_resets(&info, nr, nr_pages, false);
+    bench_resets(&info, nr, nr_pages, true);
+
+    xc_domain_unpause(xch, parent);
+    xc_interface_close(xch);
+
+    return 0;
+}
@@ -89,6 +89,7 @@ typedef union {
 
 #define xzalloc(type) ((type *)calloc(1, sizeof(type)))
 #define xmalloc(type) ((type *)malloc(sizeof(type)))
+#define xzalloc_array(type, num) ((type *)calloc(num, sizeof(type)))
 #define xfree(p) free(p)
 
 #define pci_get_pdev_by_domain(...) &test_pdev
@@ -104,6 +105,7 @@ typedef union {
 #define pci_conf_write16(...)
 #define pci_conf_write32(...)
 
+#define PCI_CFG_SPACE_SIZE 256
 #define PCI_CFG_SPACE_EXP_SIZE 4096
 
 #define BUG() assert(0)
@@ -18,6 +18,9 @@
 
 #include "emul.h"
 
+#include <string.h>
+#include <time.h>
+
 /* Single vcpu (current), and single domain with a single PCI device. */
 static struct vpci vpci;
 
@@ -70,6 +73,15 @@ static void vpci_write32(const struct pci_dev *pdev, unsigned int reg,
     *(uint32_t *)data = val;
 }
 
+/* Read hook counting its invocations, for cached registers. */
+static unsigned int nr_counted_reads;
+static uint32_t vpci_counted_read32(const struct pci_dev *pdev,
+                                    unsigned int reg, void *data)
+{
+    nr_counted_reads++;
+    return *(uint32_t *)data;
+}
+
 #define VPCI_READ(reg, size, data) ({                           \
     data = vpci_read((pci_sbdf_t){ .sbdf = 0 }, reg, size);     \
 })
@@ -119,6 +131,49 @@ void multiread4_check(unsigned int reg, uint32_t val)
     VPCI_READ_CHECK(reg, 4, val);
 }
 
+static double time_reads(unsigned int start, unsigned int end,
+                         unsigned int loops)
+{
+    struct timespec t0, t1;
+    unsigned int i, reg;
+    uint32_t sum = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for ( i = 0; i < loops; i++ )
+        for ( reg = start; reg < end; reg += 4 )
+            sum += vpci_read((pci_sbdf_t){ .sbdf = 0 }, reg, 4);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    /* Keep the reads from being optimized away. */
+    assert(sum || !sum);
+
+    return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+           ((double)loops * ((end - start) / 4));
+}
+
+/*
+ * Measure the cost of config space reads on a device with a handler in
+ * every dword of the capability area, growing the number of handlers.
+ */
+static void bench(void)
+{
+    static uint32_t regs[PCI_CFG_SPACE_EXP_SIZE / 4];
+    unsigned int nr = 0, limit;
+
+    printf("%8s %12s %12s\n", "handlers", "first (ns)", "last (ns)");
+    for ( limit = 0x80; limit <= PCI_CFG_SPACE_EXP_SIZE; limit *= 2 )
+    {
+        for ( ; nr < limit / 4; nr++ )
+            VPCI_ADD_REG(vpci_read32, vpci_write32, nr * 4, 4, regs[nr]);
+
+        printf("%8u %12.1f %12.1f\n", nr, time_reads(0, 0x40, 10000),
+               time_reads(limit - 0x40, limit, 10000));
+    }
+
+    for ( ; nr; nr-- )
+        VPCI_REMOVE_REG((nr - 1) * 4, 4);
+}
+
 void multiwrite4_check(unsigned int reg)
 {
     unsigned int i;
@@ -154,12 +209,19 @@ main(int argc, char **argv)
     uint16_t r20[2] = { };
     uint32_t r24 = 0;
     uint8_t r28, r30;
+    uint32_t r256 = 0, r4092 = 0, r32 = 0x12345678;
     unsigned int i;
     int rc;
 
     INIT_LIST_HEAD(&vpci.handlers);
     spin_lock_init(&vpci.lock);
 
+    if ( argc > 1 && !strcmp(argv[1], "--bench") )
+    {
+        bench();
+        return 0;
+    }
+
     VPCI_ADD_REG(vpci_read32, vpci_write32, 0, 4, r0);
     VPCI_READ_CHECK(0, 4, r0);
     VPCI_WRITE_CHECK(0, 4, 0xbcbcbcbc);
@@ -287,10 +349,35 @@ main(int argc, char **argv)
     VPCI_ADD_REG(vpci_read8, vpci_write8, 30, 1, r30);
     VPCI_WRITE_CHECK(28, 4, 0xffacffdc);
 
+    /* Registers in the extended configuration space. */
+    VPCI_ADD_REG(vpci_read32, vpci_write32, 256, 4, r256);
+    VPCI_ADD_REG(vpci_read32, vpci_write32, 4092, 4, r4092);
+    multiwrite4_check(256);
+    multiwrite4_check(4092);
+    VPCI_READ_CHECK(260, 4, 0xffffffff);
+    VPCI_READ_CHECK(4088, 4, 0xffffffff);
+
+    /* Cached register, only read once. */
+    assert(!vpci_add_cached_register(test_pdev.vpci, vpci_counted_read32,
+                                     32, 4, &r32));
+    assert(vpci_add_cached_register(test_pdev.vpci, NULL, 36, 4, NULL));
+    VPCI_READ_CHECK(32, 4, 0x12345678);
+    r32 = 0;
+    VPCI_READ_CHECK(32, 4, 0x12345678);
+    VPCI_READ_CHECK(34, 2, 0x1234);
+    VPCI_READ_CHECK(33, 1, 0x56);
+    VPCI_WRITE(32, 4, 0);
+    VPCI_READ_CHECK(32, 4, 0x12345678);
+    assert(nr_counted_reads == 1);
+
     /* Finally try to remove a couple of registers. */
     VPCI_REMOVE_REG(28, 1);
+    /* r30 must still be found once the first handler in its dword is gone. */
+    VPCI_READ_CHECK(28, 4, 0xffacffff);
     VPCI_REMOVE_REG(24, 4);
     VPCI_REMOVE_REG(12, 2);
+    VPCI_REMOVE_REG(256, 4);
+    VPCI_READ_CHECK(256, 4, 0xffffffff);
 
     VPCI_REMOVE_INVALID_REG(20, 1);
     VPCI_REMOVE_INVALID_REG(16, 2);
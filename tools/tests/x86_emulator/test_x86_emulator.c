@@ -4,6 +4,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <time.h>
 
 asm ( ".pushsection .test, \"ax\", @progbits; .popsection" );
 
@@ -907,6 +908,7 @@ int main(int argc, char **argv)
 
     ctxt.regs = &regs;
     ctxt.force_writeback = 0;
+    ctxt.decode_cache = NULL;
     ctxt.cpuid     = &cp;
     ctxt.lma       = sizeof(void *) == 8;
     ctxt.addr_size = 8 * sizeof(void *);
@@ -5179,6 +5181,77 @@ int main(int argc, char **argv)
 
     predicates_test(instr, &ctxt, fetch);
 
+    printf("%-40s", "Testing decode cache...");
+    if ( !(ctxt.decode_cache = x86_decode_cache_alloc()) )
+        goto fail;
+    /* movl %ecx,4(%eax,%edx,4), with varying registers */
+    instr[0] = 0x89; instr[1] = 0x4c; instr[2] = 0x90; instr[3] = 0x04;
+    for ( i = 0; i < 3; ++i )
+    {
+        regs.eflags = 0x200;
+        regs.eip    = (unsigned long)&instr[0];
+        regs.eax    = (unsigned long)res;
+        regs.ecx    = 0x12345678 + i;
+        regs.edx    = i;
+        res[i + 1]  = 0;
+        rc = x86_emulate(&ctxt, &emulops);
+        if ( (rc != X86EMUL_OKAY) ||
+             (res[i + 1] != 0x12345678 + i) ||
+             (regs.eip != (unsigned long)&instr[4]) )
+            goto fail;
+    }
+    /* The code getting modified needs to be noticed: movl 4(%eax,%edx,4),%ecx */
+    instr[0] = 0x8b;
+    regs.eip    = (unsigned long)&instr[0];
+    regs.ecx    = 0;
+    regs.edx    = 1;
+    rc = x86_emulate(&ctxt, &emulops);
+    if ( (rc != X86EMUL_OKAY) ||
+         (regs.ecx != 0x12345679) ||
+         (regs.eip != (unsigned long)&instr[4]) )
+        goto fail;
+    printf("okay\n");
+
+    /* Throughput of a device doorbell like store, without and with cache. */
+    for ( j = 0; j < 2; ++j )
+    {
+        struct x86_decode_cache *cache = ctxt.decode_cache;
+        struct timespec start, end;
+        unsigned long ns;
+
+        if ( !j )
+            ctxt.decode_cache = NULL;
+
+        instr[0] = 0x89; /* movl %ecx,4(%eax,%edx,4) */
+        regs.eax = (unsigned long)res;
+        regs.edx = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for ( i = 0; i < (1u << 20); ++i )
+        {
+            regs.eflags = 0x200;
+            regs.eip    = (unsigned long)&instr[0];
+            regs.ecx    = i;
+            rc = x86_emulate(&ctxt, &emulops);
+            if ( rc != X86EMUL_OKAY )
+                goto fail;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if ( res[1] != i - 1 )
+            goto fail;
+
+        ns = (end.tv_sec - start.tv_sec) * 1000000000UL +
+             end.tv_nsec - start.tv_nsec;
+        printf("%-40s%lu emulations/s\n",
+               j ? "Emulation throughput (decode cache)..."
+                 : "Emulation throughput (no cache)...",
+               ns ? (unsigned long)(i * 1000000000ULL / ns) : 0UL);
+
+        ctxt.decode_cache = cache;
+    }
+
+    free(ctxt.decode_cache);
+    ctxt.decode_cache = NULL;
+
     for ( j = 0; j < ARRAY_SIZE(blobs); j++ )
     {
         unsigned int nr;
@@ -276,3 +276,8 @@ static void wrpkru(unsigned int val)
 }
 
 #include "x86_emulate/x86_emulate.c"
+
+struct x86_decode_cache *x86_decode_cache_alloc(void)
+{
+    return calloc(1, sizeof(struct x86_decode_cache));
+}
@@ -235,7 +235,10 @@ void dump_pageframe_info(struct domain *d)
     }
 
     if ( is_hvm_domain(d) )
+    {
         p2m_pod_dump_data(d);
+        p2m_recombine_dump_data(d);
+    }
 
     spin_lock(&d->page_alloc_lock);
 
@@ -28,6 +28,13 @@
 #include <asm/iocap.h>
 #include <asm/vm_event.h>
 
+/*
+ * Upper bound on the repetitions of a string insn handled in one go.  This
+ * avoids extensive looping while still amortising the cost of I/O
+ * trap-and-emulate.
+ */
+#define HVMEMUL_MAX_REPS 4096
+
 struct hvmemul_cache
 {
     /* The cache is disabled as long as num_ents > max_ents. */
@@ -153,6 +160,76 @@ void hvmemul_cancel(struct vcpu *v)
     hvmemul_cache_disable(v);
 }
 
+/*
+ * Number of reps of a data_is_ptr request whose guest memory lies within a
+ * single page, for ioreq servers not able to deal with more.  A lone rep
+ * straddling two pages continues to be permitted.
+ */
+static unsigned long ioreq_ptr_reps_in_page(const ioreq_t *p)
+{
+    unsigned int off = p->data & ~PAGE_MASK;
+
+    if ( off + p->size > PAGE_SIZE )
+        return 1;
+
+    return min_t(unsigned long, p->count,
+                 (p->df ? off + p->size : PAGE_SIZE - off) / p->size);
+}
+
+/*
+ * Grow a MMIO request truncated at a GFN boundary (see hvmemul_do_io()) to
+ * up to max_reps, as long as the further pages are emulated MMIO handled by
+ * the same ioreq server and not by Xen internally.
+ */
+static void ioreq_mmio_extend(struct domain *d, const struct ioreq_server *s,
+                              ioreq_t *p, unsigned long max_reps)
+{
+    unsigned long count = p->count;
+
+    /*
+     * Checking a further page's first and last byte only catches internal
+     * handlers covering whole pages (vLAPIC, HPET, VGA, and the vIO-APIC of
+     * ordinary guests).  MSI-X tables, whether intercepted through vPCI or
+     * by the MSI-X table code for passed through devices, as well as the
+     * vIO-APICs of the hardware domain can sit anywhere inside a page which
+     * is otherwise emulated by the device model.
+     */
+    if ( has_vpci(d) || is_hardware_domain(d) || msixtbl_initialised(d) )
+        return;
+
+    while ( count < max_reps )
+    {
+        paddr_t next = p->df ? p->addr - count * p->size
+                             : p->addr + count * p->size;
+        unsigned long n = min_t(unsigned long, max_reps - count,
+                                PAGE_SIZE / p->size);
+        p2m_type_t t;
+
+        /* Continue only with a rep at the start of the next page. */
+        if ( (p->df ? next + p->size : next) & ~PAGE_MASK )
+            break;
+
+        get_gfn_query_unlocked(d, paddr_to_pfn(next), &t);
+        if ( t != p2m_mmio_dm || hvm_mmio_internal(next & PAGE_MASK) ||
+             hvm_mmio_internal(next | ~PAGE_MASK) )
+            break;
+
+        count += n;
+    }
+
+    if ( count > p->count )
+    {
+        ioreq_t q = *p;
+
+        q.count = count;
+        if ( ioreq_server_select(d, &q) == s )
+        {
+            p->count = count;
+            perfc_incr(ioreq_mmio_extended);
+        }
+    }
+}
+
 static int hvmemul_do_io(
     bool_t is_mmio, paddr_t addr, unsigned long *reps, unsigned int size,
     uint8_t dir, bool_t df, bool_t data_is_addr, uintptr_t data)
@@ -171,6 +248,7 @@ static int hvmemul_do_io(
         .data_is_ptr = data_is_addr, /* ioreq_t field name is misleading */
         .state = STATE_IOREQ_READY,
     };
+    unsigned long max_reps = *reps;
     void *p_data = (void *)data;
     int rc;
 
@@ -333,6 +411,19 @@ static int hvmemul_do_io(
         }
         else
         {
+            if ( !s->multi_page )
+            {
+                if ( data_is_addr )
+                    p.count = ioreq_ptr_reps_in_page(&p);
+            }
+            else if ( is_mmio && p2mt != p2m_ioreq_server &&
+                      p.count < max_reps )
+                ioreq_mmio_extend(currd, s, &p, max_reps);
+            *reps = vio->req.count = p.count;
+
+            perfc_incr(ioreq_emul_sent);
+            perfc_add(ioreq_emul_reps, p.count);
+
             rc = ioreq_send(s, &p, 0);
             if ( rc != X86EMUL_RETRY || currd->is_shutting_down )
                 vio->req.state = STATE_IOREQ_NONE;
@@ -384,12 +475,12 @@ static int hvmemul_do_io_buffer(
     return rc;
 }
 
-static int hvmemul_acquire_page(unsigned long gmfn, struct page_info **page)
+static int hvmemul_acquire_page(unsigned long gmfn, struct page_info **page,
+                                p2m_type_t *p2mt)
 {
     struct domain *curr_d = current->domain;
-    p2m_type_t p2mt;
 
-    switch ( check_get_page_from_gfn(curr_d, _gfn(gmfn), false, &p2mt,
+    switch ( check_get_page_from_gfn(curr_d, _gfn(gmfn), false, p2mt,
                                      page) )
     {
     case 0:
@@ -407,7 +498,7 @@ static int hvmemul_acquire_page(unsigned long gmfn, struct page_info **page)
     }
 
     /* This code should not be reached if the gmfn is not RAM */
-    if ( p2m_is_mmio(p2mt) )
+    if ( p2m_is_mmio(*p2mt) )
     {
         domain_crash(curr_d);
 
@@ -423,47 +514,123 @@ static inline void hvmemul_release_page(struct page_info *page)
     put_page(page);
 }
 
+/*
+ * Whether the ioreq server a data_is_ptr request would be sent to, if not
+ * handled by Xen internally, can deal with guest memory spanning pages.
+ */
+static bool ioreq_ptr_multi_page(bool is_mmio, paddr_t addr,
+                                 unsigned int size, uint8_t dir, bool df)
+{
+    struct domain *currd = current->domain;
+    const struct ioreq_server *s = NULL;
+    ioreq_t p = {
+        .type = is_mmio ? IOREQ_TYPE_COPY : IOREQ_TYPE_PIO,
+        .addr = addr,
+        .size = size,
+        .count = 1,
+        .dir = dir,
+        .df = df,
+        .data_is_ptr = 1,
+    };
+
+    if ( is_mmio )
+    {
+        p2m_type_t p2mt;
+
+        get_gfn_query_unlocked(currd, paddr_to_pfn(addr), &p2mt);
+        if ( p2mt == p2m_ioreq_server )
+        {
+            unsigned int flags;
+
+            s = p2m_get_ioreq_server(currd, &flags);
+        }
+    }
+
+    if ( !s )
+        s = ioreq_server_select(currd, &p);
+
+    return s && s->multi_page;
+}
+
 static int hvmemul_do_io_addr(
     bool_t is_mmio, paddr_t addr, unsigned long *reps,
     unsigned int size, uint8_t dir, bool_t df, paddr_t ram_gpa)
 {
     struct vcpu *v = current;
-    unsigned long ram_gmfn = paddr_to_pfn(ram_gpa);
-    unsigned int page_off = ram_gpa & (PAGE_SIZE - 1);
-    struct page_info *ram_page[2];
+    /* Enough for HVMEMUL_MAX_REPS of the largest size, plus a straddle. */
+    struct page_info *ram_page[PFN_UP(HVMEMUL_MAX_REPS * sizeof(long)) + 1];
     unsigned int nr_pages = 0;
-    unsigned long count;
+    unsigned long count, first, last;
+    bool multi_page = false;
     int rc;
 
-    rc = hvmemul_acquire_page(ram_gmfn, &ram_page[nr_pages]);
-    if ( rc != X86EMUL_OKAY )
-        goto out;
+    count = min_t(unsigned long, *reps,
+                  (ARRAY_SIZE(ram_page) - 1) * PAGE_SIZE / size);
+    if ( df )
+        count = min_t(unsigned long, count, ram_gpa / size + 1);
+    ASSERT(count);
 
-    nr_pages++;
+    /*
+     * Only device models having opted in get to see guest memory spanning
+     * pages (beyond a single straddling rep).  Don't acquire, and hence
+     * possibly unshare or page in, further pages for anyone else.
+     */
+    if ( count > 1 )
+        multi_page = ioreq_ptr_multi_page(is_mmio, addr, size, dir, df);
+    if ( count > 1 && !multi_page )
+    {
+        ioreq_t p = {
+            .size = size,
+            .count = count,
+            .df = df,
+            .data = ram_gpa,
+        };
 
-    /* Detemine how many reps will fit within this page */
-    count = min_t(unsigned long,
-                  *reps,
-                  df ?
-                  ((page_off + size - 1) & ~PAGE_MASK) / size :
-                  (PAGE_SIZE - page_off) / size);
+        count = ioreq_ptr_reps_in_page(&p);
+    }
+
+    /*
+     * Grab references to all pages covered by the access.  It is safe to
+     * assume multiple pages are physically contiguous at this point as
+     * hvmemul_linear_to_phys() will ensure this is the case.  Should one
+     * of them not be accessible, or not be ordinary writable RAM beyond the
+     * first one (a device model must not e.g. write to pages an ioreq
+     * server write-protects), restrict the access to the reps fitting the
+     * ones acquired so far.
+     */
+    first = paddr_to_pfn(df ? ram_gpa + size - 1 : ram_gpa);
+    last = paddr_to_pfn(df ? ram_gpa - (count - 1) * size
+                           : ram_gpa + count * size - 1);
 
-    if ( count == 0 )
+    for ( ; ; )
     {
-        /*
-         * This access must span two pages, so grab a reference to
-         * the next page and do a single rep.
-         * It is safe to assume multiple pages are physically
-         * contiguous at this point as hvmemul_linear_to_phys() will
-         * ensure this is the case.
-         */
-        rc = hvmemul_acquire_page(df ? ram_gmfn - 1 : ram_gmfn + 1,
-                                  &ram_page[nr_pages]);
+        unsigned long gmfn = df ? first - nr_pages : first + nr_pages;
+        p2m_type_t p2mt;
+
+        rc = hvmemul_acquire_page(gmfn, &ram_page[nr_pages], &p2mt);
+        if ( rc == X86EMUL_OKAY && multi_page && nr_pages &&
+             p2mt != p2m_ram_rw )
+        {
+            hvmemul_release_page(ram_page[nr_pages]);
+            rc = X86EMUL_UNHANDLEABLE;
+        }
         if ( rc != X86EMUL_OKAY )
-            goto out;
+        {
+            paddr_t limit = pfn_to_paddr(df ? gmfn + 1 : gmfn);
+
+            if ( !df )
+                count = limit > ram_gpa ? (limit - ram_gpa) / size : 0;
+            else
+                count = ram_gpa >= limit ? (ram_gpa - limit) / size + 1 : 0;
+
+            if ( !count )
+                goto out;
+            break;
+        }
 
         nr_pages++;
-        count = 1;
+        if ( gmfn == last )
+            break;
     }
 
     rc = hvmemul_do_io(is_mmio, addr, &count, size, dir, df, 1,
@@ -755,11 +922,8 @@ static int hvmemul_linear_to_phys(
     unsigned long pfn, npfn, done, todo, i, offset = addr & ~PAGE_MASK;
     int reverse;
 
-    /*
-     * Clip repetitions to a sensible maximum. This avoids extensive looping in
-     * this function while still amortising the cost of I/O trap-and-emulate.
-     */
-    *reps = min_t(unsigned long, *reps, 4096);
+    /* Clip repetitions to a sensible maximum. */
+    *reps = min_t(unsigned long, *reps, HVMEMUL_MAX_REPS);
 
     /* With no paging it's easy: linear == physical. */
     if ( !(curr->arch.hvm.guest_cr[0] & X86_CR0_PG) )
@@ -848,7 +1012,7 @@ static int hvmemul_virtual_to_linear(
 
     if ( reps_p )
     {
-        unsigned long max_reps = 4096;
+        unsigned long max_reps = HVMEMUL_MAX_REPS;
 
         /*
          * If introspection has been enabled for this domain, and we're
@@ -2850,6 +3014,7 @@ void hvm_emulate_init_once(
     hvmemul_ctxt->ctxt.regs = regs;
     hvmemul_ctxt->ctxt.cpuid = curr->domain->arch.cpuid;
     hvmemul_ctxt->ctxt.force_writeback = true;
+    hvmemul_ctxt->ctxt.decode_cache = curr->arch.hvm.hvm_io.decode_cache;
 }
 
 void hvm_emulate_init_per_insn(
@@ -2989,6 +3154,14 @@ int hvmemul_cache_init(struct vcpu *v)
 
     v->arch.hvm.hvm_io.cache = cache;
 
+    /* Also keep the decoding of recently emulated insns. */
+    v->arch.hvm.hvm_io.decode_cache = x86_decode_cache_alloc();
+    if ( !v->arch.hvm.hvm_io.decode_cache )
+    {
+        hvmemul_cache_destroy(v);
+        return -ENOMEM;
+    }
+
     return 0;
 }
 
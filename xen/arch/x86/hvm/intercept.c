@@ -220,28 +220,91 @@ int hvm_process_io_intercept(const struct hvm_io_handler *handler,
     return rc;
 }
 
+/*
+ * The handlers a vCPU used last are tried first: emulation of e.g. HPET or
+ * PIT accesses tends to come in bursts, and handlers of the same type are
+ * otherwise probed in the order they were registered.  As the ranges are
+ * defined by accept() hooks there are no static ranges to index.
+ *
+ * The first handler in registration order accepting an access is to handle
+ * it.  Handlers without ->overlaps set claim ranges disjoint from all other
+ * handlers', so a cached one accepting is that first handler as long as all
+ * earlier ones with ->overlaps set reject the access.  Handlers with
+ * ->overlaps set are never used from the cache.  Each accept() hook is
+ * called at most once per lookup.
+ */
 static const struct hvm_io_handler *hvm_find_io_handler(const ioreq_t *p)
 {
-    struct domain *curr_d = current->domain;
-    unsigned int i;
+    struct vcpu *curr = current;
+    const struct hvm_io_handler *handlers = curr->domain->arch.hvm.io_handler;
+    const struct hvm_io_handler *found = NULL;
+    uint8_t *hit =
+        curr->arch.hvm.hvm_io.io_handler_hit[p->type == IOREQ_TYPE_COPY];
+    unsigned int i, j, f = 0, nr = curr->domain->arch.hvm.io_handler_count;
+    uint32_t rejected = 0;
 
     BUG_ON((p->type != IOREQ_TYPE_PIO) &&
            (p->type != IOREQ_TYPE_COPY));
+    BUILD_BUG_ON(NR_IO_HANDLERS > 32);
+
+    perfc_incr(hvm_io_lookup);
 
-    for ( i = 0; i < curr_d->arch.hvm.io_handler_count; i++ )
+    for ( j = 0; j < ARRAY_SIZE(curr->arch.hvm.hvm_io.io_handler_hit[0]); j++ )
     {
-        const struct hvm_io_handler *handler =
-            &curr_d->arch.hvm.io_handler[i];
-        const struct hvm_io_ops *ops = handler->ops;
+        i = hit[j];
+        if ( i >= nr || (j && i == hit[0]) || handlers[i].type != p->type ||
+             handlers[i].overlaps )
+            continue;
 
-        if ( handler->type != p->type )
+        /* Earlier handlers possibly overlapping this one take precedence. */
+        for ( ; f < i; f++ )
+        {
+            if ( handlers[f].type != p->type || !handlers[f].overlaps )
+                continue;
+
+            perfc_incr(hvm_io_accept);
+            if ( handlers[f].ops->accept(&handlers[f], p) )
+            {
+                found = &handlers[f];
+                goto scan;
+            }
+            rejected |= 1u << f;
+        }
+
+        perfc_incr(hvm_io_accept);
+        if ( handlers[i].ops->accept(&handlers[i], p) )
+        {
+            perfc_incr(hvm_io_lookup_hit);
+            hit[j] = hit[0];
+            hit[0] = i;
+            return &handlers[i];
+        }
+        rejected |= 1u << i;
+    }
+
+ scan:
+    /* Only handlers registered before one already found can take over. */
+    nr = found ? found - handlers : nr;
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( handlers[i].type != p->type || (rejected & (1u << i)) )
             continue;
 
-        if ( ops->accept(handler, p) )
-            return handler;
+        perfc_incr(hvm_io_accept);
+        if ( handlers[i].ops->accept(&handlers[i], p) )
+        {
+            found = &handlers[i];
+            break;
+        }
     }
 
-    return NULL;
+    if ( found && !found->overlaps && found - handlers != hit[0] )
+    {
+        hit[1] = hit[0];
+        hit[0] = found - handlers;
+    }
+
+    return found;
 }
 
 int hvm_io_intercept(ioreq_t *p)
@@ -279,17 +342,45 @@ struct hvm_io_handler *hvm_next_io_handler(struct domain *d)
     return &d->arch.hvm.io_handler[i];
 }
 
-void register_mmio_handler(struct domain *d,
-                           const struct hvm_mmio_ops *ops)
+struct hvm_io_handler *register_mmio_handler(struct domain *d,
+                                             const struct hvm_mmio_ops *ops)
 {
     struct hvm_io_handler *handler = hvm_next_io_handler(d);
 
     if ( handler == NULL )
-        return;
+        return NULL;
 
     handler->type = IOREQ_TYPE_COPY;
     handler->ops = &mmio_ops;
     handler->mmio.ops = ops;
+
+    return handler;
+}
+
+/*
+ * Flag a port I/O handler with a static range as overlapping if its range
+ * intersects the one of any other such handler.
+ */
+static void portio_check_overlap(const struct domain *d,
+                                 struct hvm_io_handler *handler)
+{
+    unsigned int i;
+
+    for ( i = 0; i < d->arch.hvm.io_handler_count; i++ )
+    {
+        const struct hvm_io_handler *other = &d->arch.hvm.io_handler[i];
+
+        if ( other == handler || other->type != IOREQ_TYPE_PIO ||
+             other->ops != &portio_ops )
+            continue;
+
+        if ( handler->portio.port < other->portio.port + other->portio.size &&
+             other->portio.port < handler->portio.port + handler->portio.size )
+        {
+            handler->overlaps = true;
+            break;
+        }
+    }
 }
 
 void register_portio_handler(struct domain *d, unsigned int port,
@@ -305,6 +396,8 @@ void register_portio_handler(struct domain *d, unsigned int port,
     handler->portio.port = port;
     handler->portio.size = size;
     handler->portio.action = action;
+
+    portio_check_overlap(d, handler);
 }
 
 bool relocate_portio_handler(struct domain *d, unsigned int old_port,
@@ -324,6 +417,7 @@ bool relocate_portio_handler(struct domain *d, unsigned int old_port,
              (handler->portio.size = size) )
         {
             handler->portio.port = new_port;
+            portio_check_overlap(d, handler);
             return true;
         }
     }
@@ -244,6 +244,8 @@ void register_g2m_portio_handler(struct domain *d)
 
     handler->type = IOREQ_TYPE_PIO;
     handler->ops = &g2m_portio_ops;
+    /* Ports passed through may be emulated by other handlers too. */
+    handler->overlaps = true;
 }
 
 unsigned int hvm_pci_decode_addr(unsigned int cf8, unsigned int addr,
@@ -348,6 +350,8 @@ void register_vpci_portio_handler(struct domain *d)
 
     handler->type = IOREQ_TYPE_PIO;
     handler->ops = &vpci_portio_ops;
+    /* Shares 0xcf8 with the CF8 latch of the ioreq code. */
+    handler->overlaps = true;
 }
 
 struct hvm_mmcfg {
@@ -495,7 +499,14 @@ int register_vpci_mmcfg_handler(struct domain *d, paddr_t addr,
         }
 
     if ( list_empty(&d->arch.hvm.mmcfg_regions) )
-        register_mmio_handler(d, &vpci_mmcfg_ops);
+    {
+        struct hvm_io_handler *handler =
+            register_mmio_handler(d, &vpci_mmcfg_ops);
+
+        /* The regions are reported by the hardware domain. */
+        if ( handler )
+            handler->overlaps = true;
+    }
 
     list_add(&new->next, &d->arch.hvm.mmcfg_regions);
     write_unlock(&d->arch.hvm.mmcfg_lock);
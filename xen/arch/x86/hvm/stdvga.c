@@ -514,6 +514,23 @@ static int stdvga_mem_write(const struct hvm_io_handler *handler,
     return ioreq_send(srv, &p, 1);
 }
 
+/*
+ * Multi-cycle writes of a constant (REP STOS to VRAM) can be accepted if
+ * every cycle is certain to fit in the buffered ring of the server they're
+ * going to.  Other VGA writers are serialized by s->lock, held from accept
+ * to complete, which leaves only the occasional time offset update (at most
+ * two slots per vCPU) to compete for space.  Writes sourced from memory are
+ * still rejected, as fetching the data might recurse into this handler.
+ */
+static bool stdvga_can_buffer(struct domain *d, const ioreq_t *p)
+{
+    struct ioreq_server *srv = ioreq_server_select(d, (ioreq_t *)p);
+    unsigned int slots = p->count * (p->size == 8 ? 2 : 1);
+
+    return srv && !p->data_is_ptr &&
+           ioreq_server_bufioreq_space(srv) >= slots + 2 * d->max_vcpus;
+}
+
 static bool_t stdvga_mem_accept(const struct hvm_io_handler *handler,
                                 const ioreq_t *p)
 {
@@ -530,14 +547,14 @@ static bool_t stdvga_mem_accept(const struct hvm_io_handler *handler,
 
     spin_lock(&s->lock);
 
-    if ( p->dir == IOREQ_WRITE && p->count > 1 )
+    if ( p->dir == IOREQ_WRITE && p->count > 1 &&
+         !stdvga_can_buffer(current->domain, p) )
     {
         /*
          * We cannot return X86EMUL_UNHANDLEABLE on anything other then the
-         * first cycle of an I/O. So, since we cannot guarantee to always be
-         * able to send buffered writes, we have to reject any multi-cycle
-         * I/O and, since we are rejecting an I/O, we must invalidate the
-         * cache.
+         * first cycle of an I/O. So, unless the buffered ring has room for
+         * all of the cycles, we have to reject any multi-cycle I/O and,
+         * since we are rejecting an I/O, we must invalidate the cache.
          * Single-cycle write transactions are accepted even if the cache is
          * not active since we can assert, when in stdvga mode, that writes
          * to VRAM have no side effect and thus we can try to buffer them.
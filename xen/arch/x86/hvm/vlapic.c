@@ -1637,7 +1637,14 @@ int vlapic_init(struct vcpu *v)
     tasklet_init(&vlapic->init_sipi.tasklet, vlapic_init_sipi_action, v);
 
     if ( v->vcpu_id == 0 )
-        register_mmio_handler(v->domain, &vlapic_mmio_ops);
+    {
+        struct hvm_io_handler *handler =
+            register_mmio_handler(v->domain, &vlapic_mmio_ops);
+
+        /* The guest can move the APIC base anywhere. */
+        if ( handler )
+            handler->overlaps = true;
+    }
 
     return 0;
 }
@@ -173,7 +173,7 @@ static DEFINE_RCU_READ_LOCK(msixtbl_rcu_lock);
  * device is passed through to a domain, rather than unconditionally for all
  * domains.
  */
-static bool msixtbl_initialised(const struct domain *d)
+bool msixtbl_initialised(const struct domain *d)
 {
     return d->arch.hvm.msixtbl_list.next;
 }
@@ -579,6 +579,8 @@ void msixtbl_init(struct domain *d)
     {
         handler->type = IOREQ_TYPE_COPY;
         handler->ops = &msixtbl_mmio_ops;
+        /* The tables live in BARs placed by the guest. */
+        handler->overlaps = true;
     }
 }
 
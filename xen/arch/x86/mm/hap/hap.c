@@ -589,6 +589,8 @@ void hap_teardown(struct domain *d, bool *preempted)
     ASSERT(d->is_dying);
     ASSERT(d != current->domain);
 
+    p2m_recombine_teardown(p2m_get_hostp2m(d));
+
     /* TODO - Remove when the teardown path is better structured. */
     for_each_vcpu ( d, v )
         hap_vcpu_teardown(v);
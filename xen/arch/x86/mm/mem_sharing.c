@@ -26,11 +26,13 @@
 #include <xen/spinlock.h>
 #include <xen/rwlock.h>
 #include <xen/mm.h>
+#include <xen/perfc.h>
 #include <xen/grant_table.h>
 #include <xen/sched.h>
 #include <xen/rcupdate.h>
 #include <xen/guest_access.h>
 #include <xen/vm_event.h>
+#include <xen/vmap.h>
 #include <asm/page.h>
 #include <asm/string.h>
 #include <asm/p2m.h>
@@ -1001,8 +1003,26 @@ out:
     return ret;
 }
 
+static bool pages_identical(mfn_t smfn, mfn_t cmfn)
+{
+    const void *s = map_domain_page(smfn);
+    const void *c = map_domain_page(cmfn);
+    bool same = !memcmp(s, c, PAGE_SIZE);
+
+    unmap_domain_page(c);
+    unmap_domain_page(s);
+
+    return same;
+}
+
+/*
+ * With verify set, the pages are only shared if their contents match, and
+ * -EILSEQ is returned otherwise.  Nominated pages are read-only, so the
+ * contents can't change anymore once both are locked.
+ */
 static int share_pages(struct domain *sd, gfn_t sgfn, shr_handle_t sh,
-                       struct domain *cd, gfn_t cgfn, shr_handle_t ch)
+                       struct domain *cd, gfn_t cgfn, shr_handle_t ch,
+                       bool verify)
 {
     struct page_info *spage, *cpage, *firstpg, *secondpg;
     gfn_info_t *gfn;
@@ -1085,6 +1105,14 @@ static int share_pages(struct domain *sd, gfn_t sgfn, shr_handle_t sh,
         goto err_out;
     }
 
+    if ( verify && !pages_identical(smfn, cmfn) )
+    {
+        ret = -EILSEQ;
+        mem_sharing_page_unlock(secondpg);
+        mem_sharing_page_unlock(firstpg);
+        goto err_out;
+    }
+
     /* Merge the lists together */
     rmap_seed_iterator(cpage, &ri);
     while ( (gfn = rmap_iterate(cpage, &ri)) != NULL)
@@ -1490,7 +1518,8 @@ static int range_share(struct domain *d, struct domain *cd,
             if ( !rc )
             {
                 /* If we get here this should be guaranteed to succeed. */
-                rc = share_pages(d, _gfn(start), sh, cd, _gfn(start), ch);
+                rc = share_pages(d, _gfn(start), sh, cd, _gfn(start), ch,
+                                 false);
                 ASSERT(!rc);
             }
         }
@@ -1515,6 +1544,53 @@ static int range_share(struct domain *d, struct domain *cd,
     return rc;
 }
 
+/*
+ * Nominate and share a list of gfn pairs, e.g. as found to have identical
+ * contents by a deduplication scanner in the toolstack.  Unlike with
+ * range_share() failure for individual pairs is expected, and reported back
+ * per pair.  Returns 1 when a continuation is needed.
+ */
+static int batch_share(struct domain *d, struct domain *cd,
+                       struct mem_sharing_op_batch *batch)
+{
+    XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_pair_t) pairs =
+        guest_handle_cast(batch->pairs, xen_mem_sharing_pair_t);
+    bool verify = batch->flags & XENMEM_SHARING_BATCH_VERIFY;
+
+    while ( batch->opaque < batch->nr )
+    {
+        xen_mem_sharing_pair_t pair;
+        shr_handle_t sh, ch;
+
+        if ( copy_from_guest_offset(&pair, pairs, batch->opaque, 1) )
+            return -EFAULT;
+
+        if ( pair._pad )
+            pair.rc = -EINVAL;
+        else if ( !(pair.rc = nominate_page(d, _gfn(pair.source_gfn), 0,
+                                            false, &sh)) &&
+                  !(pair.rc = nominate_page(cd, _gfn(pair.client_gfn), 0,
+                                            false, &ch)) )
+            pair.rc = share_pages(d, _gfn(pair.source_gfn), sh,
+                                  cd, _gfn(pair.client_gfn), ch, verify);
+
+        if ( copy_to_guest_offset(pairs, batch->opaque, &pair, 1) )
+            return -EFAULT;
+
+        /*
+         * Without memory for sharing metadata there's no point going on.
+         * Leave opaque at the failing pair, for it to be reported back.
+         */
+        if ( pair.rc == -ENOMEM )
+            return -ENOMEM;
+
+        if ( ++batch->opaque < batch->nr && hypercall_preempt_check() )
+            return 1;
+    }
+
+    return 0;
+}
+
 static inline int mem_sharing_control(struct domain *d, bool enable,
                                       uint16_t flags)
 {
@@ -1535,6 +1611,34 @@ static inline int mem_sharing_control(struct domain *d, bool enable,
     return 0;
 }
 
+/*
+ * Find the closest ancestor of a fork having regular RAM at gfn.  Returns the
+ * mfn with the ancestor's gfn held (to be dropped with put_gfn(*pd, gfn)), or
+ * INVALID_MFN.
+ */
+static mfn_t get_parent_ram(const struct domain *d, unsigned long gfn,
+                            struct domain **pd)
+{
+    struct domain *parent;
+
+    for ( parent = d->parent; parent; parent = parent->parent )
+    {
+        p2m_type_t p2mt;
+        mfn_t mfn = get_gfn_query(parent, gfn, &p2mt);
+
+        /* We can't fork grant memory from the parent, only regular ram */
+        if ( mfn_valid(mfn) && p2m_is_ram(p2mt) )
+        {
+            *pd = parent;
+            return mfn;
+        }
+
+        put_gfn(parent, gfn);
+    }
+
+    return INVALID_MFN;
+}
+
 /*
  * Forking a page only gets called when the VM faults due to no entry being
  * in the EPT for the access. Depending on the type of access we either
@@ -1552,7 +1656,6 @@ int mem_sharing_fork_page(struct domain *d, gfn_t gfn, bool unsharing)
     struct p2m_domain *p2m;
     unsigned long gfn_l = gfn_x(gfn);
     mfn_t mfn, new_mfn;
-    p2m_type_t p2mt;
     struct page_info *page;
 
     if ( !mem_sharing_is_fork(d) )
@@ -1579,7 +1682,10 @@ int mem_sharing_fork_page(struct domain *d, gfn_t gfn, bool unsharing)
             p2m_unlock(p2m);
 
             if ( !rc )
+            {
+                perfc_incr(fork_page_shared);
                 return 0;
+            }
         }
     }
 
@@ -1588,21 +1694,9 @@ int mem_sharing_fork_page(struct domain *d, gfn_t gfn, bool unsharing)
      * the physmap failed we'll fork the page directly.
      */
     p2m = p2m_get_hostp2m(d);
-    parent = d->parent;
-
-    while ( parent )
-    {
-        mfn = get_gfn_query(parent, gfn_l, &p2mt);
-
-        /* We can't fork grant memory from the parent, only regular ram */
-        if ( mfn_valid(mfn) && p2m_is_ram(p2mt) )
-            break;
-
-        put_gfn(parent, gfn_l);
-        parent = parent->parent;
-    }
 
-    if ( !parent )
+    mfn = get_parent_ram(d, gfn_l, &parent);
+    if ( mfn_eq(mfn, INVALID_MFN) )
         return -ENOENT;
 
     if ( !(page = alloc_domheap_page(d, 0)) )
@@ -1617,10 +1711,64 @@ int mem_sharing_fork_page(struct domain *d, gfn_t gfn, bool unsharing)
 
     put_gfn(parent, gfn_l);
 
+    perfc_incr(fork_page_copied);
+
     return p2m->set_entry(p2m, gfn, new_mfn, PAGE_ORDER_4K, p2m_ram_rw,
                           p2m->default_access, -1);
 }
 
+/*
+ * Populate a range of a fork's memory up front, rather than one fault at a
+ * time: either with shared entries, or with private copies of the parent's
+ * pages.  Gfns already populated, or without RAM in any ancestor, are
+ * skipped, as is anything above the highest gfn mapped in any ancestor.
+ * Returns 1 when a continuation is needed.
+ */
+static int fork_populate(struct domain *d,
+                         struct mem_sharing_op_fork_populate *populate)
+{
+    bool private = populate->flags & XENMEM_FORK_POPULATE_PRIVATE;
+    unsigned long gfn = populate->opaque ?: populate->first_gfn;
+    unsigned long last_gfn = 0;
+    struct domain *parent;
+    int rc = 0;
+
+    for ( parent = d->parent; parent; parent = parent->parent )
+        last_gfn = max(last_gfn, domain_get_maximum_gpfn(parent));
+    last_gfn = min_t(unsigned long, last_gfn, populate->last_gfn);
+
+    if ( gfn > last_gfn )
+        return 0;
+
+    for ( ; ; )
+    {
+        p2m_type_t p2mt;
+
+        get_gfn_query(d, gfn, &p2mt);
+        if ( p2m_is_hole(p2mt) )
+            rc = mem_sharing_fork_page(d, _gfn(gfn), private);
+        put_gfn(d, gfn);
+
+        if ( rc == -ENOENT )
+            rc = 0;
+        else if ( rc )
+            break;
+
+        if ( gfn++ == last_gfn )
+            break;
+
+        if ( hypercall_preempt_check() )
+        {
+            rc = 1;
+            break;
+        }
+    }
+
+    populate->opaque = gfn;
+
+    return rc;
+}
+
 static int bring_up_vcpus(struct domain *cd, struct domain *d)
 {
     unsigned int i;
@@ -1869,32 +2017,94 @@ static int fork(struct domain *cd, struct domain *d)
     return rc;
 }
 
+/*
+ * Restore a page the fork populated to the contents of the parent's, leaving
+ * the page in place.  Returns false if the page needs to be dropped instead.
+ */
+static bool fork_restore_page(struct domain *d, gfn_t gfn, mfn_t mfn)
+{
+    struct domain *pd;
+    mfn_t pmfn = get_parent_ram(d, gfn_x(gfn), &pd);
+
+    if ( mfn_eq(pmfn, INVALID_MFN) )
+        return false;
+
+    copy_domain_page(mfn, pmfn);
+    put_gfn(pd, gfn_x(gfn));
+
+    perfc_incr(fork_reset_restored);
+
+    return true;
+}
+
 /*
  * The fork reset operation is intended to be used on short-lived forks only.
  * There is no hypercall continuation operation implemented for this reason.
  * For forks that obtain a larger memory footprint it is likely going to be
  * more performant to create a new fork instead of resetting an existing one.
  *
+ * The pages looked at are only the ones the fork got private copies of, i.e.
+ * the ones it wrote to (or had populated as private).  By default these get
+ * freed, to be populated again on the next access.  With restore set their
+ * contents get copied back from the parent instead, sparing the p2m updates
+ * and TLB flushes now and the faults and allocations for pages which are
+ * likely to be written to again after the reset.
+ *
  * TODO: In case this hypercall would become useful on forks with larger memory
  * footprints the hypercall continuation should be implemented (or if this
  * feature needs to be become "stable").
  */
-static int mem_sharing_fork_reset(struct domain *d)
+static int mem_sharing_fork_reset(struct domain *d, bool restore)
 {
-    int rc;
+    int rc = 0;
     struct domain *pd = d->parent;
     struct p2m_domain *p2m = p2m_get_hostp2m(d);
-    struct page_info *page, *tmp;
+    struct page_info *page;
+    unsigned long *gfns = NULL;
+    unsigned int i, nr, count = 0;
 
     domain_pause(d);
 
-    /* need recursive lock because we will free pages */
-    spin_lock_recursive(&d->page_alloc_lock);
-    page_list_for_each_safe(page, tmp, &d->page_list)
+    /*
+     * Restoring a page takes the parent's gfn lock, which has to nest outside
+     * of page_alloc_lock (see mm-locks.h).  Hence only collect the gfns of the
+     * fork's pages with page_alloc_lock held, and look at them once it was
+     * dropped.  The array is sized from tot_pages before taking the lock, so
+     * retry in the unlikely event of the fork having gained pages meanwhile.
+     */
+    for ( ; ; )
+    {
+        nr = d->tot_pages;
+        if ( nr && !(gfns = vmalloc(nr * sizeof(*gfns))) )
+        {
+            rc = -ENOMEM;
+            goto out;
+        }
+
+        spin_lock(&d->page_alloc_lock);
+        if ( d->tot_pages <= nr )
+            break;
+        spin_unlock(&d->page_alloc_lock);
+
+        vfree(gfns);
+        gfns = NULL;
+    }
+
+    page_list_for_each(page, &d->page_list)
+    {
+        gfn_t gfn = mfn_to_gfn(d, page_to_mfn(page));
+
+        if ( !gfn_eq(gfn, INVALID_GFN) && count < nr )
+            gfns[count++] = gfn_x(gfn);
+    }
+    spin_unlock(&d->page_alloc_lock);
+
+    for ( i = 0; i < count; i++ )
     {
         shr_handle_t sh;
-        mfn_t mfn = page_to_mfn(page);
-        gfn_t gfn = mfn_to_gfn(d, mfn);
+        p2m_type_t p2mt;
+        gfn_t gfn = _gfn(gfns[i]);
+        mfn_t mfn = get_gfn_query(d, gfn_x(gfn), &p2mt);
 
         /*
          * We only want to remove pages from the fork here that were copied
@@ -1907,8 +2117,14 @@ static int mem_sharing_fork_reset(struct domain *d)
          * nominate_page. In case the page is already shared (ie. a share
          * handle is returned) then we don't remove it.
          */
-        if ( (rc = nominate_page(d, gfn, 0, true, &sh)) || sh )
+        if ( nominate_page(d, gfn, 0, true, &sh) || sh ||
+             (restore && fork_restore_page(d, gfn, mfn)) )
+        {
+            put_gfn(d, gfn_x(gfn));
             continue;
+        }
+
+        page = mfn_to_page(mfn);
 
         /* forked memory is 4k, not splitting large pages so this must work */
         rc = p2m->set_entry(p2m, gfn, INVALID_MFN, PAGE_ORDER_4K,
@@ -1917,11 +2133,16 @@ static int mem_sharing_fork_reset(struct domain *d)
 
         put_page_alloc_ref(page);
         put_page_and_type(page);
+        put_gfn(d, gfn_x(gfn));
+
+        perfc_incr(fork_reset_freed);
     }
-    spin_unlock_recursive(&d->page_alloc_lock);
+
+    vfree(gfns);
 
     rc = copy_settings(d, pd);
 
+ out:
     domain_unpause(d);
 
     return rc;
@@ -2038,7 +2259,7 @@ int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
         sh = mso.u.share.source_handle;
         ch = mso.u.share.client_handle;
 
-        rc = share_pages(d, sgfn, sh, cd, cgfn, ch);
+        rc = share_pages(d, sgfn, sh, cd, cgfn, ch, false);
 
         rcu_unlock_domain(cd);
     }
@@ -2174,6 +2395,60 @@ int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
     }
     break;
 
+    case XENMEM_sharing_op_batch_share:
+    {
+        struct domain *cd;
+
+        rc = -EINVAL;
+        if ( mso.u.batch._pad ||
+             (mso.u.batch.flags & ~XENMEM_SHARING_BATCH_VERIFY) ||
+             mso.u.batch.opaque > mso.u.batch.nr )
+            goto out;
+
+        rc = rcu_lock_live_remote_domain_by_id(mso.u.batch.client_domain,
+                                               &cd);
+        if ( rc )
+            goto out;
+
+        /* Like range_share, this is XENMEM_sharing_op_share repeated. */
+        rc = xsm_mem_sharing_op(XSM_DM_PRIV, d, cd,
+                                XENMEM_sharing_op_share);
+        if ( rc )
+        {
+            rcu_unlock_domain(cd);
+            goto out;
+        }
+
+        if ( !mem_sharing_enabled(cd) )
+        {
+            rcu_unlock_domain(cd);
+            rc = -EINVAL;
+            goto out;
+        }
+
+        rc = batch_share(d, cd, &mso.u.batch);
+        rcu_unlock_domain(cd);
+
+        if ( rc > 0 )
+        {
+            if ( __copy_to_guest(arg, &mso, 1) )
+                rc = -EFAULT;
+            else
+                rc = hypercall_create_continuation(__HYPERVISOR_memory_op,
+                                                   "lh", XENMEM_sharing_op,
+                                                   arg);
+        }
+        else if ( rc == -ENOMEM )
+        {
+            /* Report the index of the failing pair. */
+            if ( __copy_to_guest(arg, &mso, 1) )
+                rc = -EFAULT;
+        }
+        else
+            mso.u.batch.opaque = 0;
+    }
+    break;
+
     case XENMEM_sharing_op_debug_gfn:
         rc = debug_gfn(d, _gfn(mso.u.debug.u.gfn));
         break;
@@ -2228,14 +2503,50 @@ int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
     case XENMEM_sharing_op_fork_reset:
     {
         rc = -EINVAL;
-        if ( mso.u.fork.pad || mso.u.fork.flags )
+        if ( mso.u.fork.pad ||
+             (mso.u.fork.flags & ~XENMEM_FORK_RESET_RESTORE) )
             goto out;
 
         rc = -ENOSYS;
         if ( !d->parent )
             goto out;
 
-        rc = mem_sharing_fork_reset(d);
+        rc = mem_sharing_fork_reset(d, mso.u.fork.flags &
+                                       XENMEM_FORK_RESET_RESTORE);
+        break;
+    }
+
+    case XENMEM_sharing_op_fork_populate:
+    {
+        rc = -EINVAL;
+        if ( mso.u.populate.pad ||
+             (mso.u.populate.flags & ~XENMEM_FORK_POPULATE_PRIVATE) ||
+             mso.u.populate.first_gfn > mso.u.populate.last_gfn )
+            goto out;
+
+        /* opaque is the continuation value, see range_share. */
+        if ( mso.u.populate.opaque &&
+             (mso.u.populate.opaque < mso.u.populate.first_gfn ||
+              mso.u.populate.opaque > mso.u.populate.last_gfn) )
+            goto out;
+
+        rc = -ENOSYS;
+        if ( !d->parent )
+            goto out;
+
+        rc = fork_populate(d, &mso.u.populate);
+
+        if ( rc > 0 )
+        {
+            if ( __copy_to_guest(arg, &mso, 1) )
+                rc = -EFAULT;
+            else
+                rc = hypercall_create_continuation(__HYPERVISOR_memory_op,
+                                                   "lh", XENMEM_sharing_op,
+                                                   arg);
+        }
+        else
+            mso.u.populate.opaque = 0;
         break;
     }
 
@@ -454,6 +454,7 @@ static int ept_invalidate_emt_range(struct p2m_domain *p2m,
         }
         wrc = atomic_write_ept_entry(p2m, &table[index], split_ept_entry, i);
         ASSERT(wrc == 0);
+        p2m_superpage_split(p2m);
 
         for ( ; i > target; --i )
             if ( ept_next_level(p2m, 1, &table, &gfn_remainder, i) !=
@@ -903,6 +904,7 @@ ept_set_entry(struct p2m_domain *p2m, gfn_t gfn_, mfn_t mfn,
         /* NB: please make sure domian is paused and no in-fly VT-d DMA. */
         rc = atomic_write_ept_entry(p2m, ept_entry, split_ept_entry, i);
         ASSERT(rc == 0);
+        p2m_superpage_split(p2m);
 
         /* then move to the level we want to make real changes */
         for ( ; i > target; i-- )
@@ -973,10 +975,11 @@ out:
          need_modify_vtd_table )
     {
         if ( iommu_use_hap_pt(d) && !this_cpu(iommu_dont_flush_iotlb) )
-            rc = iommu_iotlb_flush(d, _dfn(gfn), 1ul << order,
-                                   (iommu_flags ? IOMMU_FLUSHF_added : 0) |
-                                   (vtd_pte_present ? IOMMU_FLUSHF_modified
-                                                    : 0));
+            rc = iommu_iotlb_flush_gather(d, _dfn(gfn), 1ul << order,
+                                          (iommu_flags ? IOMMU_FLUSHF_added
+                                                       : 0) |
+                                          (vtd_pte_present
+                                           ? IOMMU_FLUSHF_modified : 0));
         else if ( need_iommu_pt_sync(d) )
             rc = iommu_flags ?
                 iommu_legacy_map(d, _dfn(gfn), mfn, 1ul << order, iommu_flags) :
@@ -19,10 +19,14 @@
  * along with this program; If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <xen/cpu.h>
 #include <xen/event.h>
 #include <xen/ioreq.h>
 #include <xen/mm.h>
+#include <xen/numa.h>
+#include <xen/perfc.h>
 #include <xen/sched.h>
+#include <xen/softirq.h>
 #include <xen/trace.h>
 #include <asm/hvm/nestedhvm.h>
 #include <asm/page.h>
@@ -131,11 +135,72 @@ p2m_pod_cache_add(struct p2m_domain *p2m,
     return 0;
 }
 
+/* How far into a cache list to look for a page on the preferred node. */
+#define POD_NODE_SCAN 16
+
+/*
+ * Take a page off a cache list, preferring one on the given node.  Only the
+ * first few entries are looked at, to bound the time spent under the lock.
+ */
+static struct page_info *pod_list_get(struct page_list_head *list,
+                                      nodeid_t node)
+{
+    struct page_info *p;
+    unsigned int n = 0;
+
+    if ( node != NUMA_NO_NODE )
+        page_list_for_each ( p, list )
+        {
+            if ( phys_to_nid(page_to_maddr(p)) == node )
+            {
+                page_list_del(p, list);
+                perfc_incr(pod_cache_node_hit);
+                return p;
+            }
+            if ( ++n >= POD_NODE_SCAN )
+                break;
+        }
+
+    return page_list_remove_head(list);
+}
+
+/*
+ * The host node backing the virtual NUMA node of the guest memory at gfn,
+ * or NUMA_NO_NODE if the domain has no vNUMA topology covering it.
+ */
+static nodeid_t pod_gfn_to_node(struct domain *d, gfn_t gfn)
+{
+    nodeid_t node = NUMA_NO_NODE;
+    paddr_t addr = gfn_to_gaddr(gfn);
+    unsigned int i;
+
+    read_lock(&d->vnuma_rwlock);
+
+    if ( d->vnuma )
+        for ( i = 0; i < d->vnuma->nr_vmemranges; i++ )
+        {
+            const struct xen_vmemrange *r = &d->vnuma->vmemrange[i];
+
+            if ( addr >= r->start && addr < r->end )
+            {
+                if ( r->nid < d->vnuma->nr_vnodes )
+                    node = d->vnuma->vnode_to_pnode[r->nid];
+                break;
+            }
+        }
+
+    read_unlock(&d->vnuma_rwlock);
+
+    return node;
+}
+
 /* Get a page of size order from the populate-on-demand cache.  Will break
  * down 2-meg pages into singleton pages automatically.  Returns null if
- * a superpage is requested and no superpages are available. */
+ * a superpage is requested and no superpages are available.  Pages on
+ * host node 'node' are preferred, unless it is NUMA_NO_NODE. */
 static struct page_info * p2m_pod_cache_get(struct p2m_domain *p2m,
-                                            unsigned int order)
+                                            unsigned int order,
+                                            nodeid_t node)
 {
     struct page_info *p = NULL;
     unsigned long i;
@@ -157,7 +222,7 @@ static struct page_info * p2m_pod_cache_get(struct p2m_domain *p2m,
          * Break up a superpage to make single pages. NB count doesn't
          * need to be adjusted.
          */
-        p = page_list_remove_head(&p2m->pod.super);
+        p = pod_list_get(&p2m->pod.super, node);
         mfn = mfn_x(page_to_mfn(p));
 
         for ( i = 0; i < SUPERPAGE_PAGES; i++ )
@@ -171,12 +236,12 @@ static struct page_info * p2m_pod_cache_get(struct p2m_domain *p2m,
     {
     case PAGE_ORDER_2M:
         BUG_ON( page_list_empty(&p2m->pod.super) );
-        p = page_list_remove_head(&p2m->pod.super);
+        p = pod_list_get(&p2m->pod.super, node);
         p2m->pod.count -= 1UL << order;
         break;
     case PAGE_ORDER_4K:
         BUG_ON( page_list_empty(&p2m->pod.single) );
-        p = page_list_remove_head(&p2m->pod.single);
+        p = pod_list_get(&p2m->pod.single, node);
         p2m->pod.count -= 1UL;
         break;
     default:
@@ -258,7 +323,7 @@ p2m_pod_set_cache_target(struct p2m_domain *p2m, unsigned long pod_target, int p
         else
             order = PAGE_ORDER_4K;
 
-        page = p2m_pod_cache_get(p2m, order);
+        page = p2m_pod_cache_get(p2m, order, NUMA_NO_NODE);
 
         ASSERT(page != NULL);
 
@@ -380,6 +445,7 @@ int p2m_pod_empty_cache(struct domain *d)
 
     /* After this barrier no new PoD activities can happen. */
     BUG_ON(!d->is_dying);
+    tasklet_kill(&p2m->pod.sweep);
     spin_barrier(&p2m->pod.lock.lock);
 
     lock_page_alloc(p2m);
@@ -688,6 +754,25 @@ void p2m_pod_dump_data(struct domain *d)
 }
 
 
+/*
+ * Full check of a mapped page for being all zero.  The words of a cache line
+ * are OR-ed together before testing, so there's only one (well predicted)
+ * branch per line rather than one per word.
+ */
+static bool pod_page_is_zero(const unsigned long *map)
+{
+    unsigned int i;
+
+    BUILD_BUG_ON((PAGE_SIZE / sizeof(*map)) % 8);
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*map); i += 8 )
+        if ( map[i] | map[i + 1] | map[i + 2] | map[i + 3] |
+             map[i + 4] | map[i + 5] | map[i + 6] | map[i + 7] )
+            return false;
+
+    return true;
+}
+
 /*
  * Search for all-zero superpages to be reclaimed as superpages for the
  * PoD cache. Must be called w/ pod lock held, must lock the superpage
@@ -812,12 +897,8 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, gfn_t gfn)
     {
         map = map_domain_page(mfn_add(mfn0, i));
 
-        for ( j = 0; j < (PAGE_SIZE / sizeof(*map)); j++ )
-            if ( *(map+j) != 0 )
-            {
-                reset = 1;
-                break;
-            }
+        if ( !pod_page_is_zero(map) )
+            reset = 1;
 
         unmap_domain_page(map);
 
@@ -962,12 +1043,12 @@ p2m_pod_zero_check(struct p2m_domain *p2m, const gfn_t *gfns, unsigned int count
     /* Now check each page for real */
     for ( i = 0; i < count; i++ )
     {
+        bool zero;
+
         if ( !map[i] )
             continue;
 
-        for ( j = 0; j < (PAGE_SIZE / sizeof(*map[i])); j++ )
-            if ( *(map[i] + j) != 0 )
-                break;
+        zero = pod_page_is_zero(map[i]);
 
         unmap_domain_page(map[i]);
 
@@ -977,7 +1058,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, const gfn_t *gfns, unsigned int count
          * See comment in p2m_pod_zero_check_superpage() re gnttab
          * check timing.
          */
-        if ( j < (PAGE_SIZE / sizeof(*map[i])) )
+        if ( !zero )
         {
             /*
              * If the previous p2m_set_entry call succeeded, this one shouldn't
@@ -1035,6 +1116,7 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
     unsigned long i, j = 0, start, limit;
     p2m_type_t t;
 
+    perfc_incr(pod_sweep_emergency);
 
     if ( gfn_eq(p2m->pod.reclaim_single, _gfn(0)) )
         p2m->pod.reclaim_single = p2m->pod.max_guest;
@@ -1083,6 +1165,137 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
 
 }
 
+/*
+ * Watermarks for the background sweep: it gets kicked by a fault finding
+ * fewer than POD_SWEEP_LOW pages in the cache, and keeps going until there
+ * are POD_SWEEP_HIGH (or no more PoD entries to back).
+ */
+#define POD_SWEEP_LOW   SUPERPAGE_PAGES
+#define POD_SWEEP_HIGH  (4 * SUPERPAGE_PAGES)
+
+static bool pod_sweep_wanted(const struct p2m_domain *p2m, long watermark)
+{
+    return p2m->pod.count < watermark &&
+           p2m->pod.entry_count > p2m->pod.count;
+}
+
+/*
+ * Run the sweep on some other CPU, preferably an idle one, rather than in
+ * place of the vCPU which just faulted.  The check for idleness is racy, but
+ * merely a hint.  Without the CPU maps, e.g. while a CPU is going offline,
+ * fall back to the local CPU.
+ */
+static void pod_sweep_schedule(struct p2m_domain *p2m)
+{
+    unsigned int this_cpu = smp_processor_id(), cpu = this_cpu, target;
+
+    if ( !get_cpu_maps() )
+    {
+        tasklet_schedule(&p2m->pod.sweep);
+        return;
+    }
+
+    target = cpumask_cycle(this_cpu, &cpu_online_map);
+
+    while ( (cpu = cpumask_cycle(cpu, &cpu_online_map)) != this_cpu )
+        if ( get_cpu_current(cpu) == idle_vcpu[cpu] )
+        {
+            target = cpu;
+            break;
+        }
+
+    tasklet_schedule_on_cpu(&p2m->pod.sweep, target);
+
+    put_cpu_maps();
+}
+
+/* gfns scanned by the background sweep per p2m / PoD lock hold. */
+#define POD_SWEEP_BATCH 128
+
+/*
+ * Background counterpart of p2m_pod_emergency_sweep(), run as a tasklet in
+ * idle vCPU context so that guest faults only rarely find the cache empty.
+ * Each run scans at most POD_SWEEP_LIMIT gfns, continuing where the previous
+ * scan (background or emergency) stopped, and re-schedules itself as long as
+ * it is making progress and the cache is still below the high watermark.
+ * The locks are dropped every POD_SWEEP_BATCH gfns, for the guest's faults
+ * not to wait for a whole run.
+ */
+static void p2m_pod_background_sweep(void *data)
+{
+    struct p2m_domain *p2m = data;
+    gfn_t gfns[POD_SWEEP_STRIDE];
+    long reclaimed = 0;
+    unsigned int n;
+    bool more = true;
+
+    for ( n = 0; more && n < POD_SWEEP_LIMIT / POD_SWEEP_BATCH; n++ )
+    {
+        unsigned long i, j = 0, limit;
+        long count;
+        p2m_type_t t;
+
+        p2m_lock(p2m);
+        pod_lock(p2m);
+
+        /* See p2m_pod_demand_populate() for the is_dying check. */
+        if ( unlikely(p2m->domain->is_dying) ||
+             !pod_sweep_wanted(p2m, POD_SWEEP_HIGH) )
+        {
+            pod_unlock(p2m);
+            p2m_unlock(p2m);
+            more = false;
+            break;
+        }
+
+        if ( !n )
+            perfc_incr(pod_sweep_background);
+        count = p2m->pod.count;
+
+        if ( gfn_eq(p2m->pod.reclaim_single, _gfn(0)) )
+            p2m->pod.reclaim_single = p2m->pod.max_guest;
+
+        i = gfn_x(p2m->pod.reclaim_single);
+        limit = (i > POD_SWEEP_BATCH) ? (i - POD_SWEEP_BATCH) : 0;
+
+        for ( ; i > limit; i-- )
+        {
+            p2m_access_t a;
+
+            (void)p2m->get_entry(p2m, _gfn(i), &t, &a, 0, NULL, NULL);
+            if ( !p2m_is_ram(t) )
+                continue;
+
+            gfns[j++] = _gfn(i);
+            if ( j == POD_SWEEP_STRIDE )
+            {
+                p2m_pod_zero_check(p2m, gfns, j);
+                j = 0;
+                if ( !pod_sweep_wanted(p2m, POD_SWEEP_HIGH) )
+                    break;
+            }
+        }
+
+        if ( j )
+            p2m_pod_zero_check(p2m, gfns, j);
+
+        p2m->pod.reclaim_single = _gfn(i ? i - 1 : i);
+
+        reclaimed += p2m->pod.count - count;
+        more = pod_sweep_wanted(p2m, POD_SWEEP_HIGH);
+
+        pod_unlock(p2m);
+        p2m_unlock(p2m);
+
+        process_pending_softirqs();
+    }
+
+    perfc_add(pod_sweep_reclaimed, reclaimed);
+
+    if ( more && reclaimed > 0 )
+        pod_sweep_schedule(p2m);
+}
+
 static void pod_eager_reclaim(struct p2m_domain *p2m)
 {
     struct pod_mrp_list *mrp = &p2m->pod.mrp;
@@ -1202,7 +1415,8 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, gfn_t gfn,
      * Get a page f/ the cache.  A NULL return value indicates that the
      * 2-meg range should be marked singleton PoD, and retried.
      */
-    if ( (p = p2m_pod_cache_get(p2m, order)) == NULL )
+    if ( (p = p2m_pod_cache_get(p2m, order,
+                                pod_gfn_to_node(d, gfn_aligned))) == NULL )
         goto remap_and_retry;
 
     mfn = page_to_mfn(p);
@@ -1227,6 +1441,10 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, gfn_t gfn,
 
     pod_eager_record(p2m, gfn_aligned, order);
 
+    /* Refill the cache before the next fault finds it empty. */
+    if ( pod_sweep_wanted(p2m, POD_SWEEP_LOW) )
+        pod_sweep_schedule(p2m);
+
     if ( tb_init_done )
     {
         struct {
@@ -1355,6 +1573,7 @@ void p2m_pod_init(struct p2m_domain *p2m)
     mm_lock_init(&p2m->pod.lock);
     INIT_PAGE_LIST_HEAD(&p2m->pod.super);
     INIT_PAGE_LIST_HEAD(&p2m->pod.single);
+    tasklet_init(&p2m->pod.sweep, p2m_pod_background_sweep, p2m);
 
     for ( i = 0; i < ARRAY_SIZE(p2m->pod.mrp.list); ++i )
         p2m->pod.mrp.list[i] = gfn_x(INVALID_GFN);
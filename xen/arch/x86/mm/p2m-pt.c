@@ -306,6 +306,8 @@ p2m_next_level(struct p2m_domain *p2m, void **table,
         rc = write_p2m_entry(p2m, gfn, p2m_entry, new_entry, level + 1);
         if ( rc )
             goto error;
+
+        p2m_superpage_split(p2m);
     }
     else
         ASSERT(flags & _PAGE_PRESENT);
@@ -0,0 +1,368 @@
+/******************************************************************************
+ * arch/x86/mm/p2m-recombine.c
+ *
+ * Background recombination of shattered p2m superpages.
+ *
+ * Once a 2M or 1G mapping has been split (for log-dirty tracking, ballooning,
+ * changes of access rights, ...) nothing merges it back again, leaving the
+ * guest with reduced TLB reach long after the reason for the split has gone
+ * away.  For HAP guests a per-domain scanner walks the host p2m in the
+ * background and restores superpage mappings for every aligned range that
+ * is uniformly mapped as ordinary RAM:
+ *  - ranges already backed by suitably aligned contiguous memory are simply
+ *    re-mapped with a single entry (2M and 1G),
+ *  - otherwise, for 2M ranges, the contents are moved to freshly allocated
+ *    contiguous memory with the domain briefly paused.
+ * The scanner needs enabling with the "p2m-recombine" command line option.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <xen/domain_page.h>
+#include <xen/ioreq.h>
+#include <xen/iommu.h>
+#include <xen/mm.h>
+#include <xen/param.h>
+#include <xen/perfc.h>
+#include <xen/rangeset.h>
+#include <xen/sched.h>
+#include <xen/softirq.h>
+#include <asm/altp2m.h>
+#include <asm/mem_sharing.h>
+#include <asm/p2m.h>
+
+#include "mm-locks.h"
+
+static bool __read_mostly opt_p2m_recombine;
+boolean_param("p2m-recombine", opt_p2m_recombine);
+
+/* Interval between batches while a pass is in progress. */
+#define RECOMBINE_BATCH_DELAY   MILLISECS(10)
+/* Interval between checks whether a new pass is needed. */
+#define RECOMBINE_IDLE_DELAY    SECONDS(1)
+/* Start a new pass at least this often (in idle checks), even without splits. */
+#define RECOMBINE_IDLE_PASSES   60
+/* 2M ranges looked at per batch. */
+#define RECOMBINE_BATCH         64
+/* Minimum interval between pausing the domain to move a range. */
+#define RECOMBINE_COPY_DELAY    MILLISECS(100)
+
+/* Cheap checks, suitable for timer context. */
+static bool recombine_possible(const struct domain *d)
+{
+    return d->creation_finished && !d->is_dying &&
+           !paging_mode_log_dirty(d) && !altp2m_active(d) &&
+           !mem_sharing_enabled(d);
+}
+
+static bool recombine_allowed(const struct domain *d)
+{
+    return opt_p2m_recombine && hap_has_2mb && recombine_possible(d);
+}
+
+/*
+ * Try to map [gfn, gfn + 2^order) with a single entry.  Returns 1 when a
+ * superpage mapping got established, 0 when the range isn't eligible and
+ * -EAGAIN when it would be with new backing.  The latter is only considered
+ * for 2M ranges when a buffer for the old mfns is supplied, and only put in
+ * place when *pg is non-NULL (and the domain paused).  *pg is consumed on
+ * success.
+ */
+static int recombine(struct p2m_domain *p2m, gfn_t gfn, unsigned int order,
+                     struct page_info **pg, mfn_t *old)
+{
+    struct domain *d = p2m->domain;
+    unsigned long i, n, nr = 1UL << order;
+    mfn_t mfn, mfn0 = INVALID_MFN;
+    bool contig = true;
+    int rc = 0;
+
+    gfn_lock(p2m, gfn, order);
+
+    if ( rangeset_overlaps_range(p2m->logdirty_ranges, gfn_x(gfn),
+                                 gfn_x(gfn) + nr - 1) )
+        goto out;
+
+    for ( i = 0; i < nr; i += n )
+    {
+        p2m_type_t t;
+        p2m_access_t a;
+        unsigned int cur_order;
+
+        mfn = p2m->get_entry(p2m, gfn_add(gfn, i), &t, &a, 0, &cur_order,
+                             NULL);
+
+        /* Only plain RAM, and nothing that's already mapped this way. */
+        if ( t != p2m_ram_rw || a != p2m->default_access ||
+             cur_order >= order )
+            goto out;
+
+        n = 1UL << cur_order;
+        if ( i == 0 )
+            mfn0 = mfn;
+        else if ( !mfn_eq(mfn, mfn_add(mfn0, i)) )
+            contig = false;
+    }
+
+    if ( contig && IS_ALIGNED(mfn_x(mfn0), nr) )
+    {
+        if ( p2m_set_entry(p2m, gfn, mfn0, order, p2m_ram_rw,
+                           p2m->default_access) )
+            goto out;
+
+        p2m->recombine.promoted[order == PAGE_ORDER_1G]++;
+        perfc_incr(p2m_recombine_remap);
+        rc = 1;
+        goto out;
+    }
+
+    if ( order != PAGE_ORDER_2M || !old )
+        goto out;
+
+    /*
+     * The pages can only be moved if nothing but the p2m refers to them.
+     * With the p2m write-locked and the domain paused, no new references
+     * can be obtained.
+     */
+    for ( i = 0; i < nr; i++ )
+    {
+        const struct page_info *page;
+        p2m_type_t t;
+        p2m_access_t a;
+
+        old[i] = p2m->get_entry(p2m, gfn_add(gfn, i), &t, &a, 0, NULL, NULL);
+        if ( !mfn_valid(old[i]) )
+            goto out;
+
+        page = mfn_to_page(old[i]);
+        if ( page_get_owner(page) != d || is_special_page(page) ||
+             (page->count_info & (PGC_count_mask | PGC_allocated |
+                                  PGC_page_table)) != (PGC_allocated | 1) )
+            goto out;
+    }
+
+    rc = -EAGAIN;
+    if ( !pg || !*pg )
+        goto out;
+
+    ASSERT(atomic_read(&d->pause_count));
+
+    mfn = page_to_mfn(*pg);
+    for ( i = 0; i < nr; i++ )
+        copy_domain_page(mfn_add(mfn, i), old[i]);
+
+    /*
+     * Like the pages being replaced, the new ones count towards tot_pages
+     * (i.e. the domain temporarily has both), but not towards max_pages.
+     */
+    if ( assign_pages(*pg, nr, d, MEMF_no_refcount) )
+    {
+        /* The caller frees the pages, which now hold the guest's data. */
+        for ( i = 0; i < nr; i++ )
+            scrub_one_page(*pg + i);
+        goto out;
+    }
+    spin_lock(&d->page_alloc_lock);
+    if ( unlikely(domain_adjust_tot_pages(d, nr) == nr) )
+        get_knownalive_domain(d);
+    spin_unlock(&d->page_alloc_lock);
+
+    if ( p2m_set_entry(p2m, gfn, mfn, order, p2m_ram_rw,
+                       p2m->default_access) )
+    {
+        for ( i = 0; i < nr; i++ )
+        {
+            struct page_info *page = mfn_to_page(mfn_add(mfn, i));
+
+            scrub_one_page(page);
+            if ( test_and_clear_bit(_PGC_allocated, &page->count_info) )
+                put_page(page);
+        }
+        *pg = NULL;
+        goto out;
+    }
+
+    for ( i = 0; i < nr; i++ )
+        set_gpfn_from_mfn(mfn_x(mfn) + i, gfn_x(gfn) + i);
+
+    p2m_tlb_flush_sync(p2m);
+
+    /*
+     * The old pages go back to the heap while the domain is alive, where
+     * they wouldn't get scrubbed.  Don't leak the guest's data.
+     */
+    for ( i = 0; i < nr; i++ )
+    {
+        struct page_info *page = mfn_to_page(old[i]);
+
+        set_gpfn_from_mfn(mfn_x(old[i]), INVALID_M2P_ENTRY);
+        scrub_one_page(page);
+        if ( test_and_clear_bit(_PGC_allocated, &page->count_info) )
+            put_page(page);
+    }
+
+    ioreq_request_mapcache_invalidate(d);
+
+    *pg = NULL;
+    p2m->recombine.promoted[0]++;
+    p2m->recombine.copied++;
+    perfc_incr(p2m_recombine_copy);
+    rc = 1;
+
+ out:
+    gfn_unlock(p2m, gfn, order);
+
+    return rc;
+}
+
+static void recombine_batch(void *data)
+{
+    struct p2m_domain *p2m = data;
+    struct domain *d = p2m->domain;
+    unsigned long gfn = p2m->recombine.next_gfn;
+    unsigned int n;
+    bool copy = !has_arch_pdevs(d);
+    mfn_t *old = NULL;
+
+    if ( !recombine_allowed(d) )
+        goto out;
+
+    if ( copy )
+        old = xmalloc_array(mfn_t, SUPERPAGE_PAGES);
+
+    for ( n = 0; n < RECOMBINE_BATCH; n++, gfn += SUPERPAGE_PAGES )
+    {
+        struct page_info *pg = NULL;
+
+        if ( gfn > p2m->max_mapped_pfn )
+        {
+            gfn = 0;
+            break;
+        }
+
+        if ( recombine(p2m, _gfn(gfn), PAGE_ORDER_2M, &pg, old) == -EAGAIN &&
+             copy && NOW() - p2m->recombine.last_copy >= RECOMBINE_COPY_DELAY )
+        {
+            pg = alloc_domheap_pages(d, PAGE_ORDER_2M, MEMF_no_owner);
+            if ( !pg )
+                copy = false;
+            else
+            {
+                p2m->recombine.last_copy = NOW();
+                domain_pause(d);
+                recombine(p2m, _gfn(gfn), PAGE_ORDER_2M, &pg, old);
+                domain_unpause(d);
+                if ( pg )
+                    free_domheap_pages(pg, PAGE_ORDER_2M);
+            }
+        }
+
+        /* Last 2M range of a 1G one: try to merge the latter as a whole. */
+        if ( hap_has_1gb &&
+             IS_ALIGNED(gfn + SUPERPAGE_PAGES, 1UL << PAGE_ORDER_1G) )
+            recombine(p2m, _gfn(gfn & ~((1UL << PAGE_ORDER_1G) - 1)),
+                      PAGE_ORDER_1G, NULL, NULL);
+
+        process_pending_softirqs();
+    }
+
+    xfree(old);
+
+    p2m->recombine.next_gfn = gfn;
+    if ( gfn )
+    {
+        set_timer(&p2m->recombine.timer, NOW() + RECOMBINE_BATCH_DELAY);
+        return;
+    }
+
+ out:
+    p2m->recombine.next_gfn = 0;
+    set_timer(&p2m->recombine.timer, NOW() + RECOMBINE_IDLE_DELAY);
+}
+
+static void recombine_timer_fn(void *data)
+{
+    struct p2m_domain *p2m = data;
+    unsigned long split = read_atomic(&p2m->recombine.split);
+
+    /* Don't bother the tasklet while the domain can't be dealt with. */
+    if ( !recombine_possible(p2m->domain) )
+    {
+        p2m->recombine.next_gfn = 0;
+        set_timer(&p2m->recombine.timer, NOW() + RECOMBINE_IDLE_DELAY);
+        return;
+    }
+
+    /*
+     * Continue a pass in progress, or start a new one if superpages got
+     * split since the start of the previous one.  Every so often start
+     * one regardless, to pick up on ranges populated with small pages.
+     */
+    if ( !p2m->recombine.next_gfn )
+    {
+        if ( split == p2m->recombine.pass_split &&
+             ++p2m->recombine.idle < RECOMBINE_IDLE_PASSES )
+        {
+            set_timer(&p2m->recombine.timer, NOW() + RECOMBINE_IDLE_DELAY);
+            return;
+        }
+
+        p2m->recombine.pass_split = split;
+        p2m->recombine.idle = 0;
+    }
+
+    /* Moving memory requires pausing the domain, i.e. idle vCPU context. */
+    tasklet_schedule(&p2m->recombine.tasklet);
+}
+
+void p2m_recombine_init(struct p2m_domain *p2m)
+{
+    if ( !opt_p2m_recombine || !hap_has_2mb )
+        return;
+
+    init_timer(&p2m->recombine.timer, recombine_timer_fn, p2m,
+               smp_processor_id());
+    tasklet_init(&p2m->recombine.tasklet, recombine_batch, p2m);
+    set_timer(&p2m->recombine.timer, NOW() + RECOMBINE_IDLE_DELAY);
+}
+
+void p2m_recombine_teardown(struct p2m_domain *p2m)
+{
+    if ( !opt_p2m_recombine || !hap_has_2mb )
+        return;
+
+    kill_timer(&p2m->recombine.timer);
+    tasklet_kill(&p2m->recombine.tasklet);
+}
+
+void p2m_recombine_dump_data(struct domain *d)
+{
+    const struct p2m_domain *p2m = p2m_get_hostp2m(d);
+
+    if ( !opt_p2m_recombine || !hap_has_2mb || !hap_enabled(d) )
+        return;
+
+    printk("    superpages split=%lu recombined 2M=%lu (copied %lu) 1G=%lu\n",
+           p2m->recombine.split, p2m->recombine.promoted[0],
+           p2m->recombine.copied, p2m->recombine.promoted[1]);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -153,7 +153,13 @@ static int p2m_init_hostp2m(struct domain *d)
     rc = p2m_init_logdirty(p2m);
 
     if ( !rc )
+    {
         d->arch.p2m = p2m;
+#ifdef CONFIG_HVM
+        if ( hap_enabled(d) )
+            p2m_recombine_init(p2m);
+#endif
+    }
     else
         p2m_free_one(p2m);
 
@@ -167,6 +173,10 @@ static void p2m_teardown_hostp2m(struct domain *d)
 
     if ( p2m )
     {
+#ifdef CONFIG_HVM
+        if ( hap_enabled(d) )
+            p2m_recombine_teardown(p2m);
+#endif
         p2m_free_one(p2m);
         d->arch.p2m = NULL;
     }
@@ -627,29 +637,40 @@ struct page_info *p2m_get_page_from_gfn(
 }
 
 #ifdef CONFIG_HVM
-/* Returns: 0 for success, -errno for failure */
-int p2m_set_entry(struct p2m_domain *p2m, gfn_t gfn, mfn_t mfn,
-                  unsigned int page_order, p2m_type_t p2mt, p2m_access_t p2ma)
+/*
+ * Set [gfn, gfn + nr) to map the same number of frames from mfn onwards (or
+ * nothing, for INVALID_MFN), using entries of the largest possible orders.
+ * TLB flushes are left to the p2m lock's release, and the IOTLB flushes
+ * for the individual entries get merged into one.
+ *
+ * Returns: 0 for success, -errno for failure
+ */
+static int p2m_set_range(struct p2m_domain *p2m, gfn_t gfn, mfn_t mfn,
+                         unsigned long nr, p2m_type_t p2mt, p2m_access_t p2ma)
 {
     struct domain *d = p2m->domain;
-    unsigned long todo = 1ul << page_order;
+    unsigned long todo = nr;
     unsigned int order;
     int set_rc, rc = 0;
 
     ASSERT(gfn_locked_by_me(p2m, gfn));
 
+    iommu_flush_gather_begin(d);
+
     while ( todo )
     {
         if ( hap_enabled(d) )
         {
             unsigned long fn_mask = !mfn_eq(mfn, INVALID_MFN) ? mfn_x(mfn) : 0;
 
-            fn_mask |= gfn_x(gfn) | todo;
+            fn_mask |= gfn_x(gfn);
 
             order = (!(fn_mask & ((1ul << PAGE_ORDER_1G) - 1)) &&
-                     hap_has_1gb) ? PAGE_ORDER_1G :
+                     todo >= (1ul << PAGE_ORDER_1G) && hap_has_1gb)
+                    ? PAGE_ORDER_1G :
                     (!(fn_mask & ((1ul << PAGE_ORDER_2M) - 1)) &&
-                     hap_has_2mb) ? PAGE_ORDER_2M : PAGE_ORDER_4K;
+                     todo >= (1ul << PAGE_ORDER_2M) && hap_has_2mb)
+                    ? PAGE_ORDER_2M : PAGE_ORDER_4K;
         }
         else
             order = 0;
@@ -664,7 +685,16 @@ int p2m_set_entry(struct p2m_domain *p2m, gfn_t gfn, mfn_t mfn,
         todo -= 1ul << order;
     }
 
-    return rc;
+    set_rc = iommu_flush_gather_end(d);
+
+    return rc ?: set_rc;
+}
+
+/* Returns: 0 for success, -errno for failure */
+int p2m_set_entry(struct p2m_domain *p2m, gfn_t gfn, mfn_t mfn,
+                  unsigned int page_order, p2m_type_t p2mt, p2m_access_t p2ma)
+{
+    return p2m_set_range(p2m, gfn, mfn, 1UL << page_order, p2mt, p2ma);
 }
 #endif
 
@@ -895,12 +925,13 @@ guest_physmap_add_entry(struct domain *d, gfn_t gfn, mfn_t mfn,
                         unsigned int page_order, p2m_type_t t)
 {
     struct p2m_domain *p2m = p2m_get_hostp2m(d);
-    unsigned long i;
+    unsigned long i, j, n;
     gfn_t ogfn;
     p2m_type_t ot;
     p2m_access_t a;
     mfn_t omfn;
-    int pod_count = 0;
+    unsigned int cur_order;
+    long pod_count = 0;
     int rc = 0;
 
     if ( !paging_mode_translate(d) )
@@ -923,11 +954,19 @@ guest_physmap_add_entry(struct domain *d, gfn_t gfn, mfn_t mfn,
 
     P2M_DEBUG("adding gfn=%#lx mfn=%#lx\n", gfn_x(gfn), mfn_x(mfn));
 
-    /* First, remove m->p mappings for existing p->m mappings */
-    for ( i = 0; i < (1UL << page_order); i++ )
+    /*
+     * First, remove m->p mappings for existing p->m mappings.  Existing
+     * entries are looked at as a whole, rather than page by page: n is the
+     * number of pages from gfn + i to the end of the entry (which gfn + i
+     * needn't be aligned to), or to the end of the range if that's earlier.
+     */
+    for ( i = 0; i < (1UL << page_order); i += n )
     {
         omfn = p2m->get_entry(p2m, gfn_add(gfn, i), &ot,
-                              &a, 0, NULL, NULL);
+                              &a, 0, &cur_order, NULL);
+        n = (1UL << cur_order) -
+            ((gfn_x(gfn) + i) & ((1UL << cur_order) - 1));
+        n = min(n, (1UL << page_order) - i);
         if ( p2m_is_shared(ot) )
         {
             /* Do an unshare to cleanly take care of all corner cases. */
@@ -970,12 +1009,13 @@ guest_physmap_add_entry(struct domain *d, gfn_t gfn, mfn_t mfn,
         else if ( p2m_is_ram(ot) && !p2m_is_paged(ot) )
         {
             ASSERT(mfn_valid(omfn));
-            set_gpfn_from_mfn(mfn_x(omfn), INVALID_M2P_ENTRY);
+            for ( j = 0; j < n; j++ )
+                set_gpfn_from_mfn(mfn_x(omfn) + j, INVALID_M2P_ENTRY);
         }
         else if ( ot == p2m_populate_on_demand )
         {
             /* Count how man PoD entries we'll be replacing if successful */
-            pod_count++;
+            pod_count += n;
         }
         else if ( p2m_is_paging(ot) && (ot != p2m_ram_paging_out) )
         {
@@ -1963,7 +2003,8 @@ int map_mmio_regions(struct domain *d,
                      unsigned long nr,
                      mfn_t mfn)
 {
-    int ret = 0;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    int ret = 0, rc;
     unsigned long i;
     unsigned int iter, order;
 
@@ -1973,6 +2014,10 @@ int map_mmio_regions(struct domain *d,
         return -EOPNOTSUPP;
     }
 
+    /* Have the TLB and IOTLB flushes issued only once for the batch. */
+    p2m_lock(p2m);
+    iommu_flush_gather_begin(d);
+
     for ( iter = i = 0; i < nr && iter < MAP_MMIO_MAX_ITER;
           i += 1UL << order, ++iter )
     {
@@ -1990,6 +2035,12 @@ int map_mmio_regions(struct domain *d,
             break;
     }
 
+    rc = iommu_flush_gather_end(d);
+    p2m_unlock(p2m);
+
+    if ( unlikely(rc) && ret >= 0 )
+        return rc;
+
     return i == nr ? 0 : i ?: ret;
 }
 
@@ -1998,7 +2049,8 @@ int unmap_mmio_regions(struct domain *d,
                        unsigned long nr,
                        mfn_t mfn)
 {
-    int ret = 0;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    int ret = 0, rc;
     unsigned long i;
     unsigned int iter, order;
 
@@ -2008,6 +2060,10 @@ int unmap_mmio_regions(struct domain *d,
         return -EOPNOTSUPP;
     }
 
+    /* Have the TLB and IOTLB flushes issued only once for the batch. */
+    p2m_lock(p2m);
+    iommu_flush_gather_begin(d);
+
     for ( iter = i = 0; i < nr && iter < MAP_MMIO_MAX_ITER;
           i += 1UL << order, ++iter )
     {
@@ -2025,6 +2081,12 @@ int unmap_mmio_regions(struct domain *d,
             break;
     }
 
+    rc = iommu_flush_gather_end(d);
+    p2m_unlock(p2m);
+
+    if ( unlikely(rc) && ret >= 0 )
+        return rc;
+
     return i == nr ? 0 : i ?: ret;
 }
 
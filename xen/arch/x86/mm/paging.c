@@ -21,6 +21,7 @@
 
 #include <xen/init.h>
 #include <xen/guest_access.h>
+#include <xen/vmap.h>
 #include <asm/paging.h>
 #include <asm/shadow.h>
 #include <asm/p2m.h>
@@ -211,6 +212,294 @@ static int paging_free_log_dirty_bitmap(struct domain *d, int rc)
     return rc;
 }
 
+#ifdef CONFIG_HVM
+/*
+ * Dirty ring (see struct xen_dirty_ring in public/memory.h).  It's only
+ * offered to HAP domains, where pages can be individually write-protected
+ * again once handed back.  The ring indexes are kept private, the ones in
+ * the shared header are only written (prod) or sanitized (cons).  Entries
+ * from ->reset to ->prod haven't been handed back yet.
+ */
+#define DIRTY_RING_FRAMES (1 + 32)
+#define DIRTY_RING_SIZE   ((DIRTY_RING_FRAMES - 1) * \
+                           (PAGE_SIZE / sizeof(uint64_t)))
+
+struct paging_dirty_ring {
+    struct page_info *pg[DIRTY_RING_FRAMES];
+    struct xen_dirty_ring *hdr;
+    uint64_t *pfn;
+    unsigned int prod, reset;
+};
+
+static void dirty_ring_free(struct paging_dirty_ring *ring)
+{
+    unsigned int i;
+
+    if ( !ring )
+        return;
+
+    if ( ring->hdr )
+        vunmap(ring->hdr);
+
+    for ( i = 0; i < DIRTY_RING_FRAMES; i++ )
+    {
+        if ( !ring->pg[i] )
+            continue;
+
+        put_page_alloc_ref(ring->pg[i]);
+        put_page_and_type(ring->pg[i]);
+    }
+
+    xfree(ring);
+}
+
+static struct paging_dirty_ring *dirty_ring_alloc(struct domain *d)
+{
+    struct paging_dirty_ring *ring = xzalloc(struct paging_dirty_ring);
+    mfn_t mfn[DIRTY_RING_FRAMES];
+    unsigned int i;
+
+    if ( !ring )
+        return NULL;
+
+    for ( i = 0; i < DIRTY_RING_FRAMES; i++ )
+    {
+        struct page_info *pg = alloc_domheap_page(d, MEMF_no_refcount);
+
+        if ( !pg )
+            goto fail;
+
+        if ( !get_page_and_type(pg, d, PGT_writable_page) )
+        {
+            /*
+             * The domain can't possibly know about this page yet, so failure
+             * here is a clear indication of something fishy going on.
+             */
+            domain_crash(d);
+            goto fail;
+        }
+
+        ring->pg[i] = pg;
+        mfn[i] = page_to_mfn(pg);
+        clear_domain_page(mfn[i]);
+    }
+
+    ring->hdr = vmap(mfn, DIRTY_RING_FRAMES);
+    if ( !ring->hdr )
+        goto fail;
+
+    ring->pfn = (void *)ring->hdr + PAGE_SIZE;
+    ring->hdr->size = DIRTY_RING_SIZE;
+
+    return ring;
+
+ fail:
+    dirty_ring_free(ring);
+
+    return NULL;
+}
+
+unsigned int paging_dirty_ring_max_frames(const struct domain *d)
+{
+    return hap_enabled(d) ? DIRTY_RING_FRAMES : 0;
+}
+
+int paging_dirty_ring_acquire(struct domain *d, unsigned int frame,
+                              unsigned int nr_frames, xen_pfn_t mfn_list[])
+{
+    struct paging_dirty_ring *ring, *new = NULL;
+    unsigned int i;
+
+    if ( !hap_enabled(d) )
+        return -EOPNOTSUPP;
+
+    if ( frame + nr_frames > DIRTY_RING_FRAMES )
+        return -EINVAL;
+
+    /* The ring may get freed by paging_teardown() unless we hold the lock. */
+    paging_lock(d);
+
+    ring = d->arch.paging.log_dirty.ring;
+    if ( !ring )
+    {
+        paging_unlock(d);
+
+        /* Allocate outside of the paging lock, for lock ordering reasons. */
+        new = dirty_ring_alloc(d);
+        if ( !new )
+            return -ENOMEM;
+
+        paging_lock(d);
+
+        ring = d->arch.paging.log_dirty.ring;
+        if ( !ring && !d->is_dying )
+        {
+            d->arch.paging.log_dirty.ring = ring = new;
+            new = NULL;
+        }
+    }
+
+    if ( ring )
+        for ( i = 0; i < nr_frames; i++ )
+            mfn_list[i] = mfn_x(page_to_mfn(ring->pg[frame + i]));
+
+    paging_unlock(d);
+
+    dirty_ring_free(new);
+
+    return ring ? nr_frames : -EINVAL;
+}
+
+static void dirty_ring_push(struct domain *d, pfn_t pfn)
+{
+    struct paging_dirty_ring *ring;
+
+    ASSERT(paging_locked_by_me(d));
+
+    ring = d->arch.paging.log_dirty.ring;
+    if ( !ring )
+        return;
+
+    if ( ring->prod - ring->reset >= DIRTY_RING_SIZE )
+    {
+        ring->hdr->flags |= XEN_DIRTY_RING_OVERFLOW;
+        return;
+    }
+
+    ring->pfn[ring->prod % DIRTY_RING_SIZE] = pfn_x(pfn);
+    /* Make the entry visible /before/ the producer index. */
+    smp_wmb();
+    write_atomic(&ring->hdr->prod, ++ring->prod);
+}
+
+static void dirty_ring_empty(struct domain *d)
+{
+    struct paging_dirty_ring *ring;
+
+    ASSERT(paging_locked_by_me(d));
+
+    ring = d->arch.paging.log_dirty.ring;
+    if ( !ring )
+        return;
+
+    ring->reset = ring->prod;
+    write_atomic(&ring->hdr->cons, ring->prod);
+    ring->hdr->flags &= ~XEN_DIRTY_RING_OVERFLOW;
+}
+
+/* Clear a pfn in the log-dirty bitmap. */
+static void paging_clear_pfn_dirty(struct domain *d, pfn_t pfn)
+{
+    mfn_t mfn, *l4, *l3, *l2;
+    unsigned long *l1;
+
+    ASSERT(paging_locked_by_me(d));
+
+    mfn = d->arch.paging.log_dirty.top;
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l4 = map_domain_page(mfn);
+    mfn = l4[L4_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l4);
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l3 = map_domain_page(mfn);
+    mfn = l3[L3_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l3);
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l2 = map_domain_page(mfn);
+    mfn = l2[L2_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l2);
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l1 = map_domain_page(mfn);
+    __clear_bit(L1_LOGDIRTY_IDX(pfn), l1);
+    unmap_domain_page(l1);
+}
+
+/*
+ * Hand back consumed entries: clear them in the bitmap, and turn the pages
+ * back to log-dirty so that further writes get recorded again.  The p2m
+ * lock is held throughout, so PML buffer flushes (which change the type of
+ * an entry before marking it dirty) can't interleave with a pfn being
+ * cleared and re-armed, and the EPT flush is deferred to the end of each
+ * batch.
+ */
+static int paging_dirty_ring_reset(struct domain *d, bool resuming)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    struct paging_dirty_ring *ring;
+    unsigned long batch[64];
+    unsigned int cons, i, n;
+    bool more;
+    int rc;
+
+    if ( !hap_enabled(d) )
+        return -EOPNOTSUPP;
+
+    if ( !resuming )
+    {
+        /*
+         * Flush dirty GFNs potentially cached by hardware (PML), such that
+         * the ring covers all writes done before the reset.
+         */
+        domain_pause(d);
+        p2m_flush_hardware_cached_dirty(d);
+        domain_unpause(d);
+    }
+
+    do {
+        p2m_lock(p2m);
+        paging_lock(d);
+
+        ring = d->arch.paging.log_dirty.ring;
+        cons = ring ? read_atomic(&ring->hdr->cons) : 0;
+        if ( !ring || !paging_mode_log_dirty(d) ||
+             cons - ring->reset > ring->prod - ring->reset )
+        {
+            paging_unlock(d);
+            p2m_unlock(p2m);
+            rc = -EINVAL;
+            break;
+        }
+
+        for ( n = 0; ring->reset != cons && n < ARRAY_SIZE(batch); n++ )
+        {
+            batch[n] = ring->pfn[ring->reset++ % DIRTY_RING_SIZE];
+            paging_clear_pfn_dirty(d, _pfn(batch[n]));
+        }
+        more = ring->reset != cons;
+
+        paging_unlock(d);
+
+        for ( i = 0; i < n; i++ )
+            p2m_change_type_one(d, batch[i], p2m_ram_rw, p2m_ram_logdirty);
+
+        p2m_unlock(p2m);
+
+        rc = more && hypercall_preempt_check() ? -ERESTART : 0;
+    } while ( more && !rc );
+
+    if ( rc == -ERESTART )
+    {
+        d->arch.paging.preempt.dom = current->domain;
+        d->arch.paging.preempt.op = XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET;
+    }
+    else
+        d->arch.paging.preempt.dom = NULL;
+
+    return rc;
+}
+#else /* !CONFIG_HVM */
+static inline void dirty_ring_push(struct domain *d, pfn_t pfn) {}
+static inline void dirty_ring_empty(struct domain *d) {}
+#endif /* CONFIG_HVM */
+
 int paging_log_dirty_enable(struct domain *d, bool log_global)
 {
     int ret;
@@ -228,6 +517,12 @@ int paging_log_dirty_enable(struct domain *d, bool log_global)
         return -EINVAL;
 
     domain_pause(d);
+
+    /* Entries left over from a previous round are stale. */
+    paging_lock(d);
+    dirty_ring_empty(d);
+    paging_unlock(d);
+
     ret = d->arch.paging.log_dirty.ops->enable(d, log_global);
     domain_unpause(d);
 
@@ -328,6 +623,7 @@ void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
                      "d%d: marked mfn %" PRI_mfn " (pfn %" PRI_pfn ")\n",
                      d->domain_id, mfn_x(mfn), pfn_x(pfn));
         d->arch.paging.log_dirty.dirty_count++;
+        dirty_ring_push(d, pfn);
     }
 
 out:
@@ -544,6 +840,8 @@ static int paging_log_dirty_op(struct domain *d,
         {
             d->arch.paging.log_dirty.fault_count = 0;
             d->arch.paging.log_dirty.dirty_count = 0;
+            /* Everything in the ring was just reported through the bitmap. */
+            dirty_ring_empty(d);
         }
     }
     else
@@ -747,6 +1045,13 @@ int paging_domctl(struct domain *d, struct xen_domctl_shadow_op *sc,
         if ( sc->mode & ~XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL )
             return -EINVAL;
         return paging_log_dirty_op(d, sc, resuming);
+
+    case XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET:
+#ifdef CONFIG_HVM
+        return paging_dirty_ring_reset(d, resuming);
+#else
+        return -EOPNOTSUPP;
+#endif
     }
 
     /* Here, dispatch domctl to the appropriate paging code */
@@ -827,6 +1132,19 @@ int paging_teardown(struct domain *d)
         return rc;
 #endif
 
+#ifdef CONFIG_HVM
+    {
+        struct paging_dirty_ring *ring;
+
+        paging_lock(d);
+        ring = d->arch.paging.log_dirty.ring;
+        d->arch.paging.log_dirty.ring = NULL;
+        paging_unlock(d);
+
+        dirty_ring_free(ring);
+    }
+#endif
+
     /* Move populate-on-demand cache back to domain_list for destruction */
     rc = p2m_pod_empty_cache(d);
 
@@ -78,18 +78,6 @@ int shadow_domain_init(struct domain *d)
  */
 void shadow_vcpu_init(struct vcpu *v)
 {
-#if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC)
-    int i, j;
-
-    for ( i = 0; i < SHADOW_OOS_PAGES; i++ )
-    {
-        v->arch.paging.shadow.oos[i] = INVALID_MFN;
-        v->arch.paging.shadow.oos_snapshot[i] = INVALID_MFN;
-        for ( j = 0; j < SHADOW_OOS_FIXUPS; j++ )
-            v->arch.paging.shadow.oos_fixup[i].smfn[j] = INVALID_MFN;
-    }
-#endif
-
     v->arch.paging.mode = is_hvm_vcpu(v) ?
                           &SHADOW_INTERNAL_NAME(sh_paging_mode, 3) :
                           &SHADOW_INTERNAL_NAME(sh_paging_mode, 4);
@@ -158,8 +146,33 @@ __initcall(shadow_audit_key_init);
  * We keep a hash per vcpu, because we want as much as possible to do
  * the re-sync on the save vcpu we did the unsync on, so the VA hint
  * will be valid.
+ *
+ * The table starts small, as every slot in use adds to the work done on
+ * each resync-all (i.e. guest TLB flush).  Workloads with more page tables
+ * being written to at a time (e.g. lots of forking) would keep evicting
+ * entries though, falling back to emulating every PTE write, so the table
+ * grows when a sizeable share of unsyncs evicts another page, and shrinks
+ * back once that stops happening for a while.
  */
 
+/* Slot of gmfn in v's OOS hash table, or -1 if it isn't there. */
+static int oos_hash_lookup(const struct vcpu *v, mfn_t gmfn)
+{
+    const mfn_t *oos = v->arch.paging.shadow.oos;
+    unsigned int size = v->arch.paging.shadow.oos_size;
+    unsigned int idx;
+
+    /* Not allocated yet? */
+    if ( !size )
+        return -1;
+
+    idx = mfn_x(gmfn) % size;
+    if ( !mfn_eq(oos[idx], gmfn) )
+        idx = (idx + 1) % size;
+
+    return mfn_eq(oos[idx], gmfn) ? idx : -1;
+}
+
 static void sh_oos_audit(struct domain *d)
 {
     unsigned int idx, expected_idx, expected_idx_alt;
@@ -168,14 +181,16 @@ static void sh_oos_audit(struct domain *d)
 
     for_each_vcpu(d, v)
     {
-        for ( idx = 0; idx < SHADOW_OOS_PAGES; idx++ )
+        unsigned int size = v->arch.paging.shadow.oos_size;
+
+        for ( idx = 0; idx < size; idx++ )
         {
             mfn_t *oos = v->arch.paging.shadow.oos;
             if ( !mfn_valid(oos[idx]) )
                 continue;
 
-            expected_idx = mfn_x(oos[idx]) % SHADOW_OOS_PAGES;
-            expected_idx_alt = ((expected_idx + 1) % SHADOW_OOS_PAGES);
+            expected_idx = mfn_x(oos[idx]) % size;
+            expected_idx_alt = ((expected_idx + 1) % size);
             if ( idx != expected_idx && idx != expected_idx_alt )
             {
                 printk("%s: idx %x contains gmfn %lx, expected at %x or %x.\n",
@@ -209,22 +224,13 @@ static void sh_oos_audit(struct domain *d)
 #if SHADOW_AUDIT & SHADOW_AUDIT_ENTRIES
 void oos_audit_hash_is_present(struct domain *d, mfn_t gmfn)
 {
-    int idx;
     struct vcpu *v;
-    mfn_t *oos;
 
     ASSERT(mfn_is_out_of_sync(gmfn));
 
     for_each_vcpu(d, v)
-    {
-        oos = v->arch.paging.shadow.oos;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
-        if ( !mfn_eq(oos[idx], gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
-
-        if ( mfn_eq(oos[idx], gmfn) )
+        if ( oos_hash_lookup(v, gmfn) >= 0 )
             return;
-    }
 
     printk(XENLOG_ERR "gmfn %"PRI_mfn" marked OOS but not in hash table\n",
            mfn_x(gmfn));
@@ -309,7 +315,6 @@ void oos_fixup_add(struct domain *d, mfn_t gmfn,
                    mfn_t smfn,  unsigned long off)
 {
     int idx, next;
-    mfn_t *oos;
     struct oos_fixup *oos_fixup;
     struct vcpu *v;
 
@@ -317,12 +322,9 @@ void oos_fixup_add(struct domain *d, mfn_t gmfn,
 
     for_each_vcpu(d, v)
     {
-        oos = v->arch.paging.shadow.oos;
         oos_fixup = v->arch.paging.shadow.oos_fixup;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
-        if ( !mfn_eq(oos[idx], gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
-        if ( mfn_eq(oos[idx], gmfn) )
+        idx = oos_hash_lookup(v, gmfn);
+        if ( idx >= 0 )
         {
             int i;
             for ( i = 0; i < SHADOW_OOS_FIXUPS; i++ )
@@ -446,6 +448,91 @@ static void _sh_resync(struct vcpu *v, mfn_t gmfn,
 }
 
 
+/* Unsyncs between decisions on resizing a vcpu's OOS hash table. */
+#define OOS_RESIZE_PERIOD   256
+/* Grow the table if more than 1/8th of unsyncs evicted another page ... */
+#define OOS_GROW_SHIFT      3
+/* ... and shrink it after this many periods without any evictions. */
+#define OOS_SHRINK_PERIODS  8
+
+/*
+ * Resync all of this vcpu's OOS pages, and change its table's size, along
+ * with the number of snapshot pages it holds.  Returns false, leaving
+ * everything alone, if the snapshots for a bigger table can't be had.
+ */
+static bool oos_hash_resize(struct vcpu *v, unsigned int size)
+{
+    struct domain *d = v->domain;
+    mfn_t *oos = v->arch.paging.shadow.oos;
+    mfn_t *oos_snapshot = v->arch.paging.shadow.oos_snapshot;
+    unsigned int idx, old_size = v->arch.paging.shadow.oos_size;
+
+    /*
+     * We're in the middle of unsyncing a page, so can't have
+     * shadow_prealloc() pull shadows down from under us: the new snapshots
+     * have to come out of the pages already free in the pool.
+     */
+    if ( size > old_size &&
+         d->arch.paging.shadow.free_pages <
+         (size - old_size) * shadow_size(SH_type_oos_snapshot) )
+        return false;
+
+    for ( idx = 0; idx < old_size; idx++ )
+        if ( mfn_valid(oos[idx]) )
+        {
+            _sh_resync(v, oos[idx], &v->arch.paging.shadow.oos_fixup[idx],
+                       oos_snapshot[idx]);
+            oos[idx] = INVALID_MFN;
+        }
+
+    for ( idx = size; idx < old_size; idx++ )
+    {
+        shadow_free(d, oos_snapshot[idx]);
+        oos_snapshot[idx] = INVALID_MFN;
+    }
+    for ( idx = old_size; idx < size; idx++ )
+        oos_snapshot[idx] = shadow_alloc(d, SH_type_oos_snapshot, 0);
+
+    v->arch.paging.shadow.oos_size = size;
+
+    return true;
+}
+
+static void oos_hash_adapt(struct vcpu *v)
+{
+    /* The sizes the table steps through (prime, please). */
+    static const unsigned int sizes[] = {
+        SHADOW_OOS_PAGES_MIN, 7, SHADOW_OOS_PAGES
+    };
+    struct shadow_vcpu *sv = &v->arch.paging.shadow;
+    unsigned int i = 0;
+
+    if ( ++sv->oos_unsyncs < OOS_RESIZE_PERIOD )
+        return;
+
+    while ( sizes[i] != sv->oos_size )
+        i++;
+
+    if ( (sv->oos_evicts << OOS_GROW_SHIFT) > sv->oos_unsyncs &&
+         i + 1 < ARRAY_SIZE(sizes) )
+    {
+        if ( oos_hash_resize(v, sizes[i + 1]) )
+            perfc_incr(shadow_oos_grow);
+        sv->oos_quiet = 0;
+    }
+    else if ( sv->oos_evicts || !i )
+        sv->oos_quiet = 0;
+    else if ( ++sv->oos_quiet >= OOS_SHRINK_PERIODS )
+    {
+        oos_hash_resize(v, sizes[i - 1]);
+        sv->oos_quiet = 0;
+        perfc_incr(shadow_oos_shrink);
+    }
+
+    sv->oos_unsyncs = 0;
+    sv->oos_evicts = 0;
+}
+
 /* Add an MFN to the list of out-of-sync guest pagetables */
 static void oos_hash_add(struct vcpu *v, mfn_t gmfn)
 {
@@ -455,26 +542,31 @@ static void oos_hash_add(struct vcpu *v, mfn_t gmfn)
     mfn_t *oos_snapshot = v->arch.paging.shadow.oos_snapshot;
     struct oos_fixup *oos_fixup = v->arch.paging.shadow.oos_fixup;
     struct oos_fixup fixup = { .next = 0 };
+    unsigned int size;
+
+    oos_hash_adapt(v);
+    size = v->arch.paging.shadow.oos_size;
 
     for (i = 0; i < SHADOW_OOS_FIXUPS; i++ )
         fixup.smfn[i] = INVALID_MFN;
 
-    idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
+    idx = mfn_x(gmfn) % size;
     oidx = idx;
 
     if ( mfn_valid(oos[idx])
-         && (mfn_x(oos[idx]) % SHADOW_OOS_PAGES) == idx )
+         && (mfn_x(oos[idx]) % size) == idx )
     {
         /* Punt the current occupant into the next slot */
         SWAP(oos[idx], gmfn);
         SWAP(oos_fixup[idx], fixup);
         swap = 1;
-        idx = (idx + 1) % SHADOW_OOS_PAGES;
+        idx = (idx + 1) % size;
     }
     if ( mfn_valid(oos[idx]) )
    {
         /* Crush the current occupant. */
         _sh_resync(v, oos[idx], &oos_fixup[idx], oos_snapshot[idx]);
+        v->arch.paging.shadow.oos_evicts++;
         perfc_incr(shadow_unsync_evict);
     }
     oos[idx] = gmfn;
@@ -494,20 +586,16 @@ static void oos_hash_add(struct vcpu *v, mfn_t gmfn)
 static void oos_hash_remove(struct domain *d, mfn_t gmfn)
 {
     int idx;
-    mfn_t *oos;
     struct vcpu *v;
 
     SHADOW_PRINTK("d%d gmfn %lx\n", d->domain_id, mfn_x(gmfn));
 
     for_each_vcpu(d, v)
     {
-        oos = v->arch.paging.shadow.oos;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
-        if ( !mfn_eq(oos[idx], gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
-        if ( mfn_eq(oos[idx], gmfn) )
+        idx = oos_hash_lookup(v, gmfn);
+        if ( idx >= 0 )
         {
-            oos[idx] = INVALID_MFN;
+            v->arch.paging.shadow.oos[idx] = INVALID_MFN;
             return;
         }
     }
@@ -520,21 +608,13 @@ static void oos_hash_remove(struct domain *d, mfn_t gmfn)
 mfn_t oos_snapshot_lookup(struct domain *d, mfn_t gmfn)
 {
     int idx;
-    mfn_t *oos;
-    mfn_t *oos_snapshot;
     struct vcpu *v;
 
     for_each_vcpu(d, v)
     {
-        oos = v->arch.paging.shadow.oos;
-        oos_snapshot = v->arch.paging.shadow.oos_snapshot;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
-        if ( !mfn_eq(oos[idx], gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
-        if ( mfn_eq(oos[idx], gmfn) )
-        {
-            return oos_snapshot[idx];
-        }
+        idx = oos_hash_lookup(v, gmfn);
+        if ( idx >= 0 )
+            return v->arch.paging.shadow.oos_snapshot[idx];
     }
 
     printk(XENLOG_ERR "gmfn %"PRI_mfn" was OOS but not in hash table\n",
@@ -546,24 +626,16 @@ mfn_t oos_snapshot_lookup(struct domain *d, mfn_t gmfn)
 void sh_resync(struct domain *d, mfn_t gmfn)
 {
     int idx;
-    mfn_t *oos;
-    mfn_t *oos_snapshot;
-    struct oos_fixup *oos_fixup;
     struct vcpu *v;
 
     for_each_vcpu(d, v)
     {
-        oos = v->arch.paging.shadow.oos;
-        oos_fixup = v->arch.paging.shadow.oos_fixup;
-        oos_snapshot = v->arch.paging.shadow.oos_snapshot;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
-        if ( !mfn_eq(oos[idx], gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
-
-        if ( mfn_eq(oos[idx], gmfn) )
+        idx = oos_hash_lookup(v, gmfn);
+        if ( idx >= 0 )
         {
-            _sh_resync(v, gmfn, &oos_fixup[idx], oos_snapshot[idx]);
-            oos[idx] = INVALID_MFN;
+            _sh_resync(v, gmfn, &v->arch.paging.shadow.oos_fixup[idx],
+                       v->arch.paging.shadow.oos_snapshot[idx]);
+            v->arch.paging.shadow.oos[idx] = INVALID_MFN;
             return;
         }
     }
@@ -607,11 +679,13 @@ void sh_resync_all(struct vcpu *v, int skip, int this, int others)
 
     ASSERT(paging_locked_by_me(v->domain));
 
+    perfc_incr(shadow_resync_all);
+
     if ( !this )
         goto resync_others;
 
     /* First: resync all of this vcpu's oos pages */
-    for ( idx = 0; idx < SHADOW_OOS_PAGES; idx++ )
+    for ( idx = 0; idx < v->arch.paging.shadow.oos_size; idx++ )
         if ( mfn_valid(oos[idx]) )
         {
             /* Write-protect and sync contents */
@@ -633,7 +707,7 @@ void sh_resync_all(struct vcpu *v, int skip, int this, int others)
         oos_fixup = other->arch.paging.shadow.oos_fixup;
         oos_snapshot = other->arch.paging.shadow.oos_snapshot;
 
-        for ( idx = 0; idx < SHADOW_OOS_PAGES; idx++ )
+        for ( idx = 0; idx < other->arch.paging.shadow.oos_size; idx++ )
         {
             if ( !mfn_valid(oos[idx]) )
                 continue;
@@ -675,6 +749,7 @@ int sh_unsync(struct vcpu *v, mfn_t gmfn)
          ((SHF_page_type_mask & ~SHF_L1_ANY) | SHF_out_of_sync)
          || sh_page_has_multiple_shadows(pg)
          || !is_hvm_vcpu(v)
+         || !v->arch.paging.shadow.oos_size
          || !v->domain->arch.paging.shadow.oos_active )
         return 0;
 
@@ -2331,10 +2406,43 @@ static void sh_update_paging_modes(struct vcpu *v)
 #endif /* (SHADOW_OPTIMIZATIONS & SHOPT_VIRTUAL_TLB) */
 
 #if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC)
-    if ( mfn_eq(v->arch.paging.shadow.oos_snapshot[0], INVALID_MFN) )
+    /* Make sure this vcpu has its out-of-sync table allocated */
+    if ( unlikely(!v->arch.paging.shadow.oos) && is_hvm_vcpu(v) )
+    {
+        unsigned int i, j;
+
+        v->arch.paging.shadow.oos = xmalloc_array(mfn_t, SHADOW_OOS_PAGES);
+        v->arch.paging.shadow.oos_snapshot =
+            xmalloc_array(mfn_t, SHADOW_OOS_PAGES);
+        v->arch.paging.shadow.oos_fixup =
+            xmalloc_array(struct oos_fixup, SHADOW_OOS_PAGES);
+        if ( unlikely(!v->arch.paging.shadow.oos ||
+                      !v->arch.paging.shadow.oos_snapshot ||
+                      !v->arch.paging.shadow.oos_fixup) )
+        {
+            printk(XENLOG_G_ERR "Could not allocate OOS table for %pv\n", v);
+            domain_crash(v->domain);
+            return;
+        }
+
+        for ( i = 0; i < SHADOW_OOS_PAGES; i++ )
+        {
+            v->arch.paging.shadow.oos[i] = INVALID_MFN;
+            v->arch.paging.shadow.oos_snapshot[i] = INVALID_MFN;
+            v->arch.paging.shadow.oos_fixup[i].next = 0;
+            for ( j = 0; j < SHADOW_OOS_FIXUPS; j++ )
+                v->arch.paging.shadow.oos_fixup[i].smfn[j] = INVALID_MFN;
+        }
+        v->arch.paging.shadow.oos_size = SHADOW_OOS_PAGES_MIN;
+    }
+
+    if ( v->arch.paging.shadow.oos_size &&
+         mfn_eq(v->arch.paging.shadow.oos_snapshot[0], INVALID_MFN) )
     {
-        int i;
-        for(i = 0; i < SHADOW_OOS_PAGES; i++)
+        unsigned int i;
+
+        /* Only the slots in use get snapshots; see oos_hash_resize(). */
+        for ( i = 0; i < v->arch.paging.shadow.oos_size; i++ )
         {
             shadow_prealloc(d, SH_type_oos_snapshot, 1);
             v->arch.paging.shadow.oos_snapshot[i] =
@@ -2769,6 +2877,7 @@ void shadow_teardown(struct domain *d, bool *preempted)
 #endif /* (SHADOW_OPTIMIZATIONS & SHOPT_VIRTUAL_TLB) */
 
 #if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC)
+        if ( v->arch.paging.shadow.oos_snapshot )
         {
             int i;
             mfn_t *oos_snapshot = v->arch.paging.shadow.oos_snapshot;
@@ -2779,6 +2888,12 @@ void shadow_teardown(struct domain *d, bool *preempted)
                     oos_snapshot[i] = INVALID_MFN;
                 }
         }
+
+        /* ... and the out-of-sync table itself */
+        v->arch.paging.shadow.oos_size = 0;
+        XFREE(v->arch.paging.shadow.oos);
+        XFREE(v->arch.paging.shadow.oos_snapshot);
+        XFREE(v->arch.paging.shadow.oos_fixup);
 #endif /* OOS */
     }
 #endif /* (SHADOW_OPTIMIZATIONS & (SHOPT_VIRTUAL_TLB|SHOPT_OUT_OF_SYNC)) */
@@ -2955,6 +3070,7 @@ static int shadow_one_bit_disable(struct domain *d, u32 mode)
                 make_cr3(v, pagetable_get_mfn(v->arch.guest_table));
 
 #if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC)
+            if ( v->arch.paging.shadow.oos_snapshot )
             {
                 int i;
                 mfn_t *oos_snapshot = v->arch.paging.shadow.oos_snapshot;
@@ -53,6 +53,11 @@
 
 #include "x86_emulate/x86_emulate.c"
 
+struct x86_decode_cache *x86_decode_cache_alloc(void)
+{
+    return xzalloc(struct x86_decode_cache);
+}
+
 int x86emul_read_xcr(unsigned int reg, uint64_t *val,
                      struct x86_emulate_ctxt *ctxt)
 {
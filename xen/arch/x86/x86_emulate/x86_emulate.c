@@ -869,7 +869,7 @@ struct x86_emulate_state {
         blk_movdir,
     } blk;
     uint8_t modrm, modrm_mod, modrm_reg, modrm_rm;
-    uint8_t sib_index, sib_scale;
+    uint8_t sib_index, sib_scale, sib_base;
     uint8_t rex_prefix;
     bool lock_prefix;
     bool not_64bit; /* Instruction not available in 64bit. */
@@ -901,6 +901,25 @@ struct x86_emulate_state {
 #endif
 };
 
+#define DECODE_CACHE_ENTRIES 4
+
+struct x86_decode_cache {
+    /* Bytes fetched by the most recent x86_decode(). */
+    uint8_t fetched[MAX_INST_LEN];
+
+    struct decode_cache_entry {
+        /* Lookup key: insn address and what else decoding depends upon. */
+        unsigned long ip;
+        const struct cpuid_policy *cpuid;
+        unsigned int addr_size;
+        /* The insn bytes, and the result of decoding them. */
+        unsigned int len;
+        uint8_t insn[MAX_INST_LEN];
+        unsigned int opcode;
+        struct x86_emulate_state state;
+    } ent[DECODE_CACHE_ENTRIES];
+};
+
 #ifdef __x86_64__
 #define PTR_POISON ((void *)0x8086000000008086UL) /* non-canonical */
 #else
@@ -1297,6 +1316,9 @@ static inline int mkec(uint8_t e, int32_t ec, ...)
                          EXC_GP, 0);                                    \
    rc = ops->insn_fetch(x86_seg_cs, _ip, &_x, (_size), ctxt);           \
    if ( rc ) goto done;                                                 \
+   if ( ctxt->decode_cache )                                            \
+       memcpy(&ctxt->decode_cache->fetched[_ip - ctxt->regs->r(ip)],    \
+              &_x, (_size));                                            \
    _x;                                                                  \
 })
 #define insn_fetch_type(_type) ((_type)insn_fetch_bytes(sizeof(_type)))
@@ -3435,6 +3457,7 @@ x86_decode(
                 uint8_t sib = insn_fetch_type(uint8_t);
                 uint8_t sib_base = (sib & 7) | ((rex_prefix << 3) & 8);
 
+                state->sib_base = sib_base;
                 state->sib_index = ((sib >> 3) & 7) | ((rex_prefix << 2) & 8);
                 state->sib_scale = (sib >> 6) & 3;
                 if ( unlikely(d & vSIB) )
@@ -3681,6 +3704,125 @@ x86_decode(
 #undef insn_fetch_bytes
 #undef insn_fetch_type
 
+/*
+ * Sum of the registers a memory operand's effective address was calculated
+ * from (modulo the address size, which is all that matters).
+ */
+static unsigned long
+decode_ea_regs(const struct x86_emulate_state *state,
+               struct cpu_user_regs *regs)
+{
+    unsigned long val = 0;
+
+    /* No ModRM byte (moffs forms), or no memory operand. */
+    if ( modrm_mod > 2 )
+        return 0;
+
+    if ( ad_bytes == 2 )
+    {
+        /* BX+SI, BX+DI, BP+SI, BP+DI, SI, DI, BP, BX */
+        static const uint8_t base[] = { 3, 3, 5, 5, 6, 7, 5, 3 };
+        static const uint8_t index[] = { 6, 7, 6, 7 };
+
+        if ( modrm_mod == 0 && modrm_rm == 6 )
+            return 0;
+        val = *decode_gpr(regs, base[modrm_rm]);
+        if ( modrm_rm < ARRAY_SIZE(index) )
+            val += *decode_gpr(regs, index[modrm_rm]);
+    }
+    else if ( modrm_rm == 4 )
+    {
+        /* SIB byte present. */
+        if ( state->sib_index != 4 )
+            val = *decode_gpr(regs, state->sib_index) << state->sib_scale;
+        if ( modrm_mod || (state->sib_base & 7) != 5 )
+            val += *decode_gpr(regs, state->sib_base);
+    }
+    else if ( modrm_mod || (modrm_rm & 7) != 5 )
+        val = *decode_gpr(regs, modrm_rm);
+
+    return val;
+}
+
+/*
+ * x86_decode(), but avoiding to repeat it for insns recently decoded at the
+ * same address.  Only the effective address of a memory operand depends on
+ * register state; what's recorded for it is just the displacement, with the
+ * registers' contribution re-added upon re-use.  Anything else depending on
+ * more than the insn bytes and the lookup key (VEX-like encodings, which
+ * need to be told apart from LES, LDS, BOUND, and POP based on mode) doesn't
+ * get cached.
+ */
+static int
+decode_cached(
+    struct x86_emulate_state *state,
+    struct x86_emulate_ctxt *ctxt,
+    const struct x86_emulate_ops *ops)
+{
+    struct x86_decode_cache *cache = ctxt->decode_cache;
+    struct decode_cache_entry *ent;
+    unsigned long ip = ctxt->regs->r(ip);
+    uint8_t insn[MAX_INST_LEN];
+    unsigned long ea_regs;
+    unsigned int b;
+    int rc;
+
+    if ( !cache )
+        return x86_decode(state, ctxt, ops);
+
+    ent = &cache->ent[ip % ARRAY_SIZE(cache->ent)];
+    if ( ent->len && ent->ip == ip && ent->cpuid == ctxt->cpuid &&
+         ent->addr_size == ctxt->addr_size )
+    {
+        rc = ops->insn_fetch(x86_seg_cs, ip, insn, ent->len, ctxt);
+        if ( rc == X86EMUL_OKAY && !memcmp(insn, ent->insn, ent->len) )
+        {
+            *state = ent->state;
+            state->regs = ctxt->regs;
+            if ( ea.type == OP_MEM )
+                ea.mem.off = truncate_ea(ea.mem.off +
+                                         decode_ea_regs(state, ctxt->regs));
+            ctxt->opcode = ent->opcode;
+            return X86EMUL_OKAY;
+        }
+
+        /*
+         * Leave it to regular decoding to deal with faults: the insn may
+         * have changed, and hence its length.
+         */
+        if ( rc == X86EMUL_EXCEPTION )
+            x86_emul_reset_event(ctxt);
+        else if ( rc != X86EMUL_OKAY )
+            return rc;
+
+        ent->len = 0;
+    }
+
+    rc = x86_decode(state, ctxt, ops);
+    if ( rc != X86EMUL_OKAY )
+        return rc;
+
+    b = ctxt->opcode & 0xff;
+    if ( vex.opcx ||
+         (ext == ext_none &&
+          ((b & ~1) == 0xc4 || b == 0x8f || b == 0x62)) )
+        return X86EMUL_OKAY;
+
+    ent->ip = ip;
+    ent->cpuid = ctxt->cpuid;
+    ent->addr_size = ctxt->addr_size;
+    ent->opcode = ctxt->opcode;
+    /* Record the displacement only. */
+    ea_regs = ea.type == OP_MEM ? decode_ea_regs(state, ctxt->regs) : 0;
+    ea.mem.off -= ea_regs;
+    ent->state = *state;
+    ea.mem.off += ea_regs;
+    ent->len = state->ip - ip;
+    memcpy(ent->insn, cache->fetched, ent->len);
+
+    return X86EMUL_OKAY;
+}
+
 /* Undo DEBUG wrapper. */
 #undef x86_emulate
 
@@ -3721,7 +3863,7 @@ x86_emulate(
                            (_regs.eflags & X86_EFLAGS_VIP)),
                           EXC_GP, 0);
 
-    rc = x86_decode(&state, ctxt, ops);
+    rc = decode_cached(&state, ctxt, ops);
     if ( rc != X86EMUL_OKAY )
         return rc;
 
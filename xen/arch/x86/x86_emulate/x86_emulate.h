@@ -575,6 +575,9 @@ struct x86_emulate_ctxt
     /* Caller data that can be used by x86_emulate_ops' routines. */
     void *data;
 
+    /* Cache of recently decoded insns, if any (see x86_decode_cache_alloc()). */
+    struct x86_decode_cache *decode_cache;
+
     /*
      * Input/output state:
      */
@@ -754,6 +757,16 @@ x86_decode_insn(
         void *p_data, unsigned int bytes,
         struct x86_emulate_ctxt *ctxt));
 
+/*
+ * Allocate a cache of recently decoded insns, to be hooked up through
+ * x86_emulate_ctxt.decode_cache.  This allows x86_emulate() to skip most of
+ * the decoding when the same insn gets emulated again at the same address,
+ * as is common for e.g. MMIO accesses done in a loop.  The insn bytes still
+ * get fetched and compared, so modified code won't go unnoticed.  Release
+ * the cache with xfree() (free() in the test harness).
+ */
+struct x86_decode_cache *x86_decode_cache_alloc(void);
+
 unsigned int
 x86_insn_opsize(const struct x86_emulate_state *state);
 int
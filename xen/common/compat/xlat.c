@@ -70,6 +70,10 @@ CHECK_evtchn_reset;
 CHECK_evtchn_set_priority;
 #undef xen_evtchn_set_priority
 
+#define xen_evtchn_set_moderation evtchn_set_moderation
+CHECK_evtchn_set_moderation;
+#undef xen_evtchn_set_moderation
+
 #define xen_mmu_update mmu_update
 CHECK_mmu_update;
 #undef xen_mmu_update
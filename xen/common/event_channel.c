@@ -25,6 +25,7 @@
 #include <xen/compat.h>
 #include <xen/guest_access.h>
 #include <xen/keyhandler.h>
+#include <xen/perfc.h>
 #include <asm/current.h>
 
 #include <public/xen.h>
@@ -263,6 +264,98 @@ static void check_free_port(struct domain *d, evtchn_port_t port)
         write_atomic(&d->active_evtchns, d->active_evtchns - 1);
 }
 
+/*
+ * Per-port notification moderation state.  Allocated when moderation gets
+ * first enabled for a port, and freed only when the port gets closed, such
+ * that senders holding the channel's lock in read mode can use it without
+ * further synchronization.
+ */
+struct evtchn_moderation {
+    spinlock_t lock;
+    bool deferred;            /* Notification pending delivery by timer. */
+    s_time_t gap;
+    s_time_t next;            /* Earliest time of the next delivery. */
+    unsigned long suppressed;
+    struct timer timer;
+    struct domain *domain;
+    evtchn_port_t port;
+};
+
+static void evtchn_moderation_timer(void *data)
+{
+    struct evtchn_moderation *mod = data;
+    struct evtchn *lchn = evtchn_from_port(mod->domain, mod->port);
+    bool deliver;
+
+    evtchn_read_lock(lchn);
+
+    spin_lock(&mod->lock);
+    deliver = mod->deferred;
+    mod->deferred = false;
+    mod->next = NOW() + mod->gap;
+    spin_unlock(&mod->lock);
+
+    if ( deliver && lchn->moderated && lchn->state == ECS_INTERDOMAIN )
+    {
+        struct domain *rd = lchn->u.interdomain.remote_dom;
+        struct evtchn *rchn =
+            evtchn_from_port(rd, lchn->u.interdomain.remote_port);
+
+        if ( !consumer_is_xen(rchn) )
+            evtchn_port_set_pending(rd, rchn->notify_vcpu_id, rchn);
+    }
+
+    evtchn_read_unlock(lchn);
+}
+
+/*
+ * Returns true if a notification through the (moderated) port is to be
+ * deferred.  The caller holds the channel's lock.
+ */
+static bool evtchn_moderate(struct domain *ld, evtchn_port_t lport)
+{
+    struct evtchn_moderation *mod =
+        radix_tree_lookup(&ld->evtchn_moderation, lport);
+    s_time_t now = NOW();
+    bool defer = true;
+
+    if ( !mod )
+        return false;
+
+    spin_lock(&mod->lock);
+
+    if ( mod->deferred )
+        /* Coalesce with the already deferred notification. */;
+    else if ( mod->gap && now < mod->next )
+    {
+        mod->deferred = true;
+        set_timer(&mod->timer, mod->next);
+    }
+    else
+    {
+        mod->next = now + mod->gap;
+        defer = false;
+    }
+
+    if ( defer )
+        mod->suppressed++;
+
+    spin_unlock(&mod->lock);
+
+    if ( defer )
+        perfc_incr(evtchn_moderated);
+
+    return defer;
+}
+
+static void evtchn_moderation_free(void *data)
+{
+    struct evtchn_moderation *mod = data;
+
+    kill_timer(&mod->timer);
+    xfree(mod);
+}
+
 void evtchn_free(struct domain *d, struct evtchn *chn)
 {
     /* Clear pending event to avoid unexpected behavior on re-bind. */
@@ -280,6 +373,7 @@ void evtchn_free(struct domain *d, struct evtchn *chn)
     chn->state          = ECS_FREE;
     chn->notify_vcpu_id = 0;
     chn->xen_consumer   = 0;
+    chn->moderated      = 0;
 
     xsm_evtchn_close_post(chn);
 }
@@ -607,6 +701,7 @@ int evtchn_close(struct domain *d1, int port1, bool guest)
 {
     struct domain *d2 = NULL;
     struct evtchn *chn1 = _evtchn_from_port(d1, port1), *chn2;
+    struct evtchn_moderation *mod = NULL;
     int            rc = 0;
 
     if ( !chn1 )
@@ -724,6 +819,13 @@ int evtchn_close(struct domain *d1, int port1, bool guest)
     evtchn_write_unlock(chn1);
 
  out:
+    if ( !rc )
+    {
+        mod = radix_tree_delete(&d1->evtchn_moderation, port1);
+        if ( mod )
+            d1->nr_moderated_evtchns--;
+    }
+
     if ( d2 != NULL )
     {
         if ( d1 != d2 )
@@ -733,18 +835,27 @@ int evtchn_close(struct domain *d1, int port1, bool guest)
 
     spin_unlock(&d1->event_lock);
 
+    /* The timer handler may still be running, but won't deliver anymore. */
+    if ( mod )
+        evtchn_moderation_free(mod);
+
     return rc;
 }
 
 int evtchn_send(struct domain *ld, unsigned int lport)
 {
     struct evtchn *lchn = _evtchn_from_port(ld, lport), *rchn;
+    struct vcpu   *curr = current;
     struct domain *rd;
     int            rport, ret = 0;
 
     if ( !lchn )
         return -EINVAL;
 
+    /* Account only notifications the domain sends itself. */
+    if ( curr->domain != ld )
+        curr = NULL;
+
     evtchn_read_lock(lchn);
 
     /* Guest cannot send via a Xen-attached event channel. */
@@ -776,13 +887,20 @@ int evtchn_send(struct domain *ld, unsigned int lport)
             rcu_unlock_domain(rd);
             return 0;
         }
-        evtchn_port_set_pending(rd, rchn->notify_vcpu_id, rchn);
+        if ( likely(!lchn->moderated) || !evtchn_moderate(ld, lport) )
+            evtchn_port_set_pending(rd, rchn->notify_vcpu_id, rchn);
+        if ( curr )
+            curr->evtchn_sent++;
         break;
     case ECS_IPI:
         evtchn_port_set_pending(ld, lchn->notify_vcpu_id, lchn);
+        if ( curr )
+            curr->evtchn_sent++;
         break;
     case ECS_UNBOUND:
         /* silently drop the notification */
+        if ( curr )
+            curr->evtchn_sent_unbound++;
         break;
     default:
         ret = -EINVAL;
@@ -1185,6 +1303,80 @@ static int evtchn_set_priority(const struct evtchn_set_priority *set_priority)
     return ret;
 }
 
+static int evtchn_set_moderation(const struct evtchn_set_moderation *set)
+{
+    struct domain *d = current->domain;
+    struct evtchn *chn = _evtchn_from_port(d, set->port);
+    struct evtchn_moderation *mod;
+    int rc = 0;
+
+    if ( !chn || set->min_gap_us > EVTCHN_MODERATION_MAX_GAP_US )
+        return -EINVAL;
+
+    spin_lock(&d->event_lock);
+
+    if ( chn->state != ECS_INTERDOMAIN || consumer_is_xen(chn) )
+    {
+        rc = -EINVAL;
+        goto out;
+    }
+
+    mod = radix_tree_lookup(&d->evtchn_moderation, set->port);
+    if ( !mod )
+    {
+        if ( !set->min_gap_us )
+            goto out;
+
+        /* Like the channels themselves, bounded by the domain's port limit. */
+        if ( d->nr_moderated_evtchns >= d->max_evtchn_port )
+        {
+            rc = -ENOSPC;
+            goto out;
+        }
+
+        mod = xzalloc(struct evtchn_moderation);
+        if ( !mod )
+        {
+            rc = -ENOMEM;
+            goto out;
+        }
+
+        spin_lock_init(&mod->lock);
+        init_timer(&mod->timer, evtchn_moderation_timer, mod,
+                   smp_processor_id());
+        mod->domain = d;
+        mod->port = set->port;
+
+        rc = radix_tree_insert(&d->evtchn_moderation, set->port, mod);
+        if ( rc )
+        {
+            evtchn_moderation_free(mod);
+            goto out;
+        }
+
+        d->nr_moderated_evtchns++;
+
+        /*
+         * Senders look up the state only once they observe the flag, holding
+         * the channel's lock.  Setting it with the lock held in write mode
+         * orders it after the insertion above.
+         */
+        evtchn_write_lock(chn);
+        chn->moderated = 1;
+        evtchn_write_unlock(chn);
+    }
+
+    /* A notification deferred already will still be delivered by the timer. */
+    spin_lock(&mod->lock);
+    mod->gap = MICROSECS(set->min_gap_us);
+    spin_unlock(&mod->lock);
+
+ out:
+    spin_unlock(&d->event_lock);
+
+    return rc;
+}
+
 long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
 {
     int rc;
@@ -1333,6 +1525,14 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case EVTCHNOP_set_moderation: {
+        struct evtchn_set_moderation set_moderation;
+        if ( copy_from_guest(&set_moderation, arg, 1) != 0 )
+            return -EFAULT;
+        rc = evtchn_set_moderation(&set_moderation);
+        break;
+    }
+
     default:
         rc = -ENOSYS;
         break;
@@ -1464,6 +1664,7 @@ int evtchn_init(struct domain *d, unsigned int max_port)
     d->valid_evtchns = EVTCHNS_PER_BUCKET;
 
     spin_lock_init_prof(d, event_lock);
+    radix_tree_init(&d->evtchn_moderation);
     if ( get_free_port(d) != 0 )
     {
         free_evtchn_bucket(d, d->evtchn);
@@ -1523,6 +1724,8 @@ void evtchn_destroy_final(struct domain *d)
 {
     unsigned int i, j;
 
+    radix_tree_destroy(&d->evtchn_moderation, evtchn_moderation_free);
+
     /* Free all event-channel buckets. */
     for ( i = 0; i < NR_EVTCHN_GROUPS; i++ )
     {
@@ -1562,10 +1765,20 @@ static void domain_dump_evtchn_info(struct domain *d)
 {
     unsigned int port;
     int irq;
+    const struct vcpu *v;
+    unsigned long sent = 0, sent_unbound = 0;
+
+    for_each_vcpu ( d, v )
+    {
+        sent += v->evtchn_sent;
+        sent_unbound += v->evtchn_sent_unbound;
+    }
 
     printk("Event channel information for domain %d:\n"
            "Polling vCPUs: {%*pbl}\n"
-           "    port [p/m/s]\n", d->domain_id, d->max_vcpus, d->poll_mask);
+           "Notifications sent: %lu (%lu to unbound ports)\n"
+           "    port [p/m/s]\n", d->domain_id, d->max_vcpus, d->poll_mask,
+           sent, sent_unbound);
 
     spin_lock(&d->event_lock);
 
@@ -1597,6 +1810,14 @@ static void domain_dump_evtchn_info(struct domain *d)
             printk(" d=%d p=%d",
                    chn->u.interdomain.remote_dom->domain_id,
                    chn->u.interdomain.remote_port);
+            if ( chn->moderated )
+            {
+                const struct evtchn_moderation *mod =
+                    radix_tree_lookup(&d->evtchn_moderation, port);
+
+                printk(" g=%"PRI_stime"us sup=%lu",
+                       mod->gap / MICROSECS(1), mod->suppressed);
+            }
             break;
         case ECS_PIRQ:
             irq = domain_pirq_to_irq(d, chn->u.pirq.irq);
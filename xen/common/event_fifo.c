@@ -16,6 +16,7 @@
 #include <xen/paging.h>
 #include <xen/mm.h>
 #include <xen/domain_page.h>
+#include <xen/perfc.h>
 
 #include <asm/guest_atomics.h>
 
@@ -182,6 +183,23 @@ static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
         return;
     }
 
+    /*
+     * An event which is already pending and linked needs nothing further
+     * doing: setting PENDING and LINKED again below would be no-ops, and no
+     * notification of the vCPU or pollers would result.  Avoid taking the
+     * queue locks in this case, which is common for busy interdomain
+     * channels.  A guest clearing either bit after the check is about to
+     * process the event anyway, just like it would be if we had done so
+     * under the locks.
+     */
+    if ( (read_atomic(word) &
+          ((1U << EVTCHN_FIFO_PENDING) | (1U << EVTCHN_FIFO_LINKED))) ==
+         ((1U << EVTCHN_FIFO_PENDING) | (1U << EVTCHN_FIFO_LINKED)) )
+    {
+        perfc_incr(evtchn_fifo_set_pending_fast);
+        return;
+    }
+
     /*
      * Lock all queues related to the event channel (in case of a queue change
      * this might be two).
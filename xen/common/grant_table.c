@@ -40,6 +40,7 @@
 #include <xen/radix-tree.h>
 #include <xen/vmap.h>
 #include <xen/nospec.h>
+#include <xen/perfc.h>
 #include <xsm/xsm.h>
 #include <asm/flushtlb.h>
 #include <asm/guest_atomics.h>
@@ -423,6 +424,28 @@ static inline void gnttab_flush_tlb(const struct domain *d)
         arch_flush_tlb_mask(d->dirty_cpumask);
 }
 
+/*
+ * IOMMU TLB flushes needed by the (un)map operations of a batch get issued
+ * once for the whole batch.  Failures are logged (and the domain crashed if
+ * it isn't the hardware domain) by the IOMMU code.  As the individual
+ * operations have already reported success by then, the failure is reported
+ * for the batch as a whole, by the hypercall failing with -EIO.
+ */
+static inline void gnttab_iommu_gather_begin(struct domain *d)
+{
+    iommu_flush_gather_begin(d);
+}
+
+static inline int gnttab_iommu_gather_end(struct domain *d)
+{
+    if ( likely(!iommu_flush_gather_end(d)) )
+        return 0;
+
+    gdprintk(XENLOG_WARNING, "IOMMU flush of grant batch failed\n");
+
+    return -EIO;
+}
+
 static inline unsigned int
 num_act_frames_from_sha_frames(const unsigned int num)
 {
@@ -555,17 +578,50 @@ _get_maptrack_handle(struct grant_table *t, struct vcpu *v)
 }
 
 /*
- * Try to "steal" a free maptrack entry from another VCPU.
+ * Number of free maptrack entries moved from another VCPU at a time. Taking
+ * a batch lets the thief satisfy subsequent requests from its own free
+ * list, rather than having to steal (and take remote locks) for every
+ * single map operation.
+ */
+#define MAPTRACK_STEAL_BATCH 16
+
+/*
+ * Prepend the chain of free entries [first, last] to the free list of @v.
+ * The entries must already be owned by @v.
+ */
+static void maptrack_freelist_add(struct grant_table *t, struct vcpu *v,
+                                  grant_handle_t first, grant_handle_t last)
+{
+    spin_lock(&v->maptrack_freelist_lock);
+
+    /* Uninitialized free list? The chain's last entry becomes the tail. */
+    if ( v->maptrack_tail == MAPTRACK_TAIL )
+    {
+        maptrack_entry(t, last).ref = MAPTRACK_TAIL;
+        v->maptrack_tail = last;
+    }
+    else
+        maptrack_entry(t, last).ref = v->maptrack_head;
+    v->maptrack_head = first;
+
+    spin_unlock(&v->maptrack_freelist_lock);
+}
+
+/*
+ * Try to "steal" free maptrack entries from another VCPU.
  *
- * A stolen entry is transferred to the thief, so the number of
- * entries for each VCPU should tend to the usage pattern.
+ * Stolen entries are transferred to the thief, so the number of
+ * entries for each VCPU should tend to the usage pattern.  Up to
+ * MAPTRACK_STEAL_BATCH entries are taken from the first VCPU found to have
+ * any to spare, one of which gets returned while the others are added to
+ * the thief's free list.
  *
  * To avoid having to atomically count the number of free entries on
  * each VCPU and to avoid two VCPU repeatedly stealing entries from
  * each other, the initial victim VCPU is selected randomly.
  */
 static grant_handle_t steal_maptrack_handle(struct grant_table *t,
-                                            const struct vcpu *curr)
+                                            struct vcpu *curr)
 {
     const struct domain *currd = curr->domain;
     unsigned int first, i;
@@ -574,14 +630,50 @@ static grant_handle_t steal_maptrack_handle(struct grant_table *t,
     first = i = get_random() % currd->max_vcpus;
 
     do {
-        if ( currd->vcpu[i] )
+        struct vcpu *v = currd->vcpu[i];
+
+        if ( v && v != curr )
         {
-            grant_handle_t handle;
+            grant_handle_t handle, last = INVALID_MAPTRACK_HANDLE, next;
+            unsigned int n = 0;
+
+            spin_lock(&v->maptrack_freelist_lock);
 
-            handle = _get_maptrack_handle(t, currd->vcpu[i]);
-            if ( handle != INVALID_MAPTRACK_HANDLE )
+            /*
+             * Detach entries from the head, always leaving at least one
+             * entry (the tail) on the victim's list.
+             */
+            handle = next = v->maptrack_head;
+            while ( next != MAPTRACK_TAIL && n < MAPTRACK_STEAL_BATCH &&
+                    maptrack_entry(t, next).ref != MAPTRACK_TAIL )
             {
-                maptrack_entry(t, handle).vcpu = curr->vcpu_id;
+                last = next;
+                next = maptrack_entry(t, next).ref;
+                n++;
+            }
+            if ( n )
+                v->maptrack_head = next;
+
+            spin_unlock(&v->maptrack_freelist_lock);
+
+            if ( n )
+            {
+                perfc_incr(maptrack_steal);
+                perfc_add(maptrack_stolen, n);
+
+                /* The detached chain is private to us now. */
+                for ( next = handle; ; next = maptrack_entry(t, next).ref )
+                {
+                    maptrack_entry(t, next).vcpu = curr->vcpu_id;
+                    if ( next == last )
+                        break;
+                }
+
+                if ( n > 1 )
+                    maptrack_freelist_add(t, curr,
+                                          maptrack_entry(t, handle).ref,
+                                          last);
+
                 return handle;
             }
         }
@@ -614,8 +706,14 @@ put_maptrack_handle(
     tail = v->maptrack_tail;
     v->maptrack_tail = handle;
 
-    /* 3. Update the old tail entry to point to the new entry. */
-    maptrack_entry(t, tail).ref = handle;
+    /*
+     * 3. Update the old tail entry to point to the new entry, or start the
+     *    list if a single stolen entry was all this VCPU ever had.
+     */
+    if ( unlikely(tail == MAPTRACK_TAIL) )
+        v->maptrack_head = handle;
+    else
+        maptrack_entry(t, tail).ref = handle;
 
     spin_unlock(&v->maptrack_freelist_lock);
 }
@@ -647,23 +745,6 @@ get_maptrack_handle(
     if ( !new_mt )
     {
         spin_unlock(&lgt->maptrack_lock);
-
-        /*
-         * Uninitialized free list? Steal an extra entry for the tail
-         * sentinel.
-         */
-        if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        {
-            handle = steal_maptrack_handle(lgt, curr);
-            if ( handle == INVALID_MAPTRACK_HANDLE )
-                return handle;
-            spin_lock(&curr->maptrack_freelist_lock);
-            maptrack_entry(lgt, handle).ref = MAPTRACK_TAIL;
-            curr->maptrack_tail = handle;
-            if ( curr->maptrack_head == MAPTRACK_TAIL )
-                curr->maptrack_head = handle;
-            spin_unlock(&curr->maptrack_freelist_lock);
-        }
         return steal_maptrack_handle(lgt, curr);
     }
 
@@ -682,17 +763,22 @@ get_maptrack_handle(
         new_mt[i].vcpu = curr->vcpu_id;
     }
 
-    /* Set tail directly if this is the first page for the local vCPU. */
-    if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        curr->maptrack_tail = handle + MAPTRACK_PER_PAGE - 1;
-
     lgt->maptrack[nr_maptrack_frames(lgt)] = new_mt;
     smp_wmb();
     lgt->maptrack_limit += MAPTRACK_PER_PAGE;
 
     spin_unlock(&lgt->maptrack_lock);
 
+    /*
+     * Set tail directly if the local vCPU's free list is still empty.  This
+     * needs doing together with updating the head, under the free list lock:
+     * put_maptrack_handle() on another vCPU may be starting the list with an
+     * entry stolen earlier.  The list being empty implies the head being
+     * MAPTRACK_TAIL as well.
+     */
     spin_lock(&curr->maptrack_freelist_lock);
+    if ( curr->maptrack_tail == MAPTRACK_TAIL )
+        curr->maptrack_tail = handle + MAPTRACK_PER_PAGE - 1;
     new_mt[i - 1].ref = curr->maptrack_head;
     curr->maptrack_head = handle + 1;
     spin_unlock(&curr->maptrack_freelist_lock);
@@ -1295,6 +1381,11 @@ map_grant_ref(
     {
         replace_grant_host_mapping(op->host_addr, mfn, 0, op->flags);
         gnttab_flush_tlb(ld);
+        /*
+         * The page references get dropped right below.  A failure is
+         * reported by gnttab_iommu_gather_end() for the batch.
+         */
+        iommu_flush_gather_sync(ld);
     }
 
     while ( typecnt-- )
@@ -1326,23 +1417,39 @@ gnttab_map_grant_ref(
     XEN_GUEST_HANDLE_PARAM(gnttab_map_grant_ref_t) uop, unsigned int count)
 {
     int i;
+    long rc = 0;
     struct gnttab_map_grant_ref op;
+    struct domain *ld = current->domain;
+
+    gnttab_iommu_gather_begin(ld);
 
     for ( i = 0; i < count; i++ )
     {
         if ( i && hypercall_preempt_check() )
-            return i;
+        {
+            rc = i;
+            break;
+        }
 
         if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
 
         map_grant_ref(&op);
 
         if ( unlikely(__copy_to_guest_offset(uop, i, &op, 1)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
     }
 
-    return 0;
+    if ( unlikely(gnttab_iommu_gather_end(ld)) )
+        rc = -EIO;
+
+    return rc;
 }
 
 static void
@@ -1630,15 +1737,18 @@ static long
 gnttab_unmap_grant_ref(
     XEN_GUEST_HANDLE_PARAM(gnttab_unmap_grant_ref_t) uop, unsigned int count)
 {
-    int i, c, partial_done, done = 0;
+    int i, c, partial_done, done = 0, rc;
     struct gnttab_unmap_grant_ref op;
     struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
+    struct domain *ld = current->domain;
 
     while ( count != 0 )
     {
         c = min(count, (unsigned int)GNTTAB_UNMAP_BATCH_SIZE);
         partial_done = 0;
 
+        gnttab_iommu_gather_begin(ld);
+
         for ( i = 0; i < c; i++ )
         {
             if ( unlikely(__copy_from_guest(&op, uop, 1)) )
@@ -1650,11 +1760,15 @@ gnttab_unmap_grant_ref(
             guest_handle_add_offset(uop, 1);
         }
 
-        gnttab_flush_tlb(current->domain);
+        rc = gnttab_iommu_gather_end(ld);
+        gnttab_flush_tlb(ld);
 
         for ( i = 0; i < partial_done; i++ )
             unmap_common_complete(&common[i]);
 
+        if ( unlikely(rc) )
+            return rc;
+
         count -= c;
         done += c;
 
@@ -1665,11 +1779,12 @@ gnttab_unmap_grant_ref(
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
+    rc = gnttab_iommu_gather_end(ld);
+    gnttab_flush_tlb(ld);
 
     for ( i = 0; i < partial_done; i++ )
         unmap_common_complete(&common[i]);
-    return -EFAULT;
+    return rc ?: -EFAULT;
 }
 
 static void
@@ -1695,15 +1810,18 @@ static long
 gnttab_unmap_and_replace(
     XEN_GUEST_HANDLE_PARAM(gnttab_unmap_and_replace_t) uop, unsigned int count)
 {
-    int i, c, partial_done, done = 0;
+    int i, c, partial_done, done = 0, rc;
     struct gnttab_unmap_and_replace op;
     struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
+    struct domain *ld = current->domain;
 
     while ( count != 0 )
     {
         c = min(count, (unsigned int)GNTTAB_UNMAP_BATCH_SIZE);
         partial_done = 0;
 
+        gnttab_iommu_gather_begin(ld);
+
         for ( i = 0; i < c; i++ )
         {
             if ( unlikely(__copy_from_guest(&op, uop, 1)) )
@@ -1715,11 +1833,15 @@ gnttab_unmap_and_replace(
             guest_handle_add_offset(uop, 1);
         }
 
-        gnttab_flush_tlb(current->domain);
+        rc = gnttab_iommu_gather_end(ld);
+        gnttab_flush_tlb(ld);
 
         for ( i = 0; i < partial_done; i++ )
             unmap_common_complete(&common[i]);
 
+        if ( unlikely(rc) )
+            return rc;
+
         count -= c;
         done += c;
 
@@ -1730,11 +1852,12 @@ gnttab_unmap_and_replace(
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
+    rc = gnttab_iommu_gather_end(ld);
+    gnttab_flush_tlb(ld);
 
     for ( i = 0; i < partial_done; i++ )
         unmap_common_complete(&common[i]);
-    return -EFAULT;
+    return rc ?: -EFAULT;
 }
 
 static int
@@ -2769,25 +2892,41 @@ struct gnttab_copy_buf {
     bool_t have_type;
 };
 
+/*
+ * Number of frames kept mapped per side of a batch of copy operations.
+ * Backends often split copies such that consecutive operations alternate
+ * between a few source or destination frames (e.g. packet fragments
+ * spanning page boundaries), which would otherwise re-acquire and re-map
+ * the same frames over and over.
+ */
+#define GNTTAB_COPY_NR_BUFS 4
+
+struct gnttab_copy_side {
+    domid_t domid;
+    struct domain *domain;
+    unsigned int victim;
+    struct gnttab_copy_buf bufs[GNTTAB_COPY_NR_BUFS];
+};
+
 static int gnttab_copy_lock_domain(domid_t domid, bool is_gref,
-                                   struct gnttab_copy_buf *buf)
+                                   struct gnttab_copy_side *side)
 {
     /* Only DOMID_SELF may reference via frame. */
     if ( domid != DOMID_SELF && !is_gref )
         return GNTST_permission_denied;
 
-    buf->domain = rcu_lock_domain_by_any_id(domid);
+    side->domain = rcu_lock_domain_by_any_id(domid);
 
-    if ( !buf->domain )
+    if ( !side->domain )
         return GNTST_bad_domain;
 
-    buf->ptr.domid = domid;
+    side->domid = domid;
 
     return GNTST_okay;
 }
 
-static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
-                                       struct gnttab_copy_buf *dest)
+static void gnttab_copy_unlock_domains(struct gnttab_copy_side *src,
+                                       struct gnttab_copy_side *dest)
 {
     if ( src->domain )
     {
@@ -2802,8 +2941,8 @@ static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
 }
 
 static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
-                                    struct gnttab_copy_buf *src,
-                                    struct gnttab_copy_buf *dest)
+                                    struct gnttab_copy_side *src,
+                                    struct gnttab_copy_side *dest)
 {
     int rc;
 
@@ -2853,6 +2992,14 @@ static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
     }
 }
 
+static void gnttab_copy_release_side(struct gnttab_copy_side *side)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(side->bufs); i++ )
+        gnttab_copy_release_buf(&side->bufs[i]);
+}
+
 static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
                                  const struct gnttab_copy_ptr *ptr,
                                  struct gnttab_copy_buf *buf,
@@ -2862,6 +3009,8 @@ static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
 
     buf->read_only = gref_flag == GNTCOPY_source_gref;
 
+    perfc_incr(gnttab_copy_claim);
+
     if ( op->flags & gref_flag )
     {
         rc = acquire_grant_for_copy(buf->domain, ptr->u.ref,
@@ -2920,6 +3069,45 @@ static bool_t gnttab_copy_buf_valid(const struct gnttab_copy_ptr *p,
     return p->u.gmfn == b->ptr.u.gmfn;
 }
 
+/*
+ * Find the frame referenced by @ptr among the ones mapped for this side of
+ * the copy, claiming it in place of the least recently claimed one if it
+ * isn't.
+ */
+static int gnttab_copy_get_buf(const struct gnttab_copy *op,
+                               const struct gnttab_copy_ptr *ptr,
+                               struct gnttab_copy_side *side,
+                               unsigned int gref_flag,
+                               struct gnttab_copy_buf **pbuf)
+{
+    struct gnttab_copy_buf *buf = NULL;
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(side->bufs); i++ )
+    {
+        if ( gnttab_copy_buf_valid(ptr, &side->bufs[i], op->flags & gref_flag) )
+        {
+            *pbuf = &side->bufs[i];
+            return GNTST_okay;
+        }
+        if ( !buf && !side->bufs[i].virt )
+            buf = &side->bufs[i];
+    }
+
+    if ( !buf )
+    {
+        buf = &side->bufs[side->victim];
+        if ( ++side->victim == ARRAY_SIZE(side->bufs) )
+            side->victim = 0;
+    }
+
+    gnttab_copy_release_buf(buf);
+    buf->domain = side->domain;
+    *pbuf = buf;
+
+    return gnttab_copy_claim_buf(op, ptr, buf, gref_flag);
+}
+
 static int gnttab_copy_buf(const struct gnttab_copy *op,
                            struct gnttab_copy_buf *dest,
                            const struct gnttab_copy_buf *src)
@@ -2950,22 +3138,25 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
     memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
            op->len);
     gnttab_mark_dirty(dest->domain, dest->mfn);
+    perfc_incr(gnttab_copy);
+    perfc_add(gnttab_copy_bytes, op->len);
     rc = GNTST_okay;
  out:
     return rc;
 }
 
 static int gnttab_copy_one(const struct gnttab_copy *op,
-                           struct gnttab_copy_buf *dest,
-                           struct gnttab_copy_buf *src)
+                           struct gnttab_copy_side *dest,
+                           struct gnttab_copy_side *src)
 {
+    struct gnttab_copy_buf *src_buf, *dest_buf;
     int rc;
 
-    if ( !src->domain || op->source.domid != src->ptr.domid ||
-         !dest->domain || op->dest.domid != dest->ptr.domid )
+    if ( !src->domain || op->source.domid != src->domid ||
+         !dest->domain || op->dest.domid != dest->domid )
     {
-        gnttab_copy_release_buf(src);
-        gnttab_copy_release_buf(dest);
+        gnttab_copy_release_side(src);
+        gnttab_copy_release_side(dest);
         gnttab_copy_unlock_domains(src, dest);
 
         rc = gnttab_copy_lock_domains(op, src, dest);
@@ -2973,27 +3164,17 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
             goto out;
     }
 
-    /* Different source? */
-    if ( !gnttab_copy_buf_valid(&op->source, src,
-                                op->flags & GNTCOPY_source_gref) )
-    {
-        gnttab_copy_release_buf(src);
-        rc = gnttab_copy_claim_buf(op, &op->source, src, GNTCOPY_source_gref);
-        if ( rc )
-            goto out;
-    }
+    rc = gnttab_copy_get_buf(op, &op->source, src, GNTCOPY_source_gref,
+                             &src_buf);
+    if ( rc )
+        goto out;
 
-    /* Different dest? */
-    if ( !gnttab_copy_buf_valid(&op->dest, dest,
-                                op->flags & GNTCOPY_dest_gref) )
-    {
-        gnttab_copy_release_buf(dest);
-        rc = gnttab_copy_claim_buf(op, &op->dest, dest, GNTCOPY_dest_gref);
-        if ( rc )
-            goto out;
-    }
+    rc = gnttab_copy_get_buf(op, &op->dest, dest, GNTCOPY_dest_gref,
+                             &dest_buf);
+    if ( rc )
+        goto out;
 
-    rc = gnttab_copy_buf(op, dest, src);
+    rc = gnttab_copy_buf(op, dest_buf, src_buf);
  out:
     return rc;
 }
@@ -3011,8 +3192,8 @@ static long gnttab_copy(
 {
     unsigned int i;
     struct gnttab_copy op;
-    struct gnttab_copy_buf src = {};
-    struct gnttab_copy_buf dest = {};
+    struct gnttab_copy_side src = {};
+    struct gnttab_copy_side dest = {};
     long rc = 0;
 
     for ( i = 0; i < count; i++ )
@@ -3037,8 +3218,8 @@ static long gnttab_copy(
         }
         if ( rc != GNTST_okay )
         {
-            gnttab_copy_release_buf(&src);
-            gnttab_copy_release_buf(&dest);
+            gnttab_copy_release_side(&src);
+            gnttab_copy_release_side(&dest);
         }
 
         op.status = rc;
@@ -3051,8 +3232,8 @@ static long gnttab_copy(
         guest_handle_add_offset(uop, 1);
     }
 
-    gnttab_copy_release_buf(&src);
-    gnttab_copy_release_buf(&dest);
+    gnttab_copy_release_side(&src);
+    gnttab_copy_release_side(&dest);
     gnttab_copy_unlock_domains(&src, &dest);
 
     return rc;
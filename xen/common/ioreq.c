@@ -24,8 +24,11 @@
 #include <xen/irq.h>
 #include <xen/lib.h>
 #include <xen/paging.h>
+#include <xen/perfc.h>
+#include <xen/rcupdate.h>
 #include <xen/sched.h>
 #include <xen/softirq.h>
+#include <xen/sort.h>
 #include <xen/trace.h>
 #include <xen/vpci.h>
 
@@ -267,9 +270,9 @@ bool vcpu_ioreq_handle_completion(struct vcpu *v)
     return res;
 }
 
-static int ioreq_server_alloc_mfn(struct ioreq_server *s, bool buf)
+static int ioreq_server_alloc_mfn(struct ioreq_server *s,
+                                  struct ioreq_page *iorp)
 {
-    struct ioreq_page *iorp = buf ? &s->bufioreq : &s->ioreq;
     struct page_info *page;
 
     if ( iorp->page )
@@ -315,9 +318,9 @@ static int ioreq_server_alloc_mfn(struct ioreq_server *s, bool buf)
     return -ENOMEM;
 }
 
-static void ioreq_server_free_mfn(struct ioreq_server *s, bool buf)
+static void ioreq_server_free_mfn(struct ioreq_server *s,
+                                  struct ioreq_page *iorp)
 {
-    struct ioreq_page *iorp = buf ? &s->bufioreq : &s->ioreq;
     struct page_info *page = iorp->page;
 
     if ( !page )
@@ -342,11 +345,20 @@ bool is_ioreq_server_page(struct domain *d, const struct page_info *page)
 
     FOR_EACH_IOREQ_SERVER(d, id, s)
     {
+        unsigned int i;
+
         if ( (s->ioreq.page == page) || (s->bufioreq.page == page) )
         {
             found = true;
             break;
         }
+
+        for ( i = 0; i < (1u << s->bufioreq_order) - 1; i++ )
+            if ( s->bufioreq_ext[i].page == page )
+                found = true;
+
+        if ( found )
+            break;
     }
 
     spin_unlock_recursive(&d->ioreq_server.lock);
@@ -475,23 +487,37 @@ static void ioreq_server_remove_all_vcpus(struct ioreq_server *s)
 
 static int ioreq_server_alloc_pages(struct ioreq_server *s)
 {
+    unsigned int i;
     int rc;
 
-    rc = ioreq_server_alloc_mfn(s, false);
+    rc = ioreq_server_alloc_mfn(s, &s->ioreq);
 
     if ( !rc && (s->bufioreq_handling != HVM_IOREQSRV_BUFIOREQ_OFF) )
-        rc = ioreq_server_alloc_mfn(s, true);
+    {
+        rc = ioreq_server_alloc_mfn(s, &s->bufioreq);
+
+        for ( i = 0; !rc && i < (1u << s->bufioreq_order) - 1; i++ )
+            rc = ioreq_server_alloc_mfn(s, &s->bufioreq_ext[i]);
+    }
 
     if ( rc )
-        ioreq_server_free_mfn(s, false);
+    {
+        for ( i = 0; i < ARRAY_SIZE(s->bufioreq_ext); i++ )
+            ioreq_server_free_mfn(s, &s->bufioreq_ext[i]);
+        ioreq_server_free_mfn(s, &s->ioreq);
+    }
 
     return rc;
 }
 
 static void ioreq_server_free_pages(struct ioreq_server *s)
 {
-    ioreq_server_free_mfn(s, true);
-    ioreq_server_free_mfn(s, false);
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(s->bufioreq_ext); i++ )
+        ioreq_server_free_mfn(s, &s->bufioreq_ext[i]);
+    ioreq_server_free_mfn(s, &s->bufioreq);
+    ioreq_server_free_mfn(s, &s->ioreq);
 }
 
 static void ioreq_server_free_rangesets(struct ioreq_server *s)
@@ -540,6 +566,169 @@ static int ioreq_server_alloc_rangesets(struct ioreq_server *s,
     return rc;
 }
 
+/*
+ * To avoid walking every server's rangesets for each emulated access, the
+ * ranges of all enabled servers are kept in one sorted array per range type,
+ * rebuilt whenever a range is (un)mapped or a server changes state.  Ranges
+ * of different servers may legitimately overlap, in which case the highest
+ * numbered server wins; a binary search can't express that, so the walk is
+ * kept for range types with such overlaps.
+ */
+struct ioreq_range {
+    unsigned long start, end;
+    unsigned int id;
+};
+
+struct ioreq_range_index {
+    struct rcu_head rcu;
+    unsigned int nr[NR_IO_RANGE_TYPES];
+    bool overlap[NR_IO_RANGE_TYPES];
+    struct ioreq_range *range[NR_IO_RANGE_TYPES];
+    struct ioreq_range ranges[];
+};
+
+static DEFINE_RCU_READ_LOCK(ioreq_index_rcu_lock);
+
+struct ioreq_index_fill {
+    struct ioreq_range *range;
+    unsigned int nr, id;
+};
+
+static int ioreq_index_count(unsigned long s, unsigned long e, void *arg)
+{
+    ++*(unsigned int *)arg;
+
+    return 0;
+}
+
+static int ioreq_index_add(unsigned long s, unsigned long e, void *arg)
+{
+    struct ioreq_index_fill *fill = arg;
+
+    fill->range[fill->nr].start = s;
+    fill->range[fill->nr].end = e;
+    fill->range[fill->nr].id = fill->id;
+    fill->nr++;
+
+    return 0;
+}
+
+static int ioreq_range_cmp(const void *a, const void *b)
+{
+    const struct ioreq_range *l = a, *r = b;
+
+    if ( l->start != r->start )
+        return l->start < r->start ? -1 : 1;
+
+    return 0;
+}
+
+static void ioreq_range_swap(void *a, void *b, size_t size)
+{
+    struct ioreq_range t = *(struct ioreq_range *)a;
+
+    *(struct ioreq_range *)a = *(struct ioreq_range *)b;
+    *(struct ioreq_range *)b = t;
+}
+
+static void ioreq_range_index_free(struct rcu_head *rcu)
+{
+    xfree(container_of(rcu, struct ioreq_range_index, rcu));
+}
+
+/*
+ * Rebuild the range index of a domain.  Failure to allocate a new index
+ * isn't fatal: without one ioreq_server_select() falls back to the walk.
+ */
+static void ioreq_range_index_update(struct domain *d)
+{
+    struct ioreq_range_index *idx, *old = d->ioreq_server.index;
+    struct ioreq_server *s;
+    unsigned int id, type, i, total = 0;
+
+    ASSERT(spin_is_locked(&d->ioreq_server.lock));
+
+    perfc_incr(ioreq_index_rebuild);
+
+    FOR_EACH_IOREQ_SERVER(d, id, s)
+    {
+        if ( !s->enabled )
+            continue;
+
+        for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+            rangeset_report_ranges(s->range[type], 0, ~0UL,
+                                   ioreq_index_count, &total);
+    }
+
+    idx = xmalloc_flex_struct(struct ioreq_range_index, ranges, total);
+    if ( idx )
+    {
+        struct ioreq_range *next = idx->ranges;
+
+        for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+        {
+            struct ioreq_index_fill fill = { .range = next };
+            unsigned long max_end = 0;
+
+            FOR_EACH_IOREQ_SERVER(d, id, s)
+            {
+                if ( !s->enabled )
+                    continue;
+
+                fill.id = id;
+                rangeset_report_ranges(s->range[type], 0, ~0UL,
+                                       ioreq_index_add, &fill);
+            }
+
+            sort(next, fill.nr, sizeof(*next), ioreq_range_cmp,
+                 ioreq_range_swap);
+
+            idx->range[type] = next;
+            idx->nr[type] = fill.nr;
+            idx->overlap[type] = false;
+            for ( i = 0; i < fill.nr; i++ )
+            {
+                if ( i && next[i].start <= max_end )
+                    idx->overlap[type] = true;
+                max_end = max(max_end, next[i].end);
+            }
+
+            next += fill.nr;
+        }
+    }
+
+    rcu_assign_pointer(d->ioreq_server.index, idx);
+
+    if ( old )
+        call_rcu(&old->rcu, ioreq_range_index_free);
+}
+
+/* Returns the id of the server owning [start, end], or MAX_NR_IOREQ_SERVERS. */
+static unsigned int ioreq_range_index_lookup(const struct ioreq_range_index *idx,
+                                             unsigned int type,
+                                             unsigned long start,
+                                             unsigned long end)
+{
+    const struct ioreq_range *range = idx->range[type];
+    unsigned int lo = 0, hi = idx->nr[type];
+
+    /* Find the last range starting at or below start. */
+    while ( lo < hi )
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if ( range[mid].start <= start )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if ( !lo || range[lo - 1].end < end )
+        return MAX_NR_IOREQ_SERVERS;
+
+    return range[lo - 1].id;
+}
+
 static void ioreq_server_enable(struct ioreq_server *s)
 {
     struct ioreq_vcpu *sv;
@@ -579,10 +768,12 @@ static void ioreq_server_disable(struct ioreq_server *s)
 
 static int ioreq_server_init(struct ioreq_server *s,
                              struct domain *d, int bufioreq_handling,
+                             unsigned int bufioreq_order, unsigned int flags,
                              ioservid_t id)
 {
     struct domain *currd = current->domain;
     struct vcpu *v;
+    unsigned int i;
     int rc;
 
     s->target = d;
@@ -596,12 +787,16 @@ static int ioreq_server_init(struct ioreq_server *s,
 
     s->ioreq.gfn = INVALID_GFN;
     s->bufioreq.gfn = INVALID_GFN;
+    for ( i = 0; i < ARRAY_SIZE(s->bufioreq_ext); i++ )
+        s->bufioreq_ext[i].gfn = INVALID_GFN;
 
     rc = ioreq_server_alloc_rangesets(s, id);
     if ( rc )
         return rc;
 
     s->bufioreq_handling = bufioreq_handling;
+    s->bufioreq_order = bufioreq_order;
+    s->multi_page = flags & XEN_DMOP_ioreq_multi_page;
 
     for_each_vcpu ( d, v )
     {
@@ -645,6 +840,7 @@ static void ioreq_server_deinit(struct ioreq_server *s)
 }
 
 static int ioreq_server_create(struct domain *d, int bufioreq_handling,
+                               unsigned int bufioreq_order, unsigned int flags,
                                ioservid_t *id)
 {
     struct ioreq_server *s;
@@ -657,6 +853,13 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
     if ( bufioreq_handling > HVM_IOREQSRV_BUFIOREQ_ATOMIC )
         return -EINVAL;
 
+    if ( bufioreq_order > XEN_DMOP_BUFIOREQ_MAX_ORDER ||
+         (bufioreq_order && !bufioreq_handling) )
+        return -EINVAL;
+
+    if ( flags & ~XEN_DMOP_ioreq_multi_page )
+        return -EINVAL;
+
     s = xzalloc(struct ioreq_server);
     if ( !s )
         return -ENOMEM;
@@ -680,7 +883,7 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
      */
     set_ioreq_server(d, i, s);
 
-    rc = ioreq_server_init(s, d, bufioreq_handling, i);
+    rc = ioreq_server_init(s, d, bufioreq_handling, bufioreq_order, flags, i);
     if ( rc )
     {
         set_ioreq_server(d, i, NULL);
@@ -733,6 +936,8 @@ static int ioreq_server_destroy(struct domain *d, ioservid_t id)
     ioreq_server_deinit(s);
     set_ioreq_server(d, id, NULL);
 
+    ioreq_range_index_update(d);
+
     domain_unpause(d);
 
     xfree(s);
@@ -767,6 +972,11 @@ static int ioreq_server_get_info(struct domain *d, ioservid_t id,
 
     if ( ioreq_gfn || bufioreq_gfn )
     {
+        /* Multi-page buffered rings can only be set up by resource mapping. */
+        rc = -EOPNOTSUPP;
+        if ( s->bufioreq_order )
+            goto out;
+
         rc = arch_ioreq_server_map_pages(s);
         if ( rc )
             goto out;
@@ -834,6 +1044,15 @@ int ioreq_server_get_frame(struct domain *d, ioservid_t id,
 
     default:
         rc = -EINVAL;
+        if ( idx < XENMEM_resource_ioreq_server_frame_bufioreq_ext(0) )
+            break;
+
+        idx -= XENMEM_resource_ioreq_server_frame_bufioreq_ext(0);
+        if ( !HANDLE_BUFIOREQ(s) || idx >= (1u << s->bufioreq_order) - 1 )
+            break;
+
+        *mfn = page_to_mfn(s->bufioreq_ext[idx].page);
+        rc = 0;
         break;
     }
 
@@ -888,6 +1107,8 @@ static int ioreq_server_map_io_range(struct domain *d, ioservid_t id,
         goto out;
 
     rc = rangeset_add_range(r, start, end);
+    if ( !rc && s->enabled )
+        ioreq_range_index_update(d);
 
  out:
     spin_unlock_recursive(&d->ioreq_server.lock);
@@ -940,6 +1161,8 @@ static int ioreq_server_unmap_io_range(struct domain *d, ioservid_t id,
         goto out;
 
     rc = rangeset_remove_range(r, start, end);
+    if ( !rc && s->enabled )
+        ioreq_range_index_update(d);
 
  out:
     spin_unlock_recursive(&d->ioreq_server.lock);
@@ -1015,6 +1238,8 @@ static int ioreq_server_set_state(struct domain *d, ioservid_t id,
     else
         ioreq_server_disable(s);
 
+    ioreq_range_index_update(d);
+
     domain_unpause(d);
 
     rc = 0;
@@ -1098,63 +1323,125 @@ void ioreq_server_destroy_all(struct domain *d)
         xfree(s);
     }
 
+    /* No need to wait for readers as the domain is being torn down */
+    xfree(d->ioreq_server.index);
+    d->ioreq_server.index = NULL;
+
     spin_unlock_recursive(&d->ioreq_server.lock);
 }
 
+static struct ioreq_server *ioreq_server_walk(struct domain *d,
+                                              unsigned int type,
+                                              unsigned long start,
+                                              unsigned long end)
+{
+    struct ioreq_server *s;
+    unsigned int id;
+
+    FOR_EACH_IOREQ_SERVER(d, id, s)
+    {
+        if ( s->enabled &&
+             rangeset_contains_range(s->range[type], start, end) )
+            return s;
+    }
+
+    return NULL;
+}
+
 struct ioreq_server *ioreq_server_select(struct domain *d,
                                          ioreq_t *p)
 {
+    const struct ioreq_range_index *idx;
     struct ioreq_server *s;
     uint8_t type;
     uint64_t addr;
+    unsigned long start, end;
     unsigned int id;
 
     if ( !arch_ioreq_server_get_type_addr(d, p, &type, &addr) )
         return NULL;
 
-    FOR_EACH_IOREQ_SERVER(d, id, s)
+    switch ( type )
     {
-        struct rangeset *r;
-
-        if ( !s->enabled )
-            continue;
+    case XEN_DMOP_IO_RANGE_PORT:
+        start = addr;
+        end = start + p->size - 1;
+        break;
 
-        r = s->range[type];
+    case XEN_DMOP_IO_RANGE_MEMORY:
+        start = ioreq_mmio_first_byte(p);
+        end = ioreq_mmio_last_byte(p);
+        break;
 
-        switch ( type )
-        {
-            unsigned long start, end;
+    case XEN_DMOP_IO_RANGE_PCI:
+        start = end = addr >> 32;
+        break;
 
-        case XEN_DMOP_IO_RANGE_PORT:
-            start = addr;
-            end = start + p->size - 1;
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+    default:
+        return NULL;
+    }
 
-            break;
+    rcu_read_lock(&ioreq_index_rcu_lock);
 
-        case XEN_DMOP_IO_RANGE_MEMORY:
-            start = ioreq_mmio_first_byte(p);
-            end = ioreq_mmio_last_byte(p);
+    idx = rcu_dereference(d->ioreq_server.index);
+    if ( idx && !idx->overlap[type] )
+    {
+        perfc_incr(ioreq_select_indexed);
 
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+        id = ioreq_range_index_lookup(idx, type, start, end);
+        s = id < MAX_NR_IOREQ_SERVERS ? GET_IOREQ_SERVER(d, id) : NULL;
+    }
+    else
+    {
+        perfc_incr(ioreq_select_walk);
 
-            break;
+        s = ioreq_server_walk(d, type, start, end);
+    }
 
-        case XEN_DMOP_IO_RANGE_PCI:
-            if ( rangeset_contains_singleton(r, addr >> 32) )
-            {
-                p->type = IOREQ_TYPE_PCI_CONFIG;
-                p->addr = addr;
-                return s;
-            }
+    rcu_read_unlock(&ioreq_index_rcu_lock);
 
-            break;
-        }
+    if ( s && type == XEN_DMOP_IO_RANGE_PCI )
+    {
+        p->type = IOREQ_TYPE_PCI_CONFIG;
+        p->addr = addr;
     }
 
-    return NULL;
+    return s;
+}
+
+static buf_ioreq_t *bufioreq_slot(struct ioreq_server *s, unsigned int idx)
+{
+    buffered_iopage_t *pg = s->bufioreq.va;
+    buffered_iopage_ext_t *ext;
+
+    idx %= IOREQ_BUFFER_SLOTS(s->bufioreq_order);
+    if ( idx < IOREQ_BUFFER_SLOT_NUM )
+        return &pg->buf_ioreq[idx];
+
+    idx -= IOREQ_BUFFER_SLOT_NUM;
+    ext = s->bufioreq_ext[idx / IOREQ_BUFFER_EXT_SLOT_NUM].va;
+
+    return &ext->buf_ioreq[idx % IOREQ_BUFFER_EXT_SLOT_NUM];
+}
+
+/*
+ * Number of free slots in the buffered ring.  Only a hint, unless the
+ * caller serializes all producers which may fill the ring.
+ */
+unsigned int ioreq_server_bufioreq_space(struct ioreq_server *s)
+{
+    const buffered_iopage_t *pg = s->bufioreq.va;
+    union bufioreq_pointers ptrs;
+    unsigned int used;
+
+    if ( !pg )
+        return 0;
+
+    ptrs.full = read_atomic(&pg->ptrs.full);
+    used = ptrs.write_pointer - ptrs.read_pointer;
+
+    return used < IOREQ_BUFFER_SLOTS(s->bufioreq_order)
+           ? IOREQ_BUFFER_SLOTS(s->bufioreq_order) - used : 0;
 }
 
 static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
@@ -1162,6 +1449,7 @@ static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
     struct domain *d = current->domain;
     struct ioreq_page *iorp;
     buffered_iopage_t *pg;
+    unsigned int nr_slots = IOREQ_BUFFER_SLOTS(s->bufioreq_order);
     buf_ioreq_t bp = { .data = p->data,
                        .addr = p->addr,
                        .type = p->type,
@@ -1171,6 +1459,7 @@ static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
 
     /* Ensure buffered_iopage fits in a page */
     BUILD_BUG_ON(sizeof(buffered_iopage_t) > PAGE_SIZE);
+    BUILD_BUG_ON(sizeof(buffered_iopage_ext_t) > PAGE_SIZE);
 
     iorp = &s->bufioreq;
     pg = iorp->va;
@@ -1212,19 +1501,19 @@ static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
     spin_lock(&s->bufioreq_lock);
 
     if ( (pg->ptrs.write_pointer - pg->ptrs.read_pointer) >=
-         (IOREQ_BUFFER_SLOT_NUM - qw) )
+         (nr_slots - qw) )
     {
         /* The queue is full: send the iopacket through the normal path. */
         spin_unlock(&s->bufioreq_lock);
         return IOREQ_STATUS_UNHANDLED;
     }
 
-    pg->buf_ioreq[pg->ptrs.write_pointer % IOREQ_BUFFER_SLOT_NUM] = bp;
+    *bufioreq_slot(s, pg->ptrs.write_pointer) = bp;
 
     if ( qw )
     {
         bp.data = p->data >> 32;
-        pg->buf_ioreq[(pg->ptrs.write_pointer+1) % IOREQ_BUFFER_SLOT_NUM] = bp;
+        *bufioreq_slot(s, pg->ptrs.write_pointer + 1) = bp;
     }
 
     /* Make the ioreq_t visible /before/ write_pointer. */
@@ -1233,14 +1522,14 @@ static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
 
     /* Canonicalize read/write pointers to prevent their overflow. */
     while ( (s->bufioreq_handling == HVM_IOREQSRV_BUFIOREQ_ATOMIC) &&
-            qw++ < IOREQ_BUFFER_SLOT_NUM &&
-            pg->ptrs.read_pointer >= IOREQ_BUFFER_SLOT_NUM )
+            qw++ < nr_slots &&
+            pg->ptrs.read_pointer >= nr_slots )
     {
         union bufioreq_pointers old = pg->ptrs, new;
-        unsigned int n = old.read_pointer / IOREQ_BUFFER_SLOT_NUM;
+        unsigned int n = old.read_pointer / nr_slots;
 
-        new.read_pointer = old.read_pointer - n * IOREQ_BUFFER_SLOT_NUM;
-        new.write_pointer = old.write_pointer - n * IOREQ_BUFFER_SLOT_NUM;
+        new.read_pointer = old.read_pointer - n * nr_slots;
+        new.write_pointer = old.write_pointer - n * nr_slots;
         guest_cmpxchg64(s->emulator, &pg->ptrs.full, old.full, new.full);
     }
 
@@ -1349,10 +1638,11 @@ int ioreq_server_dm_op(struct xen_dm_op *op, struct domain *d, bool *const_op)
         *const_op = false;
 
         rc = -EINVAL;
-        if ( data->pad[0] || data->pad[1] || data->pad[2] )
+        if ( data->pad )
             break;
 
         rc = ioreq_server_create(d, data->handle_bufioreq,
+                                 data->bufioreq_order, data->flags,
                                  &data->id);
         break;
     }
@@ -192,6 +192,11 @@ static void populate_physmap(struct memop_args *a)
         a->memflags |= MEMF_no_icache_flush;
     }
 
+#ifdef CONFIG_HAS_PASSTHROUGH
+    /* Issue a single IOMMU TLB flush for all the extents populated below. */
+    iommu_flush_gather_begin(d);
+#endif
+
     for ( i = a->nr_done; i < a->nr_extents; i++ )
     {
         mfn_t mfn;
@@ -279,6 +284,15 @@ static void populate_physmap(struct memop_args *a)
     }
 
 out:
+#ifdef CONFIG_HAS_PASSTHROUGH
+    /*
+     * Report the extents populated so far, but don't continue the hypercall
+     * if the IOMMU couldn't be flushed for them.
+     */
+    if ( unlikely(iommu_flush_gather_end(d)) )
+        a->preempted = 0;
+#endif
+
     if ( need_tlbflush )
         filtered_flush_tlb_mask(tlbflush_timestamp);
 
@@ -1084,8 +1098,12 @@ unsigned int ioreq_server_max_frames(const struct domain *d)
     unsigned int nr = 0;
 
 #ifdef CONFIG_IOREQ_SERVER
+    /*
+     * One frame for the buf-ioreq ring, and one frame per 128 vcpus.  The
+     * extension frames of multi-page buf-ioreq rings live at a separate range
+     * of indexes, and are documented as not being included.
+     */
     if ( is_hvm_domain(d) )
-        /* One frame for the buf-ioreq ring, and one frame per 128 vcpus. */
         nr = 1 + DIV_ROUND_UP(d->max_vcpus * sizeof(struct ioreq), PAGE_SIZE);
 #endif
 
@@ -1113,6 +1131,13 @@ static unsigned int resource_max_frames(const struct domain *d,
     case XENMEM_resource_vmtrace_buf:
         return d->vmtrace_size >> PAGE_SHIFT;
 
+    case XENMEM_resource_dirty_ring:
+#if defined(CONFIG_X86) && defined(CONFIG_HVM)
+        return id ? 0 : paging_dirty_ring_max_frames(d);
+#else
+        return 0;
+#endif
+
     default:
         return -EOPNOTSUPP;
     }
@@ -1176,6 +1201,20 @@ static int acquire_vmtrace_buf(
     return nr_frames;
 }
 
+static int acquire_dirty_ring(
+    struct domain *d, unsigned int id, unsigned int frame,
+    unsigned int nr_frames, xen_pfn_t mfn_list[])
+{
+#if defined(CONFIG_X86) && defined(CONFIG_HVM)
+    if ( id )
+        return -EINVAL;
+
+    return paging_dirty_ring_acquire(d, frame, nr_frames, mfn_list);
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
 /*
  * Returns -errno on error, or positive in the range [1, nr_frames] on
  * success.  Returning less than nr_frames contitutes a request for a
@@ -1196,6 +1235,9 @@ static int _acquire_resource(
     case XENMEM_resource_vmtrace_buf:
         return acquire_vmtrace_buf(d, id, frame, nr_frames, mfn_list);
 
+    case XENMEM_resource_dirty_ring:
+        return acquire_dirty_ring(d, id, frame, nr_frames, mfn_list);
+
     default:
         return -EOPNOTSUPP;
     }
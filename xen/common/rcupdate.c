@@ -45,9 +45,38 @@
 #include <xen/softirq.h>
 #include <xen/cpu.h>
 #include <xen/stop_machine.h>
+#include <xen/hypfs.h>
 
 DEFINE_PER_CPU(unsigned int, rcu_lock_cnt);
 
+/*
+ * Quiescent states are tracked with a two level tree. Each leaf (struct
+ * rcu_node) covers RCU_NODE_FANOUT consecutive cpus, and records which of
+ * them still need to go through a quiescent state for the current batch.
+ * The cpu clearing the last bit of a node then reports the node to the root
+ * (rcu_ctrlblk), which completes the batch once all nodes have reported.
+ *
+ * This way, cpus only contend on the lock of their node, and the global lock
+ * is only taken once per node per grace period.
+ *
+ * Lock ordering: rcu_ctrlblk.lock can be held while taking an rcu_node lock,
+ * but not the other way round.
+ */
+#define RCU_NODE_FANOUT 16
+#define RCU_NR_NODES    DIV_ROUND_UP(NR_CPUS, RCU_NODE_FANOUT)
+
+static struct rcu_node {
+    spinlock_t    lock;
+    long          batch;  /* Batch qsmask refers to                   */
+    unsigned long qsmask; /* CPUs (bit: cpu % RCU_NODE_FANOUT) still  */
+                          /* to go through a quiescent state.         */
+} __cacheline_aligned rcu_nodes[RCU_NR_NODES] = {
+    [0 ... RCU_NR_NODES - 1] = {
+        .lock = SPIN_LOCK_UNLOCKED,
+        .batch = -300,
+    },
+};
+
 /* Global control variables for rcupdate callback mechanism. */
 static struct rcu_ctrlblk {
     long cur;           /* Current batch number.                      */
@@ -55,15 +84,27 @@ static struct rcu_ctrlblk {
     int  next_pending;  /* Is the next batch already waiting?         */
 
     spinlock_t  lock __cacheline_aligned;
-    cpumask_t   cpumask; /* CPUs that need to switch in order ... */
+    DECLARE_BITMAP(nodemask, RCU_NR_NODES); /* Nodes with CPUs that need
+                                             * to switch in order ... */
     cpumask_t   idle_cpumask; /* ... unless they are already idle */
     /* for current batch to proceed.        */
+    s_time_t    batch_start;  /* When the current batch started */
 } __cacheline_aligned rcu_ctrlblk = {
     .cur = -300,
     .completed = -300,
     .lock = SPIN_LOCK_UNLOCKED,
 };
 
+/* Grace period statistics, updated with rcu_ctrlblk.lock held. */
+static uint64_t rcu_gp_count;   /* # of grace periods completed       */
+static uint64_t rcu_gp_time;    /* Total duration of grace periods (ns) */
+static uint64_t rcu_gp_max;     /* Longest grace period (ns)          */
+
+static inline unsigned int rcu_nr_nodes(void)
+{
+    return DIV_ROUND_UP(nr_cpu_ids, RCU_NODE_FANOUT);
+}
+
 /*
  * Per-CPU data for Read-Copy Update.
  * nxtlist - new callbacks are added here
@@ -249,14 +290,27 @@ static void force_quiescent_state(struct rcu_data *rdp,
                                   struct rcu_ctrlblk *rcp)
 {
     cpumask_t cpumask;
+    unsigned int node, i;
+
     raise_softirq(RCU_SOFTIRQ);
     if (unlikely(rdp->qlen - rdp->last_rs_qlen > rsinterval)) {
         rdp->last_rs_qlen = rdp->qlen;
+        /*
+         * Collect the CPUs which have not reported yet. This is done
+         * without holding any lock, as it is only a hint.
+         */
+        cpumask_clear(&cpumask);
+        for_each_set_bit(node, rcp->nodemask, rcu_nr_nodes()) {
+            unsigned long qsmask = read_atomic(&rcu_nodes[node].qsmask);
+
+            for_each_set_bit(i, &qsmask, RCU_NODE_FANOUT)
+                __cpumask_set_cpu(node * RCU_NODE_FANOUT + i, &cpumask);
+        }
         /*
          * Don't send IPI to itself. With irqs disabled,
          * rdp->cpu is the current cpu.
          */
-        cpumask_andnot(&cpumask, &rcp->cpumask, cpumask_of(rdp->cpu));
+        __cpumask_clear_cpu(rdp->cpu, &cpumask);
         cpumask_raise_softirq(&cpumask, RCU_SOFTIRQ);
     }
 }
@@ -326,18 +380,59 @@ static void rcu_do_batch(struct rcu_data *rdp)
  * - A new grace period is started.
  *   This is done by rcu_start_batch. The start is not broadcasted to
  *   all cpus, they must pick this up by comparing rcp->cur with
- *   rdp->quiescbatch. All cpus are recorded  in the
- *   rcu_ctrlblk.cpumask bitmap.
+ *   rdp->quiescbatch. All cpus are recorded in the qsmask of their
+ *   rcu_node, and all the nodes with at least one cpu in the
+ *   rcu_ctrlblk.nodemask bitmap.
  * - All cpus must go through a quiescent state.
  *   Since the start of the grace period is not broadcasted, at least two
  *   calls to rcu_check_quiescent_state are required:
  *   The first call just notices that a new grace period is running. The
  *   following calls check if there was a quiescent state since the beginning
- *   of the grace period. If so, it updates rcu_ctrlblk.cpumask. If
- *   the bitmap is empty, then the grace period is completed.
+ *   of the grace period. If so, it updates the qsmask of the cpu's node and,
+ *   if that becomes empty, rcu_ctrlblk.nodemask. If the latter is empty,
+ *   then the grace period is completed.
  *   rcu_check_quiescent_state calls rcu_start_batch(0) to start the next grace
  *   period (if necessary).
  */
+static void rcu_batch_done(struct rcu_ctrlblk *rcp);
+
+/*
+ * Set up all the nodes for the batch which is just starting.
+ * Caller must hold rcu_ctrlblk.lock.
+ */
+static void rcu_init_nodes(struct rcu_ctrlblk *rcp)
+{
+    cpumask_t cpumask;
+    unsigned int node, cpu;
+
+    cpumask_andnot(&cpumask, &cpu_online_map, &rcp->idle_cpumask);
+    bitmap_zero(rcp->nodemask, RCU_NR_NODES);
+
+    for (node = 0; node < rcu_nr_nodes(); node++) {
+        struct rcu_node *rnp = &rcu_nodes[node];
+        unsigned long qsmask = 0;
+
+        for (cpu = node * RCU_NODE_FANOUT;
+             cpu < min((node + 1) * RCU_NODE_FANOUT, nr_cpu_ids); cpu++)
+            if (cpumask_test_cpu(cpu, &cpumask))
+                qsmask |= 1UL << (cpu % RCU_NODE_FANOUT);
+
+        spin_lock(&rnp->lock);
+        rnp->batch = rcp->cur;
+        rnp->qsmask = qsmask;
+        spin_unlock(&rnp->lock);
+
+        if (qsmask)
+            __set_bit(node, rcp->nodemask);
+    }
+
+    rcp->batch_start = NOW();
+
+    /* Nobody to wait for (e.g., all other cpus idle). */
+    if (bitmap_empty(rcp->nodemask, RCU_NR_NODES))
+        rcu_batch_done(rcp);
+}
+
 /*
  * Register a new batch of callbacks, and start it up if there is currently no
  * active batch and the batch to be registered has not already occurred.
@@ -357,30 +452,80 @@ static void rcu_start_batch(struct rcu_ctrlblk *rcp)
 
        /*
         * Make sure the increment of rcp->cur is visible so, even if a
-        * CPU that is about to go idle, is captured inside rcp->cpumask,
+        * CPU that is about to go idle, is captured inside its node qsmask,
         * rcu_pending() will return false, which then means cpu_quiet()
         * will be invoked, before the CPU would actually enter idle.
         *
         * This barrier is paired with the one in rcu_idle_enter().
         */
         smp_mb();
-        cpumask_andnot(&rcp->cpumask, &cpu_online_map, &rcp->idle_cpumask);
+        rcu_init_nodes(rcp);
     }
 }
 
 /*
- * cpu went through a quiescent state since the beginning of the grace period.
- * Clear it from the cpu mask and complete the grace period if it was the last
- * cpu. Start another grace period if someone has further entries pending
+ * All the nodes reported a quiescent state: the batch is completed. Start
+ * another grace period if someone has further entries pending.
+ * Caller must hold rcu_ctrlblk.lock.
  */
-static void cpu_quiet(int cpu, struct rcu_ctrlblk *rcp)
+static void rcu_batch_done(struct rcu_ctrlblk *rcp)
 {
-    cpumask_clear_cpu(cpu, &rcp->cpumask);
-    if (cpumask_empty(&rcp->cpumask)) {
-        /* batch completed ! */
-        rcp->completed = rcp->cur;
-        rcu_start_batch(rcp);
+    s_time_t duration = NOW() - rcp->batch_start;
+
+    rcp->completed = rcp->cur;
+
+    rcu_gp_count++;
+    if (duration > 0) {
+        rcu_gp_time += duration;
+        if (duration > rcu_gp_max)
+            rcu_gp_max = duration;
     }
+
+    rcu_start_batch(rcp);
+}
+
+/*
+ * cpu went through a quiescent state since the beginning of the grace period
+ * of batch. Clear it from its node and, if it was the last cpu of the node,
+ * report the node to the root, completing the grace period if it was the last
+ * node.
+ */
+static void cpu_quiet(unsigned int cpu, long batch, struct rcu_ctrlblk *rcp)
+{
+    unsigned int node = cpu / RCU_NODE_FANOUT;
+    struct rcu_node *rnp = &rcu_nodes[node];
+    unsigned long bit = 1UL << (cpu % RCU_NODE_FANOUT);
+    bool last;
+
+    spin_lock(&rnp->lock);
+    if (unlikely(rcu_batch_before(rnp->batch, batch))) {
+        /*
+         * batch is being started on another cpu, which has not set up our
+         * node yet. As this happens with rcu_ctrlblk.lock held, waiting for
+         * the lock to be released is enough for the node to catch up.
+         */
+        spin_unlock(&rnp->lock);
+        spin_barrier(&rcp->lock);
+        spin_lock(&rnp->lock);
+    }
+    /* A stale batch (e.g., during cpu startup) is just ignored. */
+    last = rnp->batch == batch && (rnp->qsmask & bit) &&
+           !(rnp->qsmask &= ~bit);
+    spin_unlock(&rnp->lock);
+
+    if (!last)
+        return;
+
+    /*
+     * We cleared the last cpu of the node, so nobody else can report this
+     * node and the batch can't have completed yet.
+     */
+    spin_lock(&rcp->lock);
+    ASSERT(rcp->cur == batch && rcp->completed != batch);
+    __clear_bit(node, rcp->nodemask);
+    if (bitmap_empty(rcp->nodemask, RCU_NR_NODES))
+        rcu_batch_done(rcp);
+    spin_unlock(&rcp->lock);
 }
 
 /*
@@ -407,15 +552,11 @@ static void rcu_check_quiescent_state(struct rcu_ctrlblk *rcp,
 
     rdp->qs_pending = 0;
 
-    spin_lock(&rcp->lock);
     /*
-     * rdp->quiescbatch/rcp->cur and the cpu bitmap can come out of sync
-     * during cpu startup. Ignore the quiescent state.
+     * rdp->quiescbatch/rcp->cur and the node masks can come out of sync
+     * during cpu startup. cpu_quiet() ignores the quiescent state then.
      */
-    if (likely(rdp->quiescbatch == rcp->cur))
-        cpu_quiet(rdp->cpu, rcp);
-
-    spin_unlock(&rcp->lock);
+    cpu_quiet(rdp->cpu, rdp->quiescbatch, rcp);
 }
 
 
@@ -579,7 +720,7 @@ static void rcu_idle_timer_handler(void* data)
 {
     perfc_incr(rcu_idle_timer);
 
-    if ( !cpumask_empty(&rcu_ctrlblk.cpumask) )
+    if ( rcu_ctrlblk.cur != rcu_ctrlblk.completed )
         idle_timer_period = min(idle_timer_period + IDLE_TIMER_PERIOD_INCR,
                                 IDLE_TIMER_PERIOD_MAX);
     else
@@ -608,15 +749,20 @@ static void rcu_move_batch(struct rcu_data *this_rdp, struct rcu_head *list,
 static void rcu_offline_cpu(struct rcu_data *this_rdp,
                             struct rcu_ctrlblk *rcp, struct rcu_data *rdp)
 {
+    long batch;
+    bool in_progress;
+
     kill_timer(&rdp->idle_timer);
 
     /* If the cpu going offline owns the grace period we can block
      * indefinitely waiting for it, so flush it here.
      */
     spin_lock(&rcp->lock);
-    if (rcp->cur != rcp->completed)
-        cpu_quiet(rdp->cpu, rcp);
+    batch = rcp->cur;
+    in_progress = rcp->cur != rcp->completed;
     spin_unlock(&rcp->lock);
+    if (in_progress)
+        cpu_quiet(rdp->cpu, batch, rcp);
 
     rcu_move_batch(this_rdp, rdp->donelist, rdp->donetail);
     rcu_move_batch(this_rdp, rdp->curlist, rdp->curtail);
@@ -703,7 +849,7 @@ void rcu_idle_enter(unsigned int cpu)
      * If some other CPU is starting a new grace period, we'll notice that
      * by seeing a new value in rcp->cur (different than our quiescbatch).
      * That will force us all the way until cpu_quiet(), clearing our bit
-     * in rcp->cpumask, even in case we managed to get in there.
+     * in our node qsmask, even in case we managed to get in there.
      *
      * Se the comment before cpumask_andnot() in  rcu_start_batch().
      */
@@ -718,3 +864,21 @@ void rcu_idle_exit(unsigned int cpu)
     ASSERT(cpumask_test_cpu(cpu, &rcu_ctrlblk.idle_cpumask));
     cpumask_clear_cpu(cpu, &rcu_ctrlblk.idle_cpumask);
 }
+
+#ifdef CONFIG_HYPFS
+static HYPFS_DIR_INIT(rcu_dir, "rcu");
+static HYPFS_UINT_INIT(rcu_gp_count_leaf, "grace-periods", rcu_gp_count);
+static HYPFS_UINT_INIT(rcu_gp_time_leaf, "grace-period-time", rcu_gp_time);
+static HYPFS_UINT_INIT(rcu_gp_max_leaf, "grace-period-max", rcu_gp_max);
+
+static int __init rcu_hypfs_init(void)
+{
+    hypfs_add_dir(&hypfs_root, &rcu_dir, true);
+    hypfs_add_leaf(&rcu_dir, &rcu_gp_count_leaf, true);
+    hypfs_add_leaf(&rcu_dir, &rcu_gp_time_leaf, true);
+    hypfs_add_leaf(&rcu_dir, &rcu_gp_max_leaf, true);
+
+    return 0;
+}
+__initcall(rcu_hypfs_init);
+#endif
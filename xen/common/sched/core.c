@@ -87,6 +87,8 @@ DEFINE_PER_CPU(cpumask_t, cpumask_scratch);
 /* How many urgent vcpus. */
 DEFINE_PER_CPU(atomic_t, sched_urgent_count);
 
+DEFINE_PER_CPU(struct sched_stats, sched_stats);
+
 extern const struct scheduler *__start_schedulers_array[], *__end_schedulers_array[];
 #define NUM_SCHEDULERS (__end_schedulers_array - __start_schedulers_array)
 #define schedulers __start_schedulers_array
@@ -259,6 +261,49 @@ static inline void vcpu_urgent_count_update(struct vcpu *v)
     }
 }
 
+/*
+ * Wait time histogram bucket: bucket i is for waits shorter than 8^i "us",
+ * with 1us approximated to 1024ns. The last bucket takes all longer waits.
+ */
+static inline unsigned int sched_stats_bucket(s_time_t wait)
+{
+    unsigned int b = wait > 0 ? (flsl(wait >> 10) + 2) / 3 : 0;
+
+    return min(b, SCHED_STATS_WAIT_BUCKETS - 1U);
+}
+
+static inline void sched_stats_runstate_change(
+    const struct vcpu *v, int new_state, s_time_t delta)
+{
+    struct sched_stats *stats = &per_cpu(sched_stats, v->processor);
+
+    switch ( v->runstate.state )
+    {
+    case RUNSTATE_runnable:
+        stats->nr_runnable--;
+        if ( new_state != RUNSTATE_running )
+            break;
+        stats->runs++;
+        if ( delta > 0 )
+        {
+            stats->wait_time += delta;
+            if ( delta > stats->wait_max )
+                stats->wait_max = delta;
+        }
+        stats->wait_hist[sched_stats_bucket(delta)]++;
+        break;
+
+    case RUNSTATE_blocked:
+    case RUNSTATE_offline:
+        if ( new_state == RUNSTATE_runnable )
+            stats->wakeups++;
+        break;
+    }
+
+    if ( new_state == RUNSTATE_runnable )
+        stats->nr_runnable++;
+}
+
 static inline void vcpu_runstate_change(
     struct vcpu *v, int new_state, s_time_t new_entry_time)
 {
@@ -280,6 +325,10 @@ static inline void vcpu_runstate_change(
     }
 
     delta = new_entry_time - v->runstate.state_entry_time;
+
+    if ( !is_idle_vcpu(v) )
+        sched_stats_runstate_change(v, new_state, delta);
+
     if ( delta > 0 )
     {
         v->runstate.time[v->runstate.state] += delta;
@@ -2105,6 +2154,57 @@ long sched_adjust_global(struct xen_sysctl_scheduler_op *op)
     return rc;
 }
 
+void sched_stats_collect(const cpumask_t *cpus,
+                         struct xen_sysctl_sched_stats *op)
+{
+    unsigned int cpu, i;
+    int nr_runnable = 0;
+
+    op->wakeups = op->runs = op->wait_time = op->wait_max = 0;
+    op->migrations = op->ratelimit_hits = 0;
+    for ( i = 0; i < SCHED_STATS_WAIT_BUCKETS; i++ )
+        op->wait_hist[i] = 0;
+
+    /* Values are read without any locking: they might be slightly off. */
+    for_each_cpu ( cpu, cpus )
+    {
+        const struct sched_stats *stats = &per_cpu(sched_stats, cpu);
+
+        op->wakeups += stats->wakeups;
+        op->runs += stats->runs;
+        op->wait_time += stats->wait_time;
+        op->wait_max = max(op->wait_max, stats->wait_max);
+        for ( i = 0; i < SCHED_STATS_WAIT_BUCKETS; i++ )
+            op->wait_hist[i] += stats->wait_hist[i];
+        op->migrations += stats->migrations;
+        op->ratelimit_hits += stats->ratelimit_hits;
+        nr_runnable += stats->nr_runnable;
+    }
+
+    op->nr_runnable = max(nr_runnable, 0);
+}
+
+long sched_stats_get(struct xen_sysctl_sched_stats *op)
+{
+    struct cpupool *pool;
+
+    if ( op->cpupool_id == XEN_SYSCTL_CPUPOOL_PAR_ANY )
+    {
+        sched_stats_collect(&cpu_online_map, op);
+        return 0;
+    }
+
+    pool = cpupool_get_by_id(op->cpupool_id);
+    if ( pool == NULL )
+        return -ESRCH;
+
+    sched_stats_collect(pool->cpu_valid, op);
+
+    cpupool_put(pool);
+
+    return 0;
+}
+
 static void vcpu_periodic_timer_work_locked(struct vcpu *v)
 {
     s_time_t now;
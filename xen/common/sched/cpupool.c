@@ -1191,6 +1191,96 @@ static char granstr[SCHED_GRAN_NAME_LEN] = {
     [SCHED_GRAN_NAME_LEN - 1] = 0
 };
 
+/*
+ * The statistics leaves point into cpupool_stats_layout only for telling
+ * which field they represent. Actual values are collected when reading.
+ */
+static const struct xen_sysctl_sched_stats cpupool_stats_layout;
+
+static int cpupool_stats_read(const struct hypfs_entry *entry,
+                              XEN_GUEST_HANDLE_PARAM(void) uaddr)
+{
+    const struct hypfs_entry_leaf *leaf =
+        container_of(entry, const struct hypfs_entry_leaf, e);
+    const struct hypfs_dyndir_id *data;
+    const struct cpupool *cpupool;
+    struct xen_sysctl_sched_stats stats;
+    unsigned int off;
+
+    data = hypfs_get_dyndata();
+    cpupool = data->data;
+    ASSERT(cpupool);
+
+    off = leaf->u.content - (const void *)&cpupool_stats_layout;
+    ASSERT(off + entry->size <= sizeof(stats));
+
+    sched_stats_collect(cpupool->cpu_valid, &stats);
+
+    return copy_to_guest(uaddr, (const void *)&stats + off, entry->size) ?
+           -EFAULT : 0;
+}
+
+static const struct hypfs_funcs cpupool_stats_funcs = {
+    .enter = hypfs_node_enter,
+    .exit = hypfs_node_exit,
+    .read = cpupool_stats_read,
+    .write = hypfs_write_deny,
+    .getsize = hypfs_getsize,
+    .findentry = hypfs_leaf_findentry,
+};
+
+#define CPUPOOL_STATS_INIT(var, nam, field)                   \
+    static HYPFS_FIXEDSIZE_INIT(var, XEN_HYPFS_TYPE_UINT, nam, \
+                                cpupool_stats_layout.field,   \
+                                &cpupool_stats_funcs, 0)
+
+static HYPFS_DIR_INIT(cpupool_stats_dir, "stats");
+CPUPOOL_STATS_INIT(cpupool_stats_runnable, "runnable", nr_runnable);
+CPUPOOL_STATS_INIT(cpupool_stats_wakeups, "wakeups", wakeups);
+CPUPOOL_STATS_INIT(cpupool_stats_runs, "runs", runs);
+CPUPOOL_STATS_INIT(cpupool_stats_wait_time, "wait-time", wait_time);
+CPUPOOL_STATS_INIT(cpupool_stats_wait_max, "wait-max", wait_max);
+CPUPOOL_STATS_INIT(cpupool_stats_migrations, "migrations", migrations);
+CPUPOOL_STATS_INIT(cpupool_stats_ratelimit, "ratelimit-hits",
+                   ratelimit_hits);
+
+static HYPFS_DIR_INIT(cpupool_stats_hist_dir, "wait-hist");
+CPUPOOL_STATS_INIT(cpupool_stats_hist0, "0", wait_hist[0]);
+CPUPOOL_STATS_INIT(cpupool_stats_hist1, "1", wait_hist[1]);
+CPUPOOL_STATS_INIT(cpupool_stats_hist2, "2", wait_hist[2]);
+CPUPOOL_STATS_INIT(cpupool_stats_hist3, "3", wait_hist[3]);
+CPUPOOL_STATS_INIT(cpupool_stats_hist4, "4", wait_hist[4]);
+CPUPOOL_STATS_INIT(cpupool_stats_hist5, "5", wait_hist[5]);
+CPUPOOL_STATS_INIT(cpupool_stats_hist6, "6", wait_hist[6]);
+CPUPOOL_STATS_INIT(cpupool_stats_hist7, "7", wait_hist[7]);
+
+static struct hypfs_entry_leaf *const cpupool_stats_hist[] = {
+    &cpupool_stats_hist0, &cpupool_stats_hist1, &cpupool_stats_hist2,
+    &cpupool_stats_hist3, &cpupool_stats_hist4, &cpupool_stats_hist5,
+    &cpupool_stats_hist6, &cpupool_stats_hist7,
+};
+
+static void cpupool_stats_hypfs_init(void)
+{
+    unsigned int i;
+
+    BUILD_BUG_ON(ARRAY_SIZE(cpupool_stats_hist) !=
+                 XEN_SYSCTL_SCHED_STATS_WAIT_BUCKETS);
+
+    hypfs_add_dir(&cpupool_pooldir, &cpupool_stats_dir, true);
+    hypfs_add_leaf(&cpupool_stats_dir, &cpupool_stats_runnable, true);
+    hypfs_add_leaf(&cpupool_stats_dir, &cpupool_stats_wakeups, true);
+    hypfs_add_leaf(&cpupool_stats_dir, &cpupool_stats_runs, true);
+    hypfs_add_leaf(&cpupool_stats_dir, &cpupool_stats_wait_time, true);
+    hypfs_add_leaf(&cpupool_stats_dir, &cpupool_stats_wait_max, true);
+    hypfs_add_leaf(&cpupool_stats_dir, &cpupool_stats_migrations, true);
+    hypfs_add_leaf(&cpupool_stats_dir, &cpupool_stats_ratelimit, true);
+
+    hypfs_add_dir(&cpupool_stats_dir, &cpupool_stats_hist_dir, true);
+    for ( i = 0; i < ARRAY_SIZE(cpupool_stats_hist); i++ )
+        hypfs_add_leaf(&cpupool_stats_hist_dir, cpupool_stats_hist[i], true);
+}
+
 static const struct hypfs_funcs cpupool_dir_funcs = {
     .enter = cpupool_dir_enter,
     .exit = cpupool_dir_exit,
@@ -1208,6 +1298,7 @@ static void cpupool_hypfs_init(void)
     hypfs_add_dyndir(&cpupool_dir, &cpupool_pooldir);
     hypfs_string_set_reference(&cpupool_gran, granstr);
     hypfs_add_leaf(&cpupool_pooldir, &cpupool_gran, true);
+    cpupool_stats_hypfs_init();
 }
 
 #else /* CONFIG_HYPFS */
@@ -1892,6 +1892,7 @@ static void csched_schedule(
         snext = scurr;
         snext->start_time += now;
         perfc_incr(delay_ms);
+        sched_stats_ratelimit(sched_cpu);
         /*
          * Next timeslice must last just until we'll have executed for
          * ratelimit. However, to avoid setting a really short timer, which
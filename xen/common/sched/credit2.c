@@ -25,6 +25,7 @@
 #include <xen/trace.h>
 #include <xen/cpu.h>
 #include <xen/keyhandler.h>
+#include <xen/rbtree.h>
 #include <asm/cpufeature.h>
 #include <asm/processor.h>
 
@@ -497,6 +498,7 @@ struct csched2_runqueue_data {
 
     struct list_head rql;      /* List of runqueues                          */
     struct list_head runq;     /* Ordered list of runnable vms               */
+    struct rb_root runq_tree;  /* Credit-ordered index of runq, for insert   */
     unsigned int refcnt;       /* How many CPUs reference this runqueue      */
                                /* (including not yet active ones)            */
     unsigned int nr_cpus;      /* How many CPUs are sharing this runqueue    */
@@ -566,6 +568,7 @@ struct csched2_unit {
     s_time_t avgload;                  /* Decaying queue load                 */
 
     struct list_head runq_elem;        /* On the runqueue (rqd->runq)         */
+    struct rb_node runq_node;          /* On the runq index (rqd->runq_tree)  */
     struct list_head parked_elem;      /* On the parked_units list            */
     struct list_head rqd_elem;         /* On csched2_runqueue_data's svc list */
     struct csched2_runqueue_data *migrate_rqd; /* Pre-determined migr. target */
@@ -1420,33 +1423,53 @@ update_load(const struct scheduler *ops,
         update_svc_load(ops, svc, change, now);
 }
 
+/*
+ * The runqueue is kept both as a list, ordered by credit, and as a red-black
+ * tree indexing the very same ordering. The list is what all the consumers
+ * (runq_candidate(), csched2_runtime(), dump functions) walk, while the tree
+ * is only there for finding, in O(log n), where a unit needs to be inserted.
+ *
+ * Units with equal credits are queued after the ones already there, i.e.,
+ * the tree descent goes right on ties. This mimics what the old linear scan
+ * of the list used to do.
+ */
 static void runq_insert(struct csched2_unit *svc)
 {
-    struct list_head *iter;
     unsigned int cpu = sched_unit_master(svc->unit);
-    struct list_head *runq = &c2rqd(cpu)->runq;
-    int pos = 0;
+    struct csched2_runqueue_data *rqd = c2rqd(cpu);
+    struct rb_node **link = &rqd->runq_tree.rb_node, *parent = NULL, *next;
 
     ASSERT(spin_is_locked(get_sched_res(cpu)->schedule_lock));
 
     ASSERT(!unit_on_runq(svc));
     ASSERT(c2r(cpu) == c2r(sched_unit_master(svc->unit)));
 
-    ASSERT(&svc->rqd->runq == runq);
+    ASSERT(svc->rqd == rqd);
     ASSERT(!is_idle_unit(svc->unit));
     ASSERT(!svc->unit->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
+    while ( *link )
     {
-        struct csched2_unit * iter_svc = runq_elem(iter);
+        const struct csched2_unit *iter_svc =
+            rb_entry(*link, struct csched2_unit, runq_node);
 
+        parent = *link;
         if ( svc->credit > iter_svc->credit )
-            break;
-
-        pos++;
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
     }
-    list_add_tail(&svc->runq_elem, iter);
+    rb_link_node(&svc->runq_node, parent, link);
+    rb_insert_color(&svc->runq_node, &rqd->runq_tree);
+
+    /* Put svc in the list right before its successor in the tree (if any). */
+    next = rb_next(&svc->runq_node);
+    if ( next )
+        list_add_tail(&svc->runq_elem,
+                      &rb_entry(next, struct csched2_unit, runq_node)->runq_elem);
+    else
+        list_add_tail(&svc->runq_elem, &rqd->runq);
 
     if ( unlikely(tb_init_done) )
     {
@@ -1454,9 +1477,14 @@ static void runq_insert(struct csched2_unit *svc)
             unsigned unit:16, dom:16;
             unsigned pos;
         } d;
+        const struct list_head *iter;
+
         d.dom = svc->unit->domain->domain_id;
         d.unit = svc->unit->unit_id;
-        d.pos = pos;
+        d.pos = 0;
+        for ( iter = rqd->runq.next; iter != &svc->runq_elem;
+              iter = iter->next )
+            d.pos++;
         __trace_var(TRC_CSCHED2_RUNQ_POS, 1,
                     sizeof(d),
                     (unsigned char *)&d);
@@ -1466,6 +1494,7 @@ static void runq_insert(struct csched2_unit *svc)
 static inline void runq_remove(struct csched2_unit *svc)
 {
     ASSERT(unit_on_runq(svc));
+    rb_erase(&svc->runq_node, &svc->rqd->runq_tree);
     list_del_init(&svc->runq_elem);
 }
 
@@ -3403,6 +3432,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
                         sizeof(d),
                         (unsigned char *)&d);
         }
+        sched_stats_ratelimit(cpu);
         return scurr;
     }
 
@@ -3943,6 +3973,7 @@ init_cpu_runqueue(struct csched2_private *prv, struct csched2_pcpu *spc,
         rqd->max_weight = 1;
         INIT_LIST_HEAD(&rqd->svc);
         INIT_LIST_HEAD(&rqd->runq);
+        rqd->runq_tree = RB_ROOT;
         spin_lock_init(&rqd->lock);
         prv->active_queues++;
     }
@@ -60,6 +60,33 @@ struct sched_resource {
 };
 
 DECLARE_PER_CPU(struct sched_resource *, sched_res);
+
+/*
+ * Scheduler independent statistics. They are kept per physical cpu (the one
+ * a vcpu is assigned to) and are updated with the scheduling lock of that
+ * cpu being held, which makes them cheap enough to be always on.
+ */
+#define SCHED_STATS_WAIT_BUCKETS XEN_SYSCTL_SCHED_STATS_WAIT_BUCKETS
+struct sched_stats {
+    uint64_t wakeups;         /* Transitions from blocked/offline to runnable */
+    uint64_t runs;            /* Transitions from runnable to running         */
+    uint64_t wait_time;       /* Total time spent runnable (ns)               */
+    uint64_t wait_max;        /* Longest time spent runnable (ns)             */
+    uint64_t wait_hist[SCHED_STATS_WAIT_BUCKETS]; /* See sched_stats_bucket() */
+    uint64_t migrations;      /* Units moved to this cpu                      */
+    uint64_t ratelimit_hits;  /* Preemptions prevented by the ratelimit       */
+    int nr_runnable;          /* Vcpus currently runnable but not running     */
+};
+DECLARE_PER_CPU(struct sched_stats, sched_stats);
+
+void sched_stats_collect(const cpumask_t *cpus,
+                         struct xen_sysctl_sched_stats *stats);
+
+/* To be called by schedulers when the ratelimit prevents a preemption. */
+static inline void sched_stats_ratelimit(unsigned int cpu)
+{
+    per_cpu(sched_stats, cpu).ratelimit_hits++;
+}
 extern rcu_read_lock_t sched_res_rculock;
 
 static inline struct sched_resource *get_sched_res(unsigned int cpu)
@@ -150,9 +177,19 @@ static inline void sched_set_res(struct sched_unit *unit,
     unsigned int cpu = cpumask_first(res->cpus);
     struct vcpu *v;
 
+    if ( unit->res && unit->res != res && !is_idle_unit(unit) )
+        per_cpu(sched_stats, cpu).migrations++;
+
     for_each_sched_unit_vcpu ( unit, v )
     {
         ASSERT(cpu < nr_cpu_ids);
+        /* Runnable vcpus are accounted on the cpu they are assigned to. */
+        if ( v->runstate.state == RUNSTATE_runnable && !is_idle_vcpu(v) &&
+             v->processor != cpu )
+        {
+            per_cpu(sched_stats, v->processor).nr_runnable--;
+            per_cpu(sched_stats, cpu).nr_runnable++;
+        }
         v->processor = cpu;
         cpu = cpumask_next(cpu, res->cpus);
     }
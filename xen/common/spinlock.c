@@ -144,6 +144,128 @@ void spin_debug_disable(void)
 
 #endif
 
+#ifdef CONFIG_QUEUED_SPINLOCKS
+
+#define QUEUE_LOCKED   1
+#define QUEUE_SEQ_MASK 0xff00
+
+/*
+ * Per-cpu queue nodes, one per context a lock can be waited for in (task,
+ * irq, and exception context), indexed by the current nesting level.
+ */
+struct spin_qnode {
+    struct spin_qnode *next;
+    bool locked;
+};
+
+static DEFINE_PER_CPU(struct spin_qnode[SPINLOCK_QNODES], spin_qnodes);
+static DEFINE_PER_CPU(unsigned int, spin_qnode_nesting);
+
+static always_inline bool queue_trylock(spinlock_queue_t *q)
+{
+    u32 val = read_atomic(&q->val);
+
+    return !(val & ~QUEUE_SEQ_MASK) &&
+           cmpxchg(&q->val, val, val | QUEUE_LOCKED) == val;
+}
+
+static struct spin_qnode *queue_tail_node(u16 tail)
+{
+    return &per_cpu(spin_qnodes, (tail >> SPINLOCK_QNODE_BITS) - 1)
+                   [tail & (SPINLOCK_QNODES - 1)];
+}
+
+static void noinline queue_lock_slow(spinlock_queue_t *q,
+                                     void (*cb)(void *), void *data)
+{
+    unsigned int idx = this_cpu(spin_qnode_nesting)++;
+    struct spin_qnode *node, *next;
+    u16 tail, prev;
+    u32 val;
+
+    BUILD_BUG_ON(NR_CPUS >= (1u << (16 - SPINLOCK_QNODE_BITS)));
+
+    /* Out of queue nodes: just spin on the lock word. */
+    if ( unlikely(idx >= SPINLOCK_QNODES) )
+    {
+        while ( !queue_trylock(q) )
+        {
+            if ( unlikely(cb) )
+                cb(data);
+            arch_lock_relax();
+        }
+        goto out;
+    }
+
+    node = &this_cpu(spin_qnodes)[idx];
+    node->next = NULL;
+    node->locked = false;
+    tail = ((smp_processor_id() + 1) << SPINLOCK_QNODE_BITS) | idx;
+
+    /*
+     * Make our node the tail of the queue. xchg() is a full barrier, so the
+     * initialisation of the node is visible to our successor.
+     */
+    prev = xchg(&q->tail, tail);
+    if ( prev )
+    {
+        write_atomic(&queue_tail_node(prev)->next, node);
+        while ( !read_atomic(&node->locked) )
+        {
+            if ( unlikely(cb) )
+                cb(data);
+            arch_lock_relax();
+        }
+        smp_mb();
+    }
+
+    /* We are at the head of the queue, wait for the owner to go away. */
+    while ( read_atomic(&q->locked) )
+    {
+        if ( unlikely(cb) )
+            cb(data);
+        arch_lock_relax();
+    }
+
+    /*
+     * If nobody queued up behind us, take the lock and empty the queue in one
+     * go. Otherwise take the lock (nobody else can while the queue is not
+     * empty) and make our successor the head of the queue.
+     */
+    val = read_atomic(&q->val);
+    if ( (val & ~QUEUE_SEQ_MASK) == (u32)tail << 16 &&
+         cmpxchg(&q->val, val, (val & QUEUE_SEQ_MASK) | QUEUE_LOCKED) == val )
+        goto out;
+
+    write_atomic(&q->locked, QUEUE_LOCKED);
+    smp_mb();
+    while ( !(next = read_atomic(&node->next)) )
+        cpu_relax();
+    write_atomic(&next->locked, true);
+    arch_lock_signal();
+
+ out:
+    this_cpu(spin_qnode_nesting)--;
+    arch_lock_acquire_barrier();
+}
+
+void inline _spin_lock_cb(spinlock_t *lock, void (*cb)(void *), void *data)
+{
+    LOCK_PROFILE_VAR;
+
+    check_lock(&lock->debug, false);
+    preempt_disable();
+    if ( unlikely(!queue_trylock(&lock->queue)) )
+    {
+        LOCK_PROFILE_BLOCK;
+        queue_lock_slow(&lock->queue, cb, data);
+    }
+    got_lock(&lock->debug);
+    LOCK_PROFILE_GOT;
+}
+
+#else /* CONFIG_QUEUED_SPINLOCKS */
+
 static always_inline spinlock_tickets_t observe_lock(spinlock_tickets_t *t)
 {
     spinlock_tickets_t v;
@@ -180,6 +302,8 @@ void inline _spin_lock_cb(spinlock_t *lock, void (*cb)(void *), void *data)
     LOCK_PROFILE_GOT;
 }
 
+#endif /* CONFIG_QUEUED_SPINLOCKS */
+
 void _spin_lock(spinlock_t *lock)
 {
      _spin_lock_cb(lock, NULL, NULL);
@@ -206,7 +330,13 @@ void _spin_unlock(spinlock_t *lock)
     LOCK_PROFILE_REL;
     rel_lock(&lock->debug);
     arch_lock_release_barrier();
+#ifdef CONFIG_QUEUED_SPINLOCKS
+    /* Only the owner writes the lower half of the lock word. */
+    write_atomic(&lock->queue.locked_seq,
+                 (u16)((lock->queue.seq + 1) << 8));
+#else
     add_sized(&lock->tickets.head, 1);
+#endif
     arch_lock_signal();
     preempt_enable();
 }
@@ -231,12 +361,25 @@ int _spin_is_locked(spinlock_t *lock)
      * ASSERT()s and alike.
      */
     return lock->recurse_cpu == SPINLOCK_NO_CPU
+#ifdef CONFIG_QUEUED_SPINLOCKS
+           ? (lock->queue.val & ~QUEUE_SEQ_MASK) != 0
+#else
            ? lock->tickets.head != lock->tickets.tail
+#endif
            : lock->recurse_cpu == smp_processor_id();
 }
 
 int _spin_trylock(spinlock_t *lock)
 {
+#ifdef CONFIG_QUEUED_SPINLOCKS
+    preempt_disable();
+    check_lock(&lock->debug, true);
+    if ( !queue_trylock(&lock->queue) )
+    {
+        preempt_enable();
+        return 0;
+    }
+#else
     spinlock_tickets_t old, new;
 
     preempt_disable();
@@ -255,6 +398,7 @@ int _spin_trylock(spinlock_t *lock)
         preempt_enable();
         return 0;
     }
+#endif
     /*
      * cmpxchg() is a full barrier so no need for an
      * arch_lock_acquire_barrier().
@@ -269,18 +413,35 @@ int _spin_trylock(spinlock_t *lock)
 
 void _spin_barrier(spinlock_t *lock)
 {
+#ifdef CONFIG_QUEUED_SPINLOCKS
+    spinlock_queue_t sample;
+#else
     spinlock_tickets_t sample;
+#endif
 #ifdef CONFIG_DEBUG_LOCK_PROFILE
     s_time_t block = NOW();
 #endif
 
     check_barrier(&lock->debug);
     smp_mb();
+#ifdef CONFIG_QUEUED_SPINLOCKS
+    /*
+     * With the lock being handed over directly between queued waiters, it
+     * may never be observed free.  Every release bumps the seq byte though,
+     * so wait for the lower half of the lock word to change.
+     */
+    sample.val = read_atomic(&lock->queue.val);
+    if ( sample.locked )
+    {
+        while ( read_atomic(&lock->queue.locked_seq) == sample.locked_seq )
+            arch_lock_relax();
+#else
     sample = observe_lock(&lock->tickets);
     if ( sample.head != sample.tail )
     {
         while ( observe_head(&lock->tickets) == sample.head )
             arch_lock_relax();
+#endif
 #ifdef CONFIG_DEBUG_LOCK_PROFILE
         if ( lock->profile )
         {
@@ -384,7 +545,7 @@ static void spinlock_profile_print_elem(struct lock_profile *data,
     if ( type != LOCKPROF_TYPE_GLOBAL )
         printk("%d ", idx);
     printk("%s: addr=%p, lockval=%08x, ", data->name, lock,
-           lock->tickets.head_tail);
+           spinlock_val(lock));
     if ( lock->debug.cpu == SPINLOCK_NO_CPU )
         printk("not locked\n");
     else
@@ -31,6 +31,7 @@
 #include <xen/percpu.h>
 #include <xen/pfn.h>
 #include <xen/cpu.h>
+#include <xen/perfc.h>
 #include <asm/atomic.h>
 #include <public/sysctl.h>
 
@@ -53,14 +54,24 @@ integer_param("tevt_mask", opt_tevt_mask);
 static struct t_info *t_info;
 static unsigned int t_info_pages;
 
+/*
+ * Each per-cpu buffer only has a single producer, its cpu, which writes
+ * records with interrupts disabled. No lock is needed: the consumer only
+ * relies on the ordering of the record data and prod updates.
+ */
 static DEFINE_PER_CPU_READ_MOSTLY(struct t_buf *, t_bufs);
-static DEFINE_PER_CPU_READ_MOSTLY(spinlock_t, t_lock);
 static u32 data_size __read_mostly;
 
 /* High water mark for trace buffers; */
 /* Send virtual interrupt when buffer level reaches this point */
 static u32 t_buf_highwater;
 
+/*
+ * Set while a notification of the consumer is pending, so that buffers of
+ * other cpus crossing the high water mark meanwhile don't send more.
+ */
+static unsigned long tb_notify_pending;
+
 /* Number of records lost due to per-CPU trace buffer being full. */
 static DEFINE_PER_CPU(unsigned long, lost_records);
 static DEFINE_PER_CPU(unsigned long, lost_records_first_tsc);
@@ -79,21 +90,6 @@ static u32 tb_event_mask = TRC_ALL;
  * i.e., sizeof(_type) * ans >= _x. */
 #define fit_to_type(_type, _x) (((_x)+sizeof(_type)-1) / sizeof(_type))
 
-static int cpu_callback(
-    struct notifier_block *nfb, unsigned long action, void *hcpu)
-{
-    unsigned int cpu = (unsigned long)hcpu;
-
-    if ( action == CPU_UP_PREPARE )
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
-    return NOTIFY_DONE;
-}
-
-static struct notifier_block cpu_nfb = {
-    .notifier_call = cpu_callback
-};
-
 static uint32_t calc_tinfo_first_offset(void)
 {
     int offset_in_bytes = offsetof(struct t_info, mfn_offset[NR_CPUS]);
@@ -229,8 +225,6 @@ static int alloc_trace_bufs(unsigned int pages)
     {
         struct t_buf *buf;
 
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
         offset = t_info->mfn_offset[cpu];
 
         /* Initialize the buffer metadata */
@@ -343,7 +337,6 @@ int trace_will_trace_event(u32 event)
 void __init init_trace_bufs(void)
 {
     cpumask_setall(&tb_cpu_mask);
-    register_cpu_notifier(&cpu_nfb);
 
     if ( opt_tbuf_size )
     {
@@ -363,6 +356,11 @@ void __init init_trace_bufs(void)
     }
 }
 
+static void tb_clear_lost_records(void *unused)
+{
+    this_cpu(lost_records) = 0;
+}
+
 /**
  * tb_control - sysctl operations on trace buffers.
  * @tbc: a pointer to a struct xen_sysctl_tbuf_op to be filled out
@@ -412,20 +410,13 @@ int tb_control(struct xen_sysctl_tbuf_op *tbc)
          * Disable trace buffers. Just stops new records from being written,
          * does not deallocate any memory.
          */
-        int i;
-
         tb_init_done = 0;
         smp_wmb();
         /* Clear any lost-record info so we don't get phantom lost records next time we
-         * start tracing.  Grab the lock to make sure we're not racing anyone.  After this
+         * start tracing.  Records are written with interrupts disabled, so having each
+         * cpu do it from IPI context makes sure we're not racing anyone.  After this
          * hypercall returns, no more records should be placed into the buffers. */
-        for_each_online_cpu(i)
-        {
-            unsigned long flags;
-            spin_lock_irqsave(&per_cpu(t_lock, i), flags);
-            per_cpu(lost_records, i)=0;
-            spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
-        }
+        on_each_cpu(tb_clear_lost_records, NULL, 1);
     }
         break;
     default:
@@ -665,11 +656,26 @@ static inline void insert_lost_records(struct t_buf *buf)
  */
 static void trace_notify_dom0(void *unused)
 {
+    clear_bit(0, &tb_notify_pending);
+    perfc_incr(tbuf_notify);
     send_global_virq(VIRQ_TBUF);
 }
 static DECLARE_SOFTIRQ_TASKLET(trace_notify_dom0_tasklet,
                                trace_notify_dom0, NULL);
 
+/*
+ * Notifications from all cpus are batched until the consumer got the
+ * previous one, so that a burst of records hitting the high water mark on
+ * many cpus at once results in a single virq.
+ */
+static void trace_notify(void)
+{
+    if ( test_and_set_bit(0, &tb_notify_pending) )
+        perfc_incr(tbuf_notify_batched);
+    else
+        tasklet_schedule(&trace_notify_dom0_tasklet);
+}
+
 /**
  * __trace_var - Enters a trace tuple into the trace buffer for the current CPU.
  * @event: the event type being logged
@@ -721,7 +727,7 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     /* Read tb_init_done /before/ t_bufs. */
     smp_rmb();
 
-    spin_lock_irqsave(&this_cpu(t_lock), flags);
+    local_irq_save(flags);
 
     buf = this_cpu(t_bufs);
 
@@ -776,8 +782,13 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     if ( total_size > bytes_to_tail )
     {
         if ( ++this_cpu(lost_records) == 1 )
+        {
             this_cpu(lost_records_first_tsc)=(u64)get_cycles();
-        started_below_highwater = 0;
+            /* Make sure the consumer knows about a full buffer. */
+            started_below_highwater = 1;
+        }
+        else
+            started_below_highwater = 0;
         goto unlock;
     }
 
@@ -808,13 +819,13 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     __insert_record(buf, event, extra, cycles, rec_size, extra_data);
 
 unlock:
-    spin_unlock_irqrestore(&this_cpu(t_lock), flags);
+    local_irq_restore(flags);
 
     /* Notify trace buffer consumer that we've crossed the high water mark. */
     if ( likely(buf!=NULL)
          && started_below_highwater
          && (calc_unconsumed_bytes(buf) >= t_buf_highwater) )
-        tasklet_schedule(&trace_notify_dom0_tasklet);
+        trace_notify();
 }
 
 void __trace_hypercall(uint32_t event, unsigned long op,
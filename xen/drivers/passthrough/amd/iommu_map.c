@@ -31,21 +31,25 @@ static unsigned int pfn_to_pde_idx(unsigned long pfn, unsigned int level)
     return idx;
 }
 
-static unsigned int clear_iommu_pte_present(unsigned long l1_mfn,
-                                            unsigned long dfn)
+static union amd_iommu_pte clear_iommu_pte_present(unsigned long l1_mfn,
+                                                   unsigned long dfn,
+                                                   unsigned int level,
+                                                   unsigned int *flush_flags)
 {
-    union amd_iommu_pte *table, *pte;
-    unsigned int flush_flags;
+    union amd_iommu_pte *table, *pte, old;
 
     table = map_domain_page(_mfn(l1_mfn));
-    pte = &table[pfn_to_pde_idx(dfn, 1)];
+    pte = &table[pfn_to_pde_idx(dfn, level)];
+    old = *pte;
 
-    flush_flags = pte->pr ? IOMMU_FLUSHF_modified : 0;
     write_atomic(&pte->raw, 0);
 
     unmap_domain_page(table);
 
-    return flush_flags;
+    if ( old.pr )
+        *flush_flags |= IOMMU_FLUSHF_modified;
+
+    return old;
 }
 
 static unsigned int set_iommu_pde_present(union amd_iommu_pte *pte,
@@ -86,7 +90,8 @@ static unsigned int set_iommu_ptes_present(unsigned long pt_mfn,
                                            unsigned long next_mfn,
                                            unsigned int nr_ptes,
                                            unsigned int pde_level,
-                                           bool iw, bool ir)
+                                           bool iw, bool ir,
+                                           union amd_iommu_pte *old)
 {
     union amd_iommu_pte *table, *pde;
     unsigned int page_sz, flush_flags = 0;
@@ -101,6 +106,9 @@ static unsigned int set_iommu_ptes_present(unsigned long pt_mfn,
         return 0;
     }
 
+    if ( old )
+        *old = *pde;
+
     while ( nr_ptes-- )
     {
         flush_flags |= set_iommu_pde_present(pde, next_mfn, 0, iw, ir);
@@ -173,12 +181,14 @@ void __init iommu_dte_add_device_entry(struct amd_iommu_dte *dte,
     };
 }
 
-/* Walk io page tables and build level page tables if necessary
+/* Walk io page tables down to the table holding the pde of the given level,
+ * and build level page tables if necessary.
  * {Re, un}mapping super page frames causes re-allocation of io
  * page tables.
  */
 static int iommu_pde_from_dfn(struct domain *d, unsigned long dfn,
-                              unsigned long *pt_mfn, bool map)
+                              unsigned int target, unsigned long *pt_mfn,
+                              unsigned int *flush_flags, bool map)
 {
     union amd_iommu_pte *pde, *next_table_vaddr;
     unsigned long  next_table_mfn;
@@ -200,7 +210,7 @@ static int iommu_pde_from_dfn(struct domain *d, unsigned long dfn,
 
     next_table_mfn = mfn_x(page_to_mfn(table));
 
-    while ( level > 1 )
+    while ( level > target )
     {
         unsigned int next_level = level - 1;
 
@@ -230,12 +240,12 @@ static int iommu_pde_from_dfn(struct domain *d, unsigned long dfn,
             next_table_mfn = mfn_x(page_to_mfn(table));
 
             set_iommu_ptes_present(next_table_mfn, pfn, mfn, PTE_PER_TABLE_SIZE,
-                                   next_level, pde->iw, pde->ir);
+                                   next_level, pde->iw, pde->ir, NULL);
             smp_wmb();
             set_iommu_pde_present(pde, next_table_mfn, next_level, true,
                                   true);
 
-            amd_iommu_flush_all_pages(d);
+            *flush_flags |= IOMMU_FLUSHF_modified;
         }
 
         /* Install lower level page table for non-present entries */
@@ -271,17 +281,60 @@ static int iommu_pde_from_dfn(struct domain *d, unsigned long dfn,
         level--;
     }
 
-    /* mfn of level 1 page table */
+    /* mfn of target level page table */
     *pt_mfn = next_table_mfn;
     return 0;
 }
 
+/*
+ * Queue a page table unhooked from the domain's page tables for freeing,
+ * together with all the (lower level) page tables it references.
+ */
+static void queue_free_pt(struct domain *d, mfn_t mfn, unsigned int level)
+{
+    if ( level > 1 )
+    {
+        union amd_iommu_pte *pt = map_domain_page(mfn);
+        unsigned int i;
+
+        for ( i = 0; i < PTE_PER_TABLE_SIZE; ++i )
+            if ( pt[i].pr && pt[i].next_level )
+            {
+                ASSERT(pt[i].next_level < level);
+                queue_free_pt(d, _mfn(pt[i].mfn), pt[i].next_level);
+            }
+
+        unmap_domain_page(pt);
+    }
+
+    iommu_queue_free_pgtable(d, mfn_to_page(mfn));
+}
+
 int amd_iommu_map_page(struct domain *d, dfn_t dfn, mfn_t mfn,
                        unsigned int flags, unsigned int *flush_flags)
 {
     struct domain_iommu *hd = dom_iommu(d);
+    unsigned int level = (IOMMUF_order(flags) / PTE_PER_TABLE_SHIFT) + 1;
     int rc;
     unsigned long pt_mfn = 0;
+    union amd_iommu_pte old;
+
+    ASSERT((hd->platform_ops->page_sizes >> IOMMUF_order(flags)) &
+           PAGE_SIZE_4K);
+
+    /* The page tables may be too shallow to hold an entry of that size. */
+    if ( unlikely(level > hd->arch.amd.paging_mode) )
+    {
+        unsigned int i, order = IOMMUF_order(flags) - PTE_PER_TABLE_SHIFT;
+
+        flags &= ~IOMMUF_order(~0u);
+        for ( rc = 0, i = 0; !rc && i < PTE_PER_TABLE_SIZE; i++ )
+            rc = amd_iommu_map_page(d, dfn_add(dfn, (unsigned long)i << order),
+                                    mfn_add(mfn, (unsigned long)i << order),
+                                    flags | IOMMUF_order(order), flush_flags);
+
+        return rc;
+    }
 
     spin_lock(&hd->arch.mapping_lock);
 
@@ -307,7 +360,8 @@ int amd_iommu_map_page(struct domain *d, dfn_t dfn, mfn_t mfn,
         return rc;
     }
 
-    if ( iommu_pde_from_dfn(d, dfn_x(dfn), &pt_mfn, true) || !pt_mfn )
+    if ( iommu_pde_from_dfn(d, dfn_x(dfn), level, &pt_mfn, flush_flags,
+                            true) || !pt_mfn )
     {
         spin_unlock(&hd->arch.mapping_lock);
         AMD_IOMMU_ERROR("invalid IO pagetable entry dfn = %"PRI_dfn"\n",
@@ -316,10 +370,15 @@ int amd_iommu_map_page(struct domain *d, dfn_t dfn, mfn_t mfn,
         return -EFAULT;
     }
 
-    /* Install 4k mapping */
+    /* Install mapping */
     *flush_flags |= set_iommu_ptes_present(pt_mfn, dfn_x(dfn), mfn_x(mfn),
-                                           1, 1, (flags & IOMMUF_writable),
-                                           (flags & IOMMUF_readable));
+                                           1, level,
+                                           (flags & IOMMUF_writable),
+                                           (flags & IOMMUF_readable), &old);
+
+    /* A superpage may replace a page table mapping the same range. */
+    if ( old.pr && old.next_level )
+        queue_free_pt(d, _mfn(old.mfn), old.next_level);
 
     spin_unlock(&hd->arch.mapping_lock);
 
@@ -327,10 +386,25 @@ int amd_iommu_map_page(struct domain *d, dfn_t dfn, mfn_t mfn,
 }
 
 int amd_iommu_unmap_page(struct domain *d, dfn_t dfn,
-                         unsigned int *flush_flags)
+                         unsigned int order, unsigned int *flush_flags)
 {
     unsigned long pt_mfn = 0;
     struct domain_iommu *hd = dom_iommu(d);
+    unsigned int level = (order / PTE_PER_TABLE_SHIFT) + 1;
+
+    /* See amd_iommu_map_page(). */
+    if ( unlikely(level > hd->arch.amd.paging_mode) )
+    {
+        unsigned int i;
+        int rc = 0;
+
+        order -= PTE_PER_TABLE_SHIFT;
+        for ( i = 0; !rc && i < PTE_PER_TABLE_SIZE; i++ )
+            rc = amd_iommu_unmap_page(d, dfn_add(dfn, (unsigned long)i << order),
+                                      order, flush_flags);
+
+        return rc;
+    }
 
     spin_lock(&hd->arch.mapping_lock);
 
@@ -340,7 +414,8 @@ int amd_iommu_unmap_page(struct domain *d, dfn_t dfn,
         return 0;
     }
 
-    if ( iommu_pde_from_dfn(d, dfn_x(dfn), &pt_mfn, false) )
+    if ( iommu_pde_from_dfn(d, dfn_x(dfn), level, &pt_mfn, flush_flags,
+                            false) )
     {
         spin_unlock(&hd->arch.mapping_lock);
         AMD_IOMMU_ERROR("invalid IO pagetable entry dfn = %"PRI_dfn"\n",
@@ -352,7 +427,11 @@ int amd_iommu_unmap_page(struct domain *d, dfn_t dfn,
     if ( pt_mfn )
     {
         /* Mark PTE as 'page not present'. */
-        *flush_flags |= clear_iommu_pte_present(pt_mfn, dfn_x(dfn));
+        union amd_iommu_pte old = clear_iommu_pte_present(pt_mfn, dfn_x(dfn),
+                                                          level, flush_flags);
+
+        if ( old.pr && old.next_level )
+            queue_free_pt(d, _mfn(old.mfn), old.next_level);
     }
 
     spin_unlock(&hd->arch.mapping_lock);
@@ -629,12 +629,14 @@ static void amd_dump_page_tables(struct domain *d)
     if ( !hd->arch.amd.root_table )
         return;
 
-    printk("AMD IOMMU %pd table has %u levels\n", d, hd->arch.amd.paging_mode);
+    printk("AMD IOMMU %pd table has %u levels, %u pages\n", d,
+           hd->arch.amd.paging_mode, hd->arch.pgtables.nr);
     amd_dump_page_table_level(hd->arch.amd.root_table,
                               hd->arch.amd.paging_mode, 0, 0);
 }
 
 static const struct iommu_ops __initconstrel _iommu_ops = {
+    .page_sizes = PAGE_SIZE_4K | PAGE_SIZE_2M | PAGE_SIZE_1G,
     .init = amd_iommu_domain_init,
     .hwdom_init = amd_iommu_hwdom_init,
     .quarantine_init = amd_iommu_quarantine_init,
@@ -20,6 +20,7 @@
 #include <xen/param.h>
 #include <xen/softirq.h>
 #include <xen/keyhandler.h>
+#include <xen/perfc.h>
 #include <xsm/xsm.h>
 
 static void iommu_dump_page_tables(unsigned char key);
@@ -64,6 +65,15 @@ bool_t __read_mostly amd_iommu_perdev_intremap = 1;
 
 DEFINE_PER_CPU(bool_t, iommu_dont_flush_iotlb);
 
+struct iommu_flush_gather {
+    struct domain *domain;
+    unsigned int nesting;
+    unsigned int flush_flags;
+    dfn_t start, end;          /* [start, end) of the pending flush */
+    int rc;                    /* First error of a flush already issued */
+};
+static DEFINE_PER_CPU(struct iommu_flush_gather, iommu_flush_gather);
+
 static int __init parse_iommu_param(const char *s)
 {
     const char *ss;
@@ -260,21 +270,54 @@ void iommu_domain_destroy(struct domain *d)
     arch_iommu_domain_destroy(d);
 }
 
-int iommu_map(struct domain *d, dfn_t dfn, mfn_t mfn,
+/*
+ * Determine the largest page size supported by the IOMMU which both dfn and
+ * mfn are aligned to, and which doesn't exceed nr pages.
+ */
+static unsigned int mapping_order(const struct domain_iommu *hd,
+                                  dfn_t dfn, mfn_t mfn, unsigned long nr)
+{
+    unsigned long res = dfn_x(dfn) | mfn_x(mfn);
+    unsigned long sizes = hd->platform_ops->page_sizes >> PAGE_SHIFT;
+    unsigned int order, best = 0;
+
+    for ( order = 1; (sizes >> order) && order < IOMMUF_order(~0u); order++ )
+    {
+        if ( !(sizes & (1UL << order)) )
+            continue;
+        if ( nr < (1UL << order) || (res & ((1UL << order) - 1)) )
+            break;
+        best = order;
+    }
+
+    return best;
+}
+
+int iommu_map(struct domain *d, dfn_t dfn0, mfn_t mfn0,
               unsigned long page_count, unsigned int flags,
               unsigned int *flush_flags)
 {
     const struct domain_iommu *hd = dom_iommu(d);
     unsigned long i;
+    unsigned int order;
     int rc = 0;
 
     if ( !is_iommu_enabled(d) )
         return 0;
 
-    for ( i = 0; i < page_count; i++ )
+    perfc_incr(iommu_map);
+
+    ASSERT(!IOMMUF_order(flags));
+
+    for ( i = 0; i < page_count; i += 1UL << order )
     {
-        rc = iommu_call(hd->platform_ops, map_page, d, dfn_add(dfn, i),
-                        mfn_add(mfn, i), flags, flush_flags);
+        dfn_t dfn = dfn_add(dfn0, i);
+        mfn_t mfn = mfn_add(mfn0, i);
+
+        order = mapping_order(hd, dfn, mfn, page_count - i);
+
+        rc = iommu_call(hd->platform_ops, map_page, d, dfn, mfn,
+                        flags | IOMMUF_order(order), flush_flags);
 
         if ( likely(!rc) )
             continue;
@@ -282,14 +325,11 @@ int iommu_map(struct domain *d, dfn_t dfn, mfn_t mfn,
         if ( !d->is_shutting_down && printk_ratelimit() )
             printk(XENLOG_ERR
                    "d%d: IOMMU mapping dfn %"PRI_dfn" to mfn %"PRI_mfn" failed: %d\n",
-                   d->domain_id, dfn_x(dfn_add(dfn, i)),
-                   mfn_x(mfn_add(mfn, i)), rc);
+                   d->domain_id, dfn_x(dfn), mfn_x(mfn), rc);
 
-        while ( i-- )
-            /* if statement to satisfy __must_check */
-            if ( iommu_call(hd->platform_ops, unmap_page, d, dfn_add(dfn, i),
-                            flush_flags) )
-                continue;
+        /* while statement to satisfy __must_check */
+        while ( iommu_unmap(d, dfn0, i, flush_flags) )
+            break;
 
         if ( !is_hardware_domain(d) )
             domain_crash(d);
@@ -315,25 +355,32 @@ int iommu_legacy_map(struct domain *d, dfn_t dfn, mfn_t mfn,
     int rc = iommu_map(d, dfn, mfn, page_count, flags, &flush_flags);
 
     if ( !this_cpu(iommu_dont_flush_iotlb) && !rc )
-        rc = iommu_iotlb_flush(d, dfn, page_count, flush_flags);
+        rc = iommu_iotlb_flush_gather(d, dfn, page_count, flush_flags);
 
     return rc;
 }
 
-int iommu_unmap(struct domain *d, dfn_t dfn, unsigned long page_count,
+int iommu_unmap(struct domain *d, dfn_t dfn0, unsigned long page_count,
                 unsigned int *flush_flags)
 {
     const struct domain_iommu *hd = dom_iommu(d);
     unsigned long i;
+    unsigned int order;
     int rc = 0;
 
     if ( !is_iommu_enabled(d) )
         return 0;
 
-    for ( i = 0; i < page_count; i++ )
+    perfc_incr(iommu_unmap);
+
+    for ( i = 0; i < page_count; i += 1UL << order )
     {
-        int err = iommu_call(hd->platform_ops, unmap_page, d, dfn_add(dfn, i),
-                             flush_flags);
+        dfn_t dfn = dfn_add(dfn0, i);
+        int err;
+
+        order = mapping_order(hd, dfn, _mfn(0), page_count - i);
+        err = iommu_call(hd->platform_ops, unmap_page, d, dfn,
+                         order, flush_flags);
 
         if ( likely(!err) )
             continue;
@@ -341,7 +388,7 @@ int iommu_unmap(struct domain *d, dfn_t dfn, unsigned long page_count,
         if ( !d->is_shutting_down && printk_ratelimit() )
             printk(XENLOG_ERR
                    "d%d: IOMMU unmapping dfn %"PRI_dfn" failed: %d\n",
-                   d->domain_id, dfn_x(dfn_add(dfn, i)), err);
+                   d->domain_id, dfn_x(dfn), err);
 
         if ( !rc )
             rc = err;
@@ -370,7 +417,7 @@ int iommu_legacy_unmap(struct domain *d, dfn_t dfn, unsigned long page_count)
     int rc = iommu_unmap(d, dfn, page_count, &flush_flags);
 
     if ( !this_cpu(iommu_dont_flush_iotlb) && !rc )
-        rc = iommu_iotlb_flush(d, dfn, page_count, flush_flags);
+        rc = iommu_iotlb_flush_gather(d, dfn, page_count, flush_flags);
 
     return rc;
 }
@@ -399,6 +446,7 @@ int iommu_iotlb_flush(struct domain *d, dfn_t dfn, unsigned long page_count,
     if ( dfn_eq(dfn, INVALID_DFN) )
         return -EINVAL;
 
+    perfc_incr(iommu_iotlb_flush);
     rc = iommu_call(hd->platform_ops, iotlb_flush, d, dfn, page_count,
                     flush_flags);
     if ( unlikely(rc) )
@@ -428,6 +476,7 @@ int iommu_iotlb_flush_all(struct domain *d, unsigned int flush_flags)
      * The operation does a full flush so we don't need to pass the
      * flush_flags in.
      */
+    perfc_incr(iommu_iotlb_flush_all);
     rc = iommu_call(hd->platform_ops, iotlb_flush_all, d);
     if ( unlikely(rc) )
     {
@@ -443,6 +492,104 @@ int iommu_iotlb_flush_all(struct domain *d, unsigned int flush_flags)
     return rc;
 }
 
+void iommu_flush_gather_begin(struct domain *d)
+{
+    struct iommu_flush_gather *gather = &this_cpu(iommu_flush_gather);
+
+    if ( !is_iommu_enabled(d) )
+        return;
+
+    if ( gather->nesting++ )
+    {
+        /* Nested sections have to be for the same domain. */
+        ASSERT(gather->domain == d);
+        return;
+    }
+
+    gather->domain = d;
+    gather->flush_flags = 0;
+    gather->rc = 0;
+}
+
+int iommu_flush_gather_sync(struct domain *d)
+{
+    struct iommu_flush_gather *gather = &this_cpu(iommu_flush_gather);
+    unsigned int flush_flags = gather->flush_flags;
+    int rc;
+
+    if ( !is_iommu_enabled(d) || gather->domain != d || !flush_flags )
+        return 0;
+
+    gather->flush_flags = 0;
+
+    rc = iommu_iotlb_flush(d, gather->start,
+                           dfn_x(gather->end) - dfn_x(gather->start),
+                           flush_flags);
+    if ( rc && !gather->rc )
+        gather->rc = rc;
+
+    return rc;
+}
+
+int iommu_flush_gather_end(struct domain *d)
+{
+    struct iommu_flush_gather *gather = &this_cpu(iommu_flush_gather);
+    int rc;
+
+    if ( !is_iommu_enabled(d) )
+        return 0;
+
+    ASSERT(gather->nesting && gather->domain == d);
+    if ( gather->nesting > 1 )
+    {
+        gather->nesting--;
+        return 0;
+    }
+
+    rc = iommu_flush_gather_sync(d) ?: gather->rc;
+
+    gather->nesting = 0;
+    gather->domain = NULL;
+
+    return rc;
+}
+
+int iommu_iotlb_flush_gather(struct domain *d, dfn_t dfn,
+                             unsigned long page_count,
+                             unsigned int flush_flags)
+{
+    struct iommu_flush_gather *gather = &this_cpu(iommu_flush_gather);
+    dfn_t end = dfn_add(dfn, page_count);
+
+    if ( gather->domain != d || !page_count || !flush_flags ||
+         dfn_eq(dfn, INVALID_DFN) || dfn_x(end) < dfn_x(dfn) )
+        return iommu_iotlb_flush(d, dfn, page_count, flush_flags);
+
+    perfc_incr(iommu_iotlb_flush_gathered);
+
+    if ( !gather->flush_flags )
+    {
+        gather->start = dfn;
+        gather->end = end;
+    }
+    else
+    {
+        /*
+         * Merge into a single range.  Platform code picks the cheapest
+         * invalidation covering it, which for sparse ranges ends up being
+         * a domain wide one; still a single flush for the whole batch.
+         */
+        if ( dfn_x(dfn) < dfn_x(gather->start) )
+            gather->start = dfn;
+        if ( dfn_x(end) > dfn_x(gather->end) )
+            gather->end = end;
+    }
+
+    gather->flush_flags |= flush_flags;
+
+    return 0;
+}
+
 static int __init iommu_quarantine_init(void)
 {
     const struct domain_iommu *hd = dom_iommu(dom_io);
@@ -264,17 +264,27 @@ static u64 bus_to_context_maddr(struct vtd_iommu *iommu, u8 bus)
     return maddr;
 }
 
-static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
+/*
+ * Return the address of the page table holding the level *target entry for
+ * addr. With alloc set, missing page tables get allocated, and superpages
+ * mapping a larger range get split. Otherwise, if a superpage is found above
+ * *target, the address of the page table holding it is returned, with
+ * *target updated to its level.
+ */
+static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr,
+                                  unsigned int *target,
+                                  unsigned int *flush_flags, bool alloc)
 {
     struct domain_iommu *hd = dom_iommu(domain);
     int addr_width = agaw_to_width(hd->arch.vtd.agaw);
     struct dma_pte *parent, *pte = NULL;
-    int level = agaw_to_level(hd->arch.vtd.agaw);
+    unsigned int level = agaw_to_level(hd->arch.vtd.agaw);
     int offset;
-    u64 pte_maddr = 0;
+    u64 table_maddr, pte_maddr = 0;
 
     addr &= (((u64)1) << addr_width) - 1;
     ASSERT(spin_is_locked(&hd->arch.mapping_lock));
+    ASSERT(*target && *target <= level);
     if ( !hd->arch.vtd.pgd_maddr )
     {
         struct page_info *pg;
@@ -285,14 +295,56 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
         hd->arch.vtd.pgd_maddr = page_to_maddr(pg);
     }
 
-    parent = (struct dma_pte *)map_vtd_domain_page(hd->arch.vtd.pgd_maddr);
-    while ( level > 1 )
+    pte_maddr = table_maddr = hd->arch.vtd.pgd_maddr;
+    parent = (struct dma_pte *)map_vtd_domain_page(table_maddr);
+    while ( level > *target )
     {
         offset = address_level_offset(addr, level);
         pte = &parent[offset];
 
         pte_maddr = dma_pte_addr(*pte);
-        if ( !pte_maddr )
+        if ( dma_pte_present(*pte) && dma_pte_superpage(*pte) )
+        {
+            struct page_info *pg;
+            struct dma_pte *split, new = {};
+            unsigned int i;
+
+            if ( !alloc )
+            {
+                *target = level;
+                pte_maddr = table_maddr;
+                break;
+            }
+
+            pg = iommu_alloc_pgtable(domain);
+            if ( !pg )
+            {
+                pte_maddr = 0;
+                break;
+            }
+
+            /* Split the superpage into a table of next level mappings. */
+            pte_maddr = page_to_maddr(pg);
+            split = map_vtd_domain_page(pte_maddr);
+            for ( i = 0; i < PTE_NUM; i++ )
+            {
+                split[i].val = pte->val +
+                               ((u64)i << level_to_offset_bits(level - 1));
+                if ( level == 2 )
+                    split[i].val &= ~DMA_PTE_SP;
+            }
+            iommu_sync_cache(split, PAGE_SIZE);
+            unmap_vtd_domain_page(split);
+
+            dma_set_pte_addr(new, pte_maddr);
+            dma_set_pte_readable(new);
+            dma_set_pte_writable(new);
+            write_atomic(&pte->val, new.val);
+            iommu_sync_cache(pte, sizeof(struct dma_pte));
+
+            *flush_flags |= IOMMU_FLUSHF_modified;
+        }
+        else if ( !pte_maddr )
         {
             struct page_info *pg;
 
@@ -315,12 +367,12 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
             iommu_sync_cache(pte, sizeof(struct dma_pte));
         }
 
-        if ( level == 2 )
+        if ( --level == *target )
             break;
 
         unmap_vtd_domain_page(parent);
         parent = map_vtd_domain_page(pte_maddr);
-        level--;
+        table_maddr = pte_maddr;
     }
 
     unmap_vtd_domain_page(parent);
@@ -345,8 +397,10 @@ static uint64_t domain_pgd_maddr(struct domain *d, unsigned int nr_pt_levels)
 
     if ( !hd->arch.vtd.pgd_maddr )
     {
+        unsigned int level = 1, flush_flags = 0;
+
         /* Ensure we have pagetables allocated down to leaf PTE. */
-        addr_to_dma_page_maddr(d, 0, 1);
+        addr_to_dma_page_maddr(d, 0, &level, &flush_flags, true);
 
         if ( !hd->arch.vtd.pgd_maddr )
             return 0;
@@ -633,8 +687,24 @@ static int __must_check iommu_flush_iotlb(struct domain *d, dfn_t dfn,
     struct vtd_iommu *iommu;
     bool_t flush_dev_iotlb;
     int iommu_domid;
+    unsigned int order = 0;
     int ret = 0;
 
+    /*
+     * Find the smallest naturally aligned block covering the whole range,
+     * such that (possibly gathered) multi-page flushes can still use a
+     * single page selective invalidation.
+     */
+    if ( page_count && !dfn_eq(dfn, INVALID_DFN) )
+    {
+        unsigned long last = dfn_x(dfn) + page_count - 1;
+
+        if ( last < dfn_x(dfn) )
+            page_count = 0;
+        else if ( last != dfn_x(dfn) )
+            order = flsl(dfn_x(dfn) ^ last);
+    }
+
     /*
      * No need pcideves_lock here because we have flush
      * when assign/deassign device
@@ -653,14 +723,12 @@ static int __must_check iommu_flush_iotlb(struct domain *d, dfn_t dfn,
         if ( iommu_domid == -1 )
             continue;
 
-        if ( !page_count || (page_count & (page_count - 1)) ||
-             dfn_eq(dfn, INVALID_DFN) || !IS_ALIGNED(dfn_x(dfn), page_count) )
+        if ( !page_count || dfn_eq(dfn, INVALID_DFN) )
             rc = iommu_flush_iotlb_dsi(iommu, iommu_domid,
                                        0, flush_dev_iotlb);
         else
             rc = iommu_flush_iotlb_psi(iommu, iommu_domid,
-                                       dfn_to_daddr(dfn),
-                                       get_order_from_pages(page_count),
+                                       dfn_to_daddr(dfn), order,
                                        !dma_old_pte_present,
                                        flush_dev_iotlb);
 
@@ -690,40 +758,81 @@ static int __must_check iommu_flush_iotlb_all(struct domain *d)
     return iommu_flush_iotlb(d, INVALID_DFN, 0, 0);
 }
 
-/* clear one page's page table */
-static void dma_pte_clear_one(struct domain *domain, uint64_t addr,
-                              unsigned int *flush_flags)
+/*
+ * Queue a page table unhooked from the domain's page tables for freeing,
+ * together with all the (lower level) page tables it references.
+ */
+static void queue_free_pt(struct domain *d, u64 pt_maddr, unsigned int level)
+{
+    if ( level > 1 )
+    {
+        struct dma_pte *pt = map_vtd_domain_page(pt_maddr);
+        unsigned int i;
+
+        for ( i = 0; i < PTE_NUM; i++ )
+            if ( dma_pte_present(pt[i]) && !dma_pte_superpage(pt[i]) )
+                queue_free_pt(d, dma_pte_addr(pt[i]), level - 1);
+
+        unmap_vtd_domain_page(pt);
+    }
+
+    iommu_queue_free_pgtable(d, maddr_to_page(pt_maddr));
+}
+
+/* clear one mapping of the given order from the page tables */
+static int dma_pte_clear_one(struct domain *domain, uint64_t addr,
+                             unsigned int order, unsigned int *flush_flags)
 {
     struct domain_iommu *hd = dom_iommu(domain);
-    struct dma_pte *page = NULL, *pte = NULL;
+    struct dma_pte *page = NULL, *pte = NULL, old;
+    unsigned int target = order / LEVEL_STRIDE + 1, level = target;
     u64 pg_maddr;
 
     spin_lock(&hd->arch.mapping_lock);
-    /* get last level pte */
-    pg_maddr = addr_to_dma_page_maddr(domain, addr, 0);
+    /* get the page table holding the pte */
+    pg_maddr = addr_to_dma_page_maddr(domain, addr, &level, flush_flags,
+                                      false);
+    if ( pg_maddr && level != target )
+    {
+        /* Only part of a superpage is being unmapped: split it. */
+        level = target;
+        pg_maddr = addr_to_dma_page_maddr(domain, addr, &level, flush_flags,
+                                          true);
+        if ( !pg_maddr )
+        {
+            spin_unlock(&hd->arch.mapping_lock);
+            return -ENOMEM;
+        }
+    }
     if ( pg_maddr == 0 )
     {
         spin_unlock(&hd->arch.mapping_lock);
-        return;
+        return 0;
     }
 
     page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = page + address_level_offset(addr, 1);
+    pte = page + address_level_offset(addr, level);
 
     if ( !dma_pte_present(*pte) )
     {
         spin_unlock(&hd->arch.mapping_lock);
         unmap_vtd_domain_page(page);
-        return;
+        return 0;
     }
 
+    old = *pte;
     dma_clear_pte(*pte);
     *flush_flags |= IOMMU_FLUSHF_modified;
 
+    if ( level > 1 && !dma_pte_superpage(old) )
+        queue_free_pt(domain, dma_pte_addr(old), level - 1);
+
     spin_unlock(&hd->arch.mapping_lock);
     iommu_sync_cache(pte, sizeof(struct dma_pte));
 
     unmap_vtd_domain_page(page);
+
+    return 0;
 }
 
 static int iommu_set_root_entry(struct vtd_iommu *iommu)
@@ -1827,9 +1936,12 @@ static int __must_check intel_iommu_map_page(struct domain *d, dfn_t dfn,
 {
     struct domain_iommu *hd = dom_iommu(d);
     struct dma_pte *page, *pte, old, new = {};
+    unsigned int level = IOMMUF_order(flags) / LEVEL_STRIDE + 1;
     u64 pg_maddr;
     int rc = 0;
 
+    ASSERT(!(IOMMUF_order(flags) % LEVEL_STRIDE));
+
     /* Do nothing if VT-d shares EPT page table */
     if ( iommu_use_hap_pt(d) )
         return 0;
@@ -1852,7 +1964,8 @@ static int __must_check intel_iommu_map_page(struct domain *d, dfn_t dfn,
         return 0;
     }
 
-    pg_maddr = addr_to_dma_page_maddr(d, dfn_to_daddr(dfn), 1);
+    pg_maddr = addr_to_dma_page_maddr(d, dfn_to_daddr(dfn), &level,
+                                      flush_flags, true);
     if ( !pg_maddr )
     {
         spin_unlock(&hd->arch.mapping_lock);
@@ -1860,13 +1973,15 @@ static int __must_check intel_iommu_map_page(struct domain *d, dfn_t dfn,
     }
 
     page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = &page[dfn_x(dfn) & LEVEL_MASK];
+    pte = &page[address_level_offset(dfn_to_daddr(dfn), level)];
     old = *pte;
 
     dma_set_pte_addr(new, mfn_to_maddr(mfn));
     dma_set_pte_prot(new,
                      ((flags & IOMMUF_readable) ? DMA_PTE_READ  : 0) |
                      ((flags & IOMMUF_writable) ? DMA_PTE_WRITE : 0));
+    if ( level > 1 )
+        dma_set_pte_superpage(new);
 
     /* Set the SNP on leaf page table if Snoop Control available */
     if ( iommu_snoop )
@@ -1879,9 +1994,13 @@ static int __must_check intel_iommu_map_page(struct domain *d, dfn_t dfn,
         return 0;
     }
 
-    *pte = new;
-
+    write_atomic(&pte->val, new.val);
     iommu_sync_cache(pte, sizeof(struct dma_pte));
+
+    /* A superpage may replace a page table mapping the same range. */
+    if ( level > 1 && dma_pte_present(old) && !dma_pte_superpage(old) )
+        queue_free_pt(d, dma_pte_addr(old), level - 1);
+
     spin_unlock(&hd->arch.mapping_lock);
     unmap_vtd_domain_page(page);
 
@@ -1893,6 +2012,7 @@ static int __must_check intel_iommu_map_page(struct domain *d, dfn_t dfn,
 }
 
 static int __must_check intel_iommu_unmap_page(struct domain *d, dfn_t dfn,
+                                               unsigned int order,
                                                unsigned int *flush_flags)
 {
     /* Do nothing if VT-d shares EPT page table */
@@ -1903,9 +2023,7 @@ static int __must_check intel_iommu_unmap_page(struct domain *d, dfn_t dfn,
     if ( iommu_hwdom_passthrough && is_hardware_domain(d) )
         return 0;
 
-    dma_pte_clear_one(d, dfn_to_daddr(dfn), flush_flags);
-
-    return 0;
+    return dma_pte_clear_one(d, dfn_to_daddr(dfn), order, flush_flags);
 }
 
 static int intel_iommu_lookup_page(struct domain *d, dfn_t dfn, mfn_t *mfn,
@@ -1913,6 +2031,7 @@ static int intel_iommu_lookup_page(struct domain *d, dfn_t dfn, mfn_t *mfn,
 {
     struct domain_iommu *hd = dom_iommu(d);
     struct dma_pte *page, val;
+    unsigned int level = 1;
     u64 pg_maddr;
 
     /*
@@ -1925,7 +2044,8 @@ static int intel_iommu_lookup_page(struct domain *d, dfn_t dfn, mfn_t *mfn,
 
     spin_lock(&hd->arch.mapping_lock);
 
-    pg_maddr = addr_to_dma_page_maddr(d, dfn_to_daddr(dfn), 0);
+    pg_maddr = addr_to_dma_page_maddr(d, dfn_to_daddr(dfn), &level, NULL,
+                                      false);
     if ( !pg_maddr )
     {
         spin_unlock(&hd->arch.mapping_lock);
@@ -1933,7 +2053,7 @@ static int intel_iommu_lookup_page(struct domain *d, dfn_t dfn, mfn_t *mfn,
     }
 
     page = map_vtd_domain_page(pg_maddr);
-    val = page[dfn_x(dfn) & LEVEL_MASK];
+    val = page[address_level_offset(dfn_to_daddr(dfn), level)];
 
     unmap_vtd_domain_page(page);
     spin_unlock(&hd->arch.mapping_lock);
@@ -1941,7 +2061,9 @@ static int intel_iommu_lookup_page(struct domain *d, dfn_t dfn, mfn_t *mfn,
     if ( !dma_pte_present(val) )
         return -ENOENT;
 
-    *mfn = maddr_to_mfn(dma_pte_addr(val));
+    /* Within a superpage, the mfn is offset like the dfn. */
+    *mfn = mfn_add(maddr_to_mfn(dma_pte_addr(val)),
+                   dfn_x(dfn) & ((1UL << ((level - 1) * LEVEL_STRIDE)) - 1));
     *flags = dma_pte_read(val) ? IOMMUF_readable : 0;
     *flags |= dma_pte_write(val) ? IOMMUF_writable : 0;
 
@@ -2258,6 +2380,7 @@ static int __init vtd_setup(void)
     struct vtd_iommu *iommu;
     int ret;
     bool reg_inval_supported = true;
+    unsigned long large_sizes = PAGE_SIZE_2M | PAGE_SIZE_1G;
 
     if ( list_empty(&acpi_drhd_units) )
     {
@@ -2298,6 +2421,11 @@ static int __init vtd_setup(void)
                cap_sps_2mb(iommu->cap) ? ", 2MB" : "",
                cap_sps_1gb(iommu->cap) ? ", 1GB" : "");
 
+        if ( !cap_sps_2mb(iommu->cap) )
+            large_sizes &= ~PAGE_SIZE_2M;
+        if ( !cap_sps_1gb(iommu->cap) )
+            large_sizes &= ~PAGE_SIZE_1G;
+
 #ifndef iommu_snoop
         if ( iommu_snoop && !ecap_snp_ctl(iommu->ecap) )
             iommu_snoop = false;
@@ -2338,6 +2466,9 @@ static int __init vtd_setup(void)
 
     softirq_tasklet_init(&vtd_fault_tasklet, do_iommu_page_fault, NULL);
 
+    /* Superpages can only be used if all IOMMUs support them. */
+    iommu_ops.page_sizes |= large_sizes;
+
     if ( !iommu_qinval && !reg_inval_supported )
     {
         dprintk(XENLOG_ERR VTDPREFIX, "No available invalidation interface\n");
@@ -2682,16 +2813,17 @@ static void vtd_dump_page_table_level(paddr_t pt_maddr, int level, paddr_t gpa,
             continue;
 
         address = gpa + offset_level_address(i, level);
-        if ( next_level >= 1 ) 
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             vtd_dump_page_table_level(dma_pte_addr(*pte), next_level,
                                       address, indent + 1);
         else
-            printk("%*sdfn: %08lx mfn: %08lx %c%c\n",
+            printk("%*sdfn: %08lx mfn: %08lx %c%c%s\n",
                    indent, "",
                    (unsigned long)(address >> PAGE_SHIFT_4K),
                    (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K),
                    dma_pte_read(*pte) ? 'r' : '-',
-                   dma_pte_write(*pte) ? 'w' : '-');
+                   dma_pte_write(*pte) ? 'w' : '-',
+                   next_level ? " (superpage)" : "");
     }
 
     unmap_vtd_domain_page(pt_vaddr);
@@ -2701,8 +2833,8 @@ static void vtd_dump_page_tables(struct domain *d)
 {
     const struct domain_iommu *hd = dom_iommu(d);
 
-    printk(VTDPREFIX" %pd table has %d levels\n", d,
-           agaw_to_level(hd->arch.vtd.agaw));
+    printk(VTDPREFIX" %pd table has %d levels, %u pages\n", d,
+           agaw_to_level(hd->arch.vtd.agaw), hd->arch.pgtables.nr);
     vtd_dump_page_table_level(hd->arch.vtd.pgd_maddr,
                               agaw_to_level(hd->arch.vtd.agaw), 0, 0);
 }
@@ -2777,6 +2909,7 @@ static int __init intel_iommu_quarantine_init(struct domain *d)
 }
 
 static struct iommu_ops __initdata vtd_ops = {
+    .page_sizes = PAGE_SIZE_4K,
     .init = intel_iommu_domain_init,
     .hwdom_init = intel_iommu_hwdom_init,
     .quarantine_init = intel_iommu_quarantine_init,
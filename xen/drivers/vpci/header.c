@@ -470,6 +470,17 @@ static int init_bars(struct pci_dev *pdev)
         return -EOPNOTSUPP;
     }
 
+    /* Identification registers are hardwired and frequently read. */
+    rc = vpci_add_cached_register(pdev->vpci, vpci_hw_read32, PCI_VENDOR_ID,
+                                  4, NULL);
+    if ( rc )
+        return rc;
+
+    rc = vpci_add_cached_register(pdev->vpci, vpci_hw_read32,
+                                  PCI_CLASS_REVISION, 4, NULL);
+    if ( rc )
+        return rc;
+
     /* Setup a handler for the command register. */
     rc = vpci_add_register(pdev->vpci, vpci_hw_read16, cmd_write, PCI_COMMAND,
                            2, header);
@@ -28,6 +28,10 @@ struct vpci_register {
     unsigned int offset;
     void *private;
     struct list_head node;
+    /* See vpci_add_cached_register(). */
+    bool cache;
+    bool cached;
+    uint32_t value;
 };
 
 #ifdef __XEN__
@@ -51,6 +55,7 @@ void vpci_remove_device(struct pci_dev *pdev)
         xfree(r);
     }
     spin_unlock(&pdev->vpci->lock);
+    xfree(pdev->vpci->index);
     xfree(pdev->vpci->msix);
     xfree(pdev->vpci->msi);
     xfree(pdev->vpci);
@@ -129,12 +134,44 @@ uint32_t vpci_hw_read32(const struct pci_dev *pdev, unsigned int reg,
     return pci_conf_read32(pdev->sbdf, reg);
 }
 
-int vpci_add_register(struct vpci *vpci, vpci_read_t *read_handler,
-                      vpci_write_t *write_handler, unsigned int offset,
-                      unsigned int size, void *data)
+/*
+ * The handlers of a device are indexed by the dword they live in, each slot
+ * of the index pointing to the first handler in the dword, if any.  As
+ * handlers can't straddle dwords this allows config space accesses to
+ * start walking the list at the right place.
+ */
+static void vpci_index_add(struct vpci *vpci, struct vpci_register *r)
+{
+    struct vpci_register **slot = &vpci->index[r->offset / 4];
+
+    ASSERT(r->offset / 4 < vpci->index_size);
+
+    if ( !*slot || (*slot)->offset > r->offset )
+        *slot = r;
+}
+
+static void vpci_index_remove(struct vpci *vpci, struct vpci_register *r)
+{
+    struct vpci_register **slot = &vpci->index[r->offset / 4];
+    struct vpci_register *next;
+
+    if ( *slot != r )
+        return;
+
+    next = list_next_entry(r, node);
+    *slot = &next->node != &vpci->handlers &&
+            next->offset / 4 == r->offset / 4 ? next : NULL;
+}
+
+static int vpci_add_register_common(struct vpci *vpci,
+                                    vpci_read_t *read_handler,
+                                    vpci_write_t *write_handler,
+                                    unsigned int offset, unsigned int size,
+                                    void *data, bool cache)
 {
     struct list_head *prev;
-    struct vpci_register *r;
+    struct vpci_register *r, **index = NULL, **old_index = NULL;
+    unsigned int index_size = offset / 4 + 1;
 
     /* Some sanity checks. */
     if ( (size != 1 && size != 2 && size != 4) ||
@@ -151,9 +188,36 @@ int vpci_add_register(struct vpci *vpci, vpci_read_t *read_handler,
     r->size = size;
     r->offset = offset;
     r->private = data;
+    r->cache = cache;
+    r->cached = false;
+
+    /* Most handlers live in the first 256 bytes, size the index for those. */
+    if ( index_size > vpci->index_size )
+    {
+        index_size = max(index_size, PCI_CFG_SPACE_SIZE / 4u);
+        index = xzalloc_array(struct vpci_register *, index_size);
+        if ( !index )
+        {
+            xfree(r);
+            return -ENOMEM;
+        }
+    }
 
     spin_lock(&vpci->lock);
 
+    if ( index && index_size > vpci->index_size )
+    {
+        unsigned int i;
+
+        for ( i = 0; i < vpci->index_size; i++ )
+            index[i] = vpci->index[i];
+        old_index = vpci->index;
+        vpci->index = index;
+        vpci->index_size = index_size;
+    }
+    else
+        old_index = index;
+
     /* The list of handlers must be kept sorted at all times. */
     list_for_each ( prev, &vpci->handlers )
     {
@@ -166,17 +230,40 @@ int vpci_add_register(struct vpci *vpci, vpci_read_t *read_handler,
         if ( cmp == 0 )
         {
             spin_unlock(&vpci->lock);
+            xfree(old_index);
             xfree(r);
             return -EEXIST;
         }
     }
 
     list_add_tail(&r->node, prev);
+    vpci_index_add(vpci, r);
     spin_unlock(&vpci->lock);
 
+    xfree(old_index);
+
     return 0;
 }
 
+int vpci_add_register(struct vpci *vpci, vpci_read_t *read_handler,
+                      vpci_write_t *write_handler, unsigned int offset,
+                      unsigned int size, void *data)
+{
+    return vpci_add_register_common(vpci, read_handler, write_handler, offset,
+                                    size, data, false);
+}
+
+int vpci_add_cached_register(struct vpci *vpci, vpci_read_t *read_handler,
+                             unsigned int offset, unsigned int size,
+                             void *data)
+{
+    if ( !read_handler )
+        return -EINVAL;
+
+    return vpci_add_register_common(vpci, read_handler, NULL, offset, size,
+                                    data, true);
+}
+
 int vpci_remove_register(struct vpci *vpci, unsigned int offset,
                          unsigned int size)
 {
@@ -194,6 +281,7 @@ int vpci_remove_register(struct vpci *vpci, unsigned int offset,
          */
         if ( !cmp && rm->offset == offset && rm->size == size )
         {
+            vpci_index_remove(vpci, rm);
             list_del(&rm->node);
             spin_unlock(&vpci->lock);
             xfree(rm);
@@ -308,11 +396,51 @@ static uint32_t merge_result(uint32_t data, uint32_t new, unsigned int size,
     return (data & ~(mask << (offset * 8))) | ((new & mask) << (offset * 8));
 }
 
+static uint32_t vpci_register_read(const struct pci_dev *pdev,
+                                   struct vpci_register *r)
+{
+    uint32_t val;
+
+    if ( r->cached )
+        return r->value;
+
+    val = r->read(pdev, r->offset, r->private);
+    /* Don't latch the all ones returned by absent or powered off devices. */
+    if ( r->cache && val != (0xffffffff >> (32 - 8 * r->size)) )
+    {
+        r->value = val;
+        r->cached = true;
+    }
+
+    return val;
+}
+
+/*
+ * Find the first handler that may overlap an access, for use as the start
+ * of a list_for_each_entry_from() walk.  If there's none, the list head is
+ * returned, ending such a walk straight away.
+ */
+static struct vpci_register *vpci_first_register(struct vpci *vpci,
+                                                 unsigned int reg,
+                                                 unsigned int size)
+{
+    struct vpci_register *r = NULL;
+
+    /* Accesses crossing a dword boundary don't get to use the index. */
+    if ( (reg & 3) + size > 4 )
+        return list_first_entry(&vpci->handlers, struct vpci_register, node);
+
+    if ( reg / 4 < vpci->index_size )
+        r = vpci->index[reg / 4];
+
+    return r ?: list_entry(&vpci->handlers, struct vpci_register, node);
+}
+
 uint32_t vpci_read(pci_sbdf_t sbdf, unsigned int reg, unsigned int size)
 {
     const struct domain *d = current->domain;
     const struct pci_dev *pdev;
-    const struct vpci_register *r;
+    struct vpci_register *r;
     unsigned int data_offset = 0;
     uint32_t data = ~(uint32_t)0;
 
@@ -330,7 +458,8 @@ uint32_t vpci_read(pci_sbdf_t sbdf, unsigned int reg, unsigned int size)
     spin_lock(&pdev->vpci->lock);
 
     /* Read from the hardware or the emulated register handlers. */
-    list_for_each_entry ( r, &pdev->vpci->handlers, node )
+    r = vpci_first_register(pdev->vpci, reg, size);
+    list_for_each_entry_from ( r, &pdev->vpci->handlers, node )
     {
         const struct vpci_register emu = {
             .offset = reg + data_offset,
@@ -354,7 +483,7 @@ uint32_t vpci_read(pci_sbdf_t sbdf, unsigned int reg, unsigned int size)
             data_offset += read_size;
         }
 
-        val = r->read(pdev, r->offset, r->private);
+        val = vpci_register_read(pdev, r);
 
         /* Check if the read is in the middle of a register. */
         if ( r->offset < emu.offset )
@@ -443,7 +572,8 @@ void vpci_write(pci_sbdf_t sbdf, unsigned int reg, unsigned int size,
     spin_lock(&pdev->vpci->lock);
 
     /* Write the value to the hardware or emulated registers. */
-    list_for_each_entry ( r, &pdev->vpci->handlers, node )
+    r = vpci_first_register(pdev->vpci, reg, size);
+    list_for_each_entry_from ( r, &pdev->vpci->handlers, node )
     {
         const struct vpci_register emu = {
             .offset = reg + data_offset,
@@ -155,14 +155,22 @@ struct shadow_vcpu {
     unsigned long last_emulated_mfn;
 #endif
 
-    /* Shadow out-of-sync: pages that this vcpu has let go out of sync */
-    mfn_t oos[SHADOW_OOS_PAGES];
-    mfn_t oos_snapshot[SHADOW_OOS_PAGES];
+    /*
+     * Shadow out-of-sync: pages that this vcpu has let go out of sync.
+     * Arrays of SHADOW_OOS_PAGES entries, of which the first oos_size are
+     * in use as hash table.  Only those slots have snapshot pages, which
+     * get allocated and freed as the table is resized.
+     */
+    mfn_t *oos;
+    mfn_t *oos_snapshot;
     struct oos_fixup {
         int next;
         mfn_t smfn[SHADOW_OOS_FIXUPS];
         unsigned long off[SHADOW_OOS_FIXUPS];
-    } oos_fixup[SHADOW_OOS_PAGES];
+    } *oos_fixup;
+    unsigned int oos_size;
+    /* Statistics for resizing the hash table. */
+    unsigned int oos_unsyncs, oos_evicts, oos_quiet;
 
 #ifdef CONFIG_HVM
     bool_t pagetable_dying;
@@ -193,6 +201,9 @@ struct log_dirty_domain {
     unsigned long  fault_count;
     unsigned long  dirty_count;
 
+    /* dirty ring shared with the toolstack, if set up */
+    struct paging_dirty_ring *ring;
+
     /* functions which are paging mode specific */
     const struct log_dirty_ops {
         int        (*enable  )(struct domain *d, bool log_global);
@@ -121,6 +121,7 @@ int __must_check hvmemul_cache_init(struct vcpu *v);
 static inline void hvmemul_cache_destroy(struct vcpu *v)
 {
     XFREE(v->arch.hvm.hvm_io.cache);
+    XFREE(v->arch.hvm.hvm_io.decode_cache);
 }
 bool hvmemul_read_cache(const struct vcpu *, paddr_t gpa,
                         void *buffer, unsigned int size);
@@ -55,6 +55,12 @@ struct hvm_io_handler {
     };
     const struct hvm_io_ops *ops;
     uint8_t type;
+    /*
+     * Set for handlers whose range may intersect another handler's, e.g.
+     * because it is guest or toolstack controlled.  Such handlers are never
+     * skipped in favour of a later registered one (see hvm_find_io_handler()).
+     */
+    bool overlaps;
 };
 
 typedef int (*hvm_io_read_t)(const struct hvm_io_handler *,
@@ -85,8 +91,8 @@ struct hvm_io_handler *hvm_next_io_handler(struct domain *d);
 
 bool_t hvm_mmio_internal(paddr_t gpa);
 
-void register_mmio_handler(struct domain *d,
-                           const struct hvm_mmio_ops *ops);
+struct hvm_io_handler *register_mmio_handler(struct domain *d,
+                                             const struct hvm_mmio_ops *ops);
 
 void register_portio_handler(
     struct domain *d, unsigned int port, unsigned int size,
@@ -106,8 +112,13 @@ void msix_write_completion(struct vcpu *);
 
 #ifdef CONFIG_HVM
 void msixtbl_init(struct domain *d);
+bool msixtbl_initialised(const struct domain *d);
 #else
 static inline void msixtbl_init(struct domain *d) {}
+static inline bool msixtbl_initialised(const struct domain *d)
+{
+    return false;
+}
 #endif
 
 /* Arch-specific MSI data for vPCI. */
@@ -66,6 +66,7 @@ struct hvm_vcpu_io {
     unsigned int mmio_insn_bytes;
     unsigned char mmio_insn[16];
     struct hvmemul_cache *cache;
+    struct x86_decode_cache *decode_cache;
 
     /*
      * For string instruction emulation we need to be able to signal a
@@ -78,6 +79,12 @@ struct hvm_vcpu_io {
     unsigned long msix_snoop_gpa;
 
     const struct g2m_ioport *g2m_ioport;
+
+    /*
+     * Indexes of the internal I/O handlers most recently used, most recent
+     * first, for port I/O [0] and MMIO [1] (see hvm_find_io_handler()).
+     */
+    uint8_t io_handler_hit[2][2];
 };
 
 struct nestedvcpu {
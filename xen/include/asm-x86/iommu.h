@@ -49,6 +49,7 @@ struct arch_iommu
     struct {
         struct page_list_head list;
         spinlock_t lock;
+        unsigned int nr; /* # of pages on list */
     } pgtables;
 
     struct list_head identity_maps;
@@ -143,6 +144,7 @@ int pi_update_irte(const struct pi_desc *pi_desc, const struct pirq *pirq,
 
 int __must_check iommu_free_pgtables(struct domain *d);
 struct page_info *__must_check iommu_alloc_pgtable(struct domain *d);
+void iommu_queue_free_pgtable(struct domain *d, struct page_info *pg);
 
 #endif /* !__ARCH_X86_IOMMU_H__ */
 /*
@@ -313,8 +313,13 @@ struct page_info
 
 #define PRtype_info "016lx"/* should only be used for printk's */
 
-/* The number of out-of-sync shadows we allow per vcpu (prime, please) */
-#define SHADOW_OOS_PAGES 3
+/*
+ * The number of out-of-sync shadows we allow per vcpu: the hash table
+ * starts out with SHADOW_OOS_PAGES_MIN slots, and grows up to
+ * SHADOW_OOS_PAGES when unsyncs keep evicting each other (prime, please).
+ */
+#define SHADOW_OOS_PAGES_MIN 3
+#define SHADOW_OOS_PAGES 13
 
 /* OOS fixup entries */
 #define SHADOW_OOS_FIXUPS 2
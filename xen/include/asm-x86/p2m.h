@@ -28,6 +28,8 @@
 
 #include <xen/paging.h>
 #include <xen/mem_access.h>
+#include <xen/tasklet.h>
+#include <xen/timer.h>
 #include <asm/mem_sharing.h>
 #include <asm/page.h>    /* for pagetable_t */
 
@@ -325,6 +327,7 @@ struct p2m_domain {
                          entry_count;  /* # of pages in p2m marked pod      */
         gfn_t            reclaim_single; /* Last gfn of a scan */
         gfn_t            max_guest;    /* gfn of max guest demand-populate */
+        struct tasklet   sweep;        /* Background zero page reclaim      */
 
         /*
          * Tracking of the most recently populated PoD pages, for eager
@@ -343,6 +346,22 @@ struct p2m_domain {
                                         * not relying on the p2m lock.      */
     } pod;
 
+    /*
+     * Superpage recombination (host p2m of HAP domains only, see
+     * p2m-recombine.c).  The counters are updated with the p2m lock held.
+     */
+    struct {
+        struct timer     timer;
+        struct tasklet   tasklet;
+        unsigned long    next_gfn;     /* Position of the pass in progress  */
+        unsigned long    pass_split;   /* ->split when the pass started     */
+        unsigned int     idle;         /* # of checks without a pass        */
+        s_time_t         last_copy;    /* Time of the last domain pause     */
+        unsigned long    split,        /* # of superpages shattered         */
+                         promoted[2],  /* # of 2M / 1G mappings rebuilt     */
+                         copied;       /* # of 2M ones needing new memory   */
+    } recombine;
+
     /*
      * Host p2m: when this flag is set, don't flush all the nested-p2m
      * tables on every host-p2m change.  The setter of this flag
@@ -644,6 +663,27 @@ int clear_identity_p2m_entry(struct domain *d, unsigned long gfn);
 /* Dump PoD information about the domain */
 void p2m_pod_dump_data(struct domain *d);
 
+/*
+ * Superpage recombination
+ */
+
+/* Dump superpage split / recombination statistics of the domain */
+void p2m_recombine_dump_data(struct domain *d);
+
+#ifdef CONFIG_HVM
+
+void p2m_recombine_init(struct p2m_domain *p2m);
+void p2m_recombine_teardown(struct p2m_domain *p2m);
+
+/* Called by p2m code when a superpage mapping gets shattered. */
+static inline void p2m_superpage_split(struct p2m_domain *p2m)
+{
+    p2m->recombine.split++;
+    perfc_incr(p2m_superpage_split);
+}
+
+#endif
+
 #ifdef CONFIG_HVM
 
 /* Report a change affecting memory types. */
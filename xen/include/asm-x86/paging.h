@@ -177,6 +177,13 @@ void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn);
  * This is called from inside paging code, with the paging lock held. */
 int paging_mfn_is_dirty(struct domain *d, mfn_t gmfn);
 
+#ifdef CONFIG_HVM
+/* dirty ring resource (XENMEM_resource_dirty_ring) */
+unsigned int paging_dirty_ring_max_frames(const struct domain *d);
+int paging_dirty_ring_acquire(struct domain *d, unsigned int frame,
+                              unsigned int nr_frames, xen_pfn_t mfn_list[]);
+#endif
+
 /*
  * Log-dirty radix tree indexing:
  *   All tree nodes are PAGE_SIZE bytes, mapped on-demand.
@@ -111,10 +111,35 @@ PERFCOUNTER(shadow_oos_fixup_evict,"shadow OOS fixup evictions")
 PERFCOUNTER(shadow_unsync,         "shadow OOS unsyncs")
 PERFCOUNTER(shadow_unsync_evict,   "shadow OOS evictions")
 PERFCOUNTER(shadow_resync,         "shadow OOS resyncs")
+PERFCOUNTER(shadow_resync_all,     "shadow OOS resync-all calls")
+PERFCOUNTER(shadow_oos_grow,       "shadow OOS table grown")
+PERFCOUNTER(shadow_oos_shrink,     "shadow OOS table shrunk")
 
 PERFCOUNTER(realmode_emulations, "realmode instructions emulated")
 PERFCOUNTER(realmode_exits,      "vmexits from realmode")
 
 PERFCOUNTER(pauseloop_exits, "vmexits from Pause-Loop Detection")
 
+PERFCOUNTER(p2m_superpage_split, "p2m superpages split")
+PERFCOUNTER(p2m_recombine_remap, "p2m superpages recombined in place")
+PERFCOUNTER(p2m_recombine_copy,  "p2m superpages recombined by copying")
+
+PERFCOUNTER(pod_sweep_background, "PoD background sweeps")
+PERFCOUNTER(pod_sweep_reclaimed,  "PoD pages reclaimed in the background")
+PERFCOUNTER(pod_sweep_emergency,  "PoD emergency sweeps")
+PERFCOUNTER(pod_cache_node_hit,   "PoD cache pages from the preferred node")
+
+PERFCOUNTER(fork_page_shared,    "VM fork pages mapped shared")
+PERFCOUNTER(fork_page_copied,    "VM fork pages copied")
+PERFCOUNTER(fork_reset_freed,    "VM fork reset pages freed")
+PERFCOUNTER(fork_reset_restored, "VM fork reset pages restored")
+
+PERFCOUNTER(ioreq_emul_sent,     "emulated I/O requests sent to ioreq servers")
+PERFCOUNTER(ioreq_emul_reps,     "emulated I/O reps sent to ioreq servers")
+PERFCOUNTER(ioreq_mmio_extended, "MMIO requests extended across pages")
+
+PERFCOUNTER(hvm_io_lookup,       "HVM I/O handler lookups")
+PERFCOUNTER(hvm_io_lookup_hit,   "HVM I/O handler lookups hitting the cache")
+PERFCOUNTER(hvm_io_accept,       "HVM I/O handler accept() calls")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
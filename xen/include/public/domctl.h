@@ -204,6 +204,12 @@ struct xen_domctl_getpageframeinfo3 {
 #define XEN_DOMCTL_SHADOW_OP_CLEAN       11
  /* Return the bitmap but do not modify internal copy. */
 #define XEN_DOMCTL_SHADOW_OP_PEEK        12
+ /*
+  * Hand back the entries consumed from the dirty ring since the last reset
+  * (see struct xen_dirty_ring in memory.h).  Dirty pfns cached by hardware
+  * get flushed to the ring first.
+  */
+#define XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET 13
 
 /* Memory allocation accessors. */
 #define XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION   30
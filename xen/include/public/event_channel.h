@@ -77,6 +77,7 @@
 #ifdef __XEN__
 #define EVTCHNOP_reset_cont      14
 #endif
+#define EVTCHNOP_set_moderation  15
 /* ` } */
 
 typedef uint32_t evtchn_port_t;
@@ -315,6 +316,22 @@ struct evtchn_set_priority {
 };
 typedef struct evtchn_set_priority evtchn_set_priority_t;
 
+/*
+ * EVTCHNOP_set_moderation: limit the rate of notifications sent through a
+ * local interdomain event channel.  A notification sent less than
+ * @min_gap_us microseconds after the previously delivered one is deferred
+ * until the gap has elapsed, with all further notifications sent in the
+ * meantime coalescing with it.  A gap of zero (the default) disables
+ * moderation.
+ */
+struct evtchn_set_moderation {
+    /* IN parameters. */
+    evtchn_port_t port;
+    uint32_t min_gap_us;
+#define EVTCHN_MODERATION_MAX_GAP_US 10000
+};
+typedef struct evtchn_set_moderation evtchn_set_moderation_t;
+
 /*
  * ` enum neg_errnoval
  * ` HYPERVISOR_event_channel_op_compat(struct evtchn_op *op)
@@ -61,13 +61,35 @@ typedef uint16_t ioservid_t;
  * hvm_op.h. If the value is HVM_IOREQSRV_BUFIOREQ_OFF then  the buffered
  * ioreq ring will not be allocated and hence all emulation requests to
  * this server will be synchronous.
+ *
+ * <bufioreq_order> is the log2 of the number of pages of the buffered
+ * ioreq ring, and must be zero if buffered ioreqs aren't handled. Rings of
+ * more than one page (see struct buffered_iopage_ext in hvm/ioreq.h) can
+ * only be mapped using XENMEM_acquire_resource.
+ *
+ * If <flags> contains XEN_DMOP_ioreq_multi_page the emulator indicates it
+ * can deal with requests whose guest memory (for data_is_ptr requests) or
+ * MMIO range extends across page boundaries.  Without it, such requests are
+ * limited to what fits in a single page (with the exception of a single
+ * access straddling two pages), which may need many more round trips for
+ * large REP MOVS / REP STOS / REP INS / REP OUTS.  Guest memory of a
+ * data_is_ptr request beyond its first page is always ordinary writable RAM.
  */
 #define XEN_DMOP_create_ioreq_server 1
 
 struct xen_dm_op_create_ioreq_server {
     /* IN - should server handle buffered ioreqs */
     uint8_t handle_bufioreq;
-    uint8_t pad[3];
+    /* IN - size of the buffered ioreq ring */
+    uint8_t bufioreq_order;
+#define XEN_DMOP_BUFIOREQ_MAX_ORDER 4
+    /* IN - flags */
+    uint8_t flags;
+
+#define _XEN_DMOP_ioreq_multi_page 0
+#define XEN_DMOP_ioreq_multi_page (1u << _XEN_DMOP_ioreq_multi_page)
+
+    uint8_t pad;
     /* OUT - server id */
     ioservid_t id;
 };
@@ -98,6 +98,23 @@ struct buffered_iopage {
 }; /* NB. Size of this structure must be no greater than one page. */
 typedef struct buffered_iopage buffered_iopage_t;
 
+/*
+ * Buffered ioreq rings of 2^order pages consist of the buffered_iopage
+ * above followed by (2^order - 1) extension pages.  Slot <n> of such a
+ * ring lives in the first page if n < IOREQ_BUFFER_SLOT_NUM, and otherwise
+ * is slot (n - IOREQ_BUFFER_SLOT_NUM) % IOREQ_BUFFER_EXT_SLOT_NUM of
+ * extension page (n - IOREQ_BUFFER_SLOT_NUM) / IOREQ_BUFFER_EXT_SLOT_NUM.
+ * Read and write pointers wrap at IOREQ_BUFFER_SLOTS(order) rather than
+ * IOREQ_BUFFER_SLOT_NUM.
+ */
+#define IOREQ_BUFFER_EXT_SLOT_NUM 512
+#define IOREQ_BUFFER_SLOTS(order) \
+    (IOREQ_BUFFER_SLOT_NUM + ((1u << (order)) - 1) * IOREQ_BUFFER_EXT_SLOT_NUM)
+struct buffered_iopage_ext {
+    buf_ioreq_t buf_ioreq[IOREQ_BUFFER_EXT_SLOT_NUM];
+};
+typedef struct buffered_iopage_ext buffered_iopage_ext_t;
+
 /*
  * ACPI Control/Event register locations. Location is controlled by a
  * version number in HVM_PARAM_ACPI_IOPORTS_LOCATION.
@@ -491,6 +491,8 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_access_op_t);
 #define XENMEM_sharing_op_range_share       8
 #define XENMEM_sharing_op_fork              9
 #define XENMEM_sharing_op_fork_reset        10
+#define XENMEM_sharing_op_batch_share       11
+#define XENMEM_sharing_op_fork_populate     12
 
 #define XENMEM_SHARING_OP_S_HANDLE_INVALID  (-10)
 #define XENMEM_SHARING_OP_C_HANDLE_INVALID  (-9)
@@ -508,6 +510,21 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_access_op_t);
 #define XENMEM_SHARING_OP_FIELD_GET_GREF(field)        \
     ((field) & (~XENMEM_SHARING_OP_FIELD_IS_GREF_FLAG))
 
+/*
+ * A pair of gfns for XENMEM_sharing_op_batch_share.  rc is set to the result
+ * of nominating and sharing the two pages, 0 on success.  With
+ * XENMEM_SHARING_BATCH_VERIFY, -EILSEQ indicates the pages' contents differ
+ * (both pages are left nominated in that case).
+ */
+struct xen_mem_sharing_pair {
+    uint64_aligned_t source_gfn;     /* IN: the gfn in the source domain */
+    uint64_aligned_t client_gfn;     /* IN: the gfn in the client domain */
+    int32_t rc;                      /* OUT: result for this pair */
+    uint32_t _pad;                   /* Must be set to 0 */
+};
+typedef struct xen_mem_sharing_pair xen_mem_sharing_pair_t;
+DEFINE_XEN_GUEST_HANDLE(xen_mem_sharing_pair_t);
+
 struct xen_mem_sharing_op {
     uint8_t     op;     /* XENMEM_sharing_op_* */
     domid_t     domain;
@@ -534,6 +551,18 @@ struct xen_mem_sharing_op {
             domid_t client_domain;           /* IN: the client domain id */
             uint16_t _pad[3];                /* Must be set to 0 */
         } range;
+        struct mem_sharing_op_batch {         /* OP_BATCH_SHARE */
+            /* IN/OUT: array of nr xen_mem_sharing_pair_t */
+            XEN_GUEST_HANDLE_64(void) pairs;
+            uint32_t nr;                     /* IN: number of pairs */
+            /* IN: must be set to 0; OUT: on -ENOMEM, the failing pair */
+            uint32_t opaque;
+/* Compare the contents of the two pages before sharing them. */
+#define XENMEM_SHARING_BATCH_VERIFY (1u << 0)
+            uint32_t flags;                  /* IN: XENMEM_SHARING_BATCH_* */
+            domid_t client_domain;           /* IN: the client domain id */
+            uint16_t _pad;                   /* Must be set to 0 */
+        } batch;
         struct mem_sharing_op_debug {     /* OP_DEBUG_xxx */
             union {
                 uint64_aligned_t gfn;      /* IN: gfn to debug          */
@@ -547,9 +576,23 @@ struct xen_mem_sharing_op {
 #define XENMEM_FORK_WITH_IOMMU_ALLOWED (1u << 0)
 /* Only makes sense for short-lived forks */
 #define XENMEM_FORK_BLOCK_INTERRUPTS   (1u << 1)
+/*
+ * OP_FORK_RESET only: restore the contents of pages the fork wrote to from
+ * the parent, rather than freeing them.
+ */
+#define XENMEM_FORK_RESET_RESTORE      (1u << 2)
             uint16_t flags;               /* IN: optional settings */
             uint32_t pad;                 /* Must be set to 0 */
         } fork;
+        struct mem_sharing_op_fork_populate { /* OP_FORK_POPULATE */
+            uint64_aligned_t first_gfn;      /* IN: the first gfn */
+            uint64_aligned_t last_gfn;       /* IN: the last gfn */
+            uint64_aligned_t opaque;         /* Must be set to 0 */
+/* Populate with private copies rather than shared entries. */
+#define XENMEM_FORK_POPULATE_PRIVATE   (1u << 0)
+            uint32_t flags;                  /* IN: XENMEM_FORK_POPULATE_* */
+            uint32_t pad;                    /* Must be set to 0 */
+        } populate;
     } u;
 };
 typedef struct xen_mem_sharing_op xen_mem_sharing_op_t;
@@ -633,6 +676,7 @@ struct xen_mem_acquire_resource {
 #define XENMEM_resource_ioreq_server 0
 #define XENMEM_resource_grant_table 1
 #define XENMEM_resource_vmtrace_buf 2
+#define XENMEM_resource_dirty_ring 3
 
     /*
      * IN - a type-specific resource identifier, which must be zero
@@ -672,6 +716,14 @@ struct xen_mem_acquire_resource {
 
 #define XENMEM_resource_ioreq_server_frame_bufioreq 0
 #define XENMEM_resource_ioreq_server_frame_ioreq(n) (1 + (n))
+/*
+ * Extension pages of multi-page buffered ioreq rings.  These are not covered
+ * by the size reported when nr_frames is 0, which only describes the frames
+ * from index 0.  A ring of 2^bufioreq_order pages (as requested at creation
+ * of the ioreq server) has 2^bufioreq_order - 1 of them, at indexes
+ * XENMEM_resource_ioreq_server_frame_bufioreq_ext(0) and onwards.
+ */
+#define XENMEM_resource_ioreq_server_frame_bufioreq_ext(n) (0x1000 + (n))
 
     /*
      * IN/OUT - If the tools domain is PV then, upon return, frame_list
@@ -690,6 +742,40 @@ struct xen_mem_acquire_resource {
 typedef struct xen_mem_acquire_resource xen_mem_acquire_resource_t;
 DEFINE_XEN_GUEST_HANDLE(xen_mem_acquire_resource_t);
 
+/*
+ * Layout of XENMEM_resource_dirty_ring, available for HAP guests.
+ *
+ * While log-dirty mode is enabled, the pfn of every page newly set in the
+ * log-dirty bitmap is also appended to this ring, allowing the toolstack
+ * to pick up dirty pages as they get written rather than by scanning the
+ * whole bitmap.  Frame 0 holds the header below, the remaining frames an
+ * array of 'size' uint64_t pfns, of which entry i % size is the i-th one
+ * produced.
+ *
+ * The consumer advances 'cons' past the entries it has picked up, and
+ * hands them back through XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET, which
+ * clears them in the log-dirty bitmap and write-protects them again, so
+ * that the next write to them gets logged anew.  This has to happen
+ * /before/ the page contents are read, or writes racing with the copy may
+ * go unnoticed.  The reset also flushes pfns cached by hardware (e.g. Intel
+ * PML buffers) to the ring, so a reset (with nothing consumed, if need be)
+ * is required for the ring to cover all writes done before it, e.g. on the
+ * final pass with the domain paused.  Entries which haven't been handed
+ * back yet are never overwritten: when the ring is full, pfns are only
+ * recorded in the bitmap and XEN_DIRTY_RING_OVERFLOW gets set, and the
+ * consumer must fall back to XEN_DOMCTL_SHADOW_OP_CLEAN (which also clears
+ * the flag).  Enabling log-dirty mode empties the ring.
+ */
+struct xen_dirty_ring {
+    uint32_t prod;  /* Written by Xen. */
+    uint32_t cons;  /* Written by the consumer. */
+    uint32_t size;  /* Number of entries, a power of 2. */
+    uint32_t flags;
+#define _XEN_DIRTY_RING_OVERFLOW 0
+#define XEN_DIRTY_RING_OVERFLOW (1U << _XEN_DIRTY_RING_OVERFLOW)
+};
+typedef struct xen_dirty_ring xen_dirty_ring_t;
+
 /*
  * XENMEM_get_vnumainfo used by guest to get
  * vNUMA topology from hypervisor.
@@ -476,6 +476,31 @@ struct xen_sysctl_lockprof_op {
     XEN_GUEST_HANDLE_64(xen_sysctl_lockprof_data_t) data;
 };
 
+/* XEN_SYSCTL_sched_stats */
+/*
+ * Scheduler independent statistics, summed up over all cpus of a cpupool (or
+ * of the whole host, when cpupool_id is XEN_SYSCTL_CPUPOOL_PAR_ANY).
+ *
+ * Bucket i of wait_hist counts the times a vcpu got to run after having been
+ * runnable for less than 8^i microseconds (the last bucket counting all the
+ * longer waits). For computing the buckets a microsecond is approximated
+ * to 1024ns.
+ */
+#define XEN_SYSCTL_SCHED_STATS_WAIT_BUCKETS 8
+struct xen_sysctl_sched_stats {
+    /* IN variables. */
+    uint32_t cpupool_id;
+    /* OUT variables. */
+    uint32_t nr_runnable;          /* vcpus runnable, but not running now */
+    uint64_aligned_t wakeups;      /* # of vcpus wakeups */
+    uint64_aligned_t runs;         /* # of vcpus going from runnable to run */
+    uint64_aligned_t wait_time;    /* nsecs spent runnable (i.e., steal) */
+    uint64_aligned_t wait_max;     /* max nsecs spent runnable in one go */
+    uint64_aligned_t wait_hist[XEN_SYSCTL_SCHED_STATS_WAIT_BUCKETS];
+    uint64_aligned_t migrations;   /* # of units moved to another cpu */
+    uint64_aligned_t ratelimit_hits; /* # of preemptions delayed */
+};
+
 /* XEN_SYSCTL_cputopoinfo */
 #define XEN_INVALID_CORE_ID     (~0U)
 #define XEN_INVALID_SOCKET_ID   (~0U)
@@ -1095,6 +1120,7 @@ struct xen_sysctl {
 #define XEN_SYSCTL_livepatch_op                  27
 /* #define XEN_SYSCTL_set_parameter              28 */
 #define XEN_SYSCTL_get_cpu_policy                29
+#define XEN_SYSCTL_sched_stats                   30
     uint32_t interface_version; /* XEN_SYSCTL_INTERFACE_VERSION */
     union {
         struct xen_sysctl_readconsole       readconsole;
@@ -1122,6 +1148,7 @@ struct xen_sysctl {
         struct xen_sysctl_cpu_levelling_caps cpu_levelling_caps;
         struct xen_sysctl_cpu_featureset    cpu_featureset;
         struct xen_sysctl_livepatch_op      livepatch;
+        struct xen_sysctl_sched_stats       sched_stats;
 #if defined(__i386__) || defined(__x86_64__)
         struct xen_sysctl_cpu_policy        cpu_policy;
 #endif
@@ -125,11 +125,13 @@ void arch_iommu_hwdom_init(struct domain *d);
 
 /*
  * The following flags are passed to map operations and passed by lookup
- * operations.
+ * operations. Map operations additionally get passed the order of the
+ * mapping to establish (see IOMMUF_order()).
  */
-#define _IOMMUF_readable 0
+#define IOMMUF_order(n)  ((n) & 0x3f)
+#define _IOMMUF_readable 6
 #define IOMMUF_readable  (1u<<_IOMMUF_readable)
-#define _IOMMUF_writable 1
+#define _IOMMUF_writable 7
 #define IOMMUF_writable  (1u<<_IOMMUF_writable)
 
 /*
@@ -231,6 +233,7 @@ struct page_info;
 typedef int iommu_grdm_t(xen_pfn_t start, xen_ulong_t nr, u32 id, void *ctxt);
 
 struct iommu_ops {
+    unsigned long page_sizes; /* Mapping sizes supported (PAGE_SIZE_*). */
     int (*init)(struct domain *d);
     void (*hwdom_init)(struct domain *d);
     int (*quarantine_init)(struct domain *d);
@@ -254,6 +257,7 @@ struct iommu_ops {
                                  unsigned int flags,
                                  unsigned int *flush_flags);
     int __must_check (*unmap_page)(struct domain *d, dfn_t dfn,
+                                   unsigned int order,
                                    unsigned int *flush_flags);
     int __must_check (*lookup_page)(struct domain *d, dfn_t dfn, mfn_t *mfn,
                                     unsigned int *flags);
@@ -373,6 +377,25 @@ void iommu_dev_iotlb_flush_timeout(struct domain *d, struct pci_dev *pdev);
  */
 DECLARE_PER_CPU(bool_t, iommu_dont_flush_iotlb);
 
+/*
+ * Sequences of iommu_legacy_map()/iommu_legacy_unmap() operations on a
+ * single domain can be bracketed by iommu_flush_gather_begin() and
+ * iommu_flush_gather_end(), in which case the IOTLB flushes required by
+ * the individual operations get accumulated on the local CPU and issued as
+ * a single flush covering all affected DFNs by iommu_flush_gather_end().
+ * Pages unmapped within such a section must not be freed or re-used before
+ * the section has been ended, or the flushes gathered so far have been
+ * issued by iommu_flush_gather_sync().  Sections may nest, but only for the
+ * same domain, and must not span hypercall continuations.  A failure of any
+ * flush issued within a section is also reported by iommu_flush_gather_end().
+ */
+void iommu_flush_gather_begin(struct domain *d);
+int iommu_flush_gather_sync(struct domain *d);
+int __must_check iommu_flush_gather_end(struct domain *d);
+int __must_check iommu_iotlb_flush_gather(struct domain *d, dfn_t dfn,
+                                          unsigned long page_count,
+                                          unsigned int flush_flags);
+
 extern struct spinlock iommu_pt_cleanup_lock;
 extern struct page_list_head iommu_pt_cleanup_list;
 
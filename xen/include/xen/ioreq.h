@@ -48,6 +48,8 @@ struct ioreq_server {
     struct ioreq_page      ioreq;
     struct list_head       ioreq_vcpu_list;
     struct ioreq_page      bufioreq;
+    /* Further pages of buffered ioreq rings with bufioreq_order > 0 */
+    struct ioreq_page      bufioreq_ext[(1u << XEN_DMOP_BUFIOREQ_MAX_ORDER) - 1];
 
     /* Lock to serialize access to buffered ioreq ring */
     spinlock_t             bufioreq_lock;
@@ -55,6 +57,9 @@ struct ioreq_server {
     struct rangeset        *range[NR_IO_RANGE_TYPES];
     bool                   enabled;
     uint8_t                bufioreq_handling;
+    uint8_t                bufioreq_order;
+    /* Emulator handles requests spanning pages (XEN_DMOP_ioreq_multi_page) */
+    bool                   multi_page;
 };
 
 static inline paddr_t ioreq_mmio_first_byte(const ioreq_t *p)
@@ -88,6 +93,7 @@ bool domain_has_ioreq_server(const struct domain *d);
 bool vcpu_ioreq_pending(struct vcpu *v);
 bool vcpu_ioreq_handle_completion(struct vcpu *v);
 bool is_ioreq_server_page(struct domain *d, const struct page_info *page);
+unsigned int ioreq_server_bufioreq_space(struct ioreq_server *s);
 
 int ioreq_server_get_frame(struct domain *d, ioservid_t id,
                            unsigned int idx, mfn_t *mfn);
@@ -14,6 +14,28 @@ PERFCOUNTER(ipis,                   "#IPIs")
 
 PERFCOUNTER(rcu_idle_timer,         "RCU: idle_timer")
 
+PERFCOUNTER(tbuf_notify,            "tbuf: consumer notifications")
+PERFCOUNTER(tbuf_notify_batched,    "tbuf: batched notifications")
+
+PERFCOUNTER(evtchn_fifo_set_pending_fast, "evtchn: FIFO already pending")
+PERFCOUNTER(evtchn_moderated,       "evtchn: moderated notifications")
+
+PERFCOUNTER(iommu_map,              "IOMMU: map operations")
+PERFCOUNTER(iommu_unmap,            "IOMMU: unmap operations")
+PERFCOUNTER(iommu_iotlb_flush,      "IOMMU: IOTLB flushes")
+PERFCOUNTER(iommu_iotlb_flush_all,  "IOMMU: full IOTLB flushes")
+PERFCOUNTER(iommu_iotlb_flush_gathered, "IOMMU: gathered IOTLB flushes")
+
+PERFCOUNTER(ioreq_select_indexed,   "ioreq: indexed server selections")
+PERFCOUNTER(ioreq_select_walk,      "ioreq: server selections by walk")
+PERFCOUNTER(ioreq_index_rebuild,    "ioreq: range index rebuilds")
+
+PERFCOUNTER(maptrack_steal,         "gnttab: maptrack steals")
+PERFCOUNTER(maptrack_stolen,        "gnttab: maptrack entries stolen")
+PERFCOUNTER(gnttab_copy,            "gnttab: copy operations")
+PERFCOUNTER(gnttab_copy_claim,      "gnttab: copy frames claimed")
+PERFCOUNTER(gnttab_copy_bytes,      "gnttab: bytes copied")
+
 /* Generic scheduler counters (applicable to all schedulers) */
 PERFCOUNTER(sched_irq,              "sched: timer")
 PERFCOUNTER(sched_run,              "sched: runs through scheduler")
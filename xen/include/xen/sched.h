@@ -98,6 +98,7 @@ struct evtchn
     unsigned char old_state; /* State when taking lock in write mode. */
 #endif
     unsigned char xen_consumer:XEN_CONSUMER_BITS; /* Consumer in Xen if != 0 */
+    unsigned char moderated:1; /* Has entry in domain's evtchn_moderation. */
     evtchn_port_t port;
     union {
         struct {
@@ -270,6 +271,10 @@ struct vcpu
     evtchn_port_t    virq_to_evtchn[NR_VIRQS];
     rwlock_t         virq_lock;
 
+    /* Event channel notifications sent by this VCPU (statistics only). */
+    unsigned long    evtchn_sent;
+    unsigned long    evtchn_sent_unbound;
+
     /* Tasklet for continue_hypercall_on_cpu(). */
     struct tasklet   continue_hypercall_tasklet;
 
@@ -419,6 +424,9 @@ struct domain
     spinlock_t       event_lock;
     const struct evtchn_port_ops *evtchn_port_ops;
     struct evtchn_fifo_domain *evtchn_fifo;
+    /* Moderation state of ports, indexed by port.  Updated under event_lock. */
+    struct radix_tree_root evtchn_moderation;
+    unsigned int     nr_moderated_evtchns;
 
     struct grant_table *grant_table;
 
@@ -581,6 +589,8 @@ struct domain
     struct {
         spinlock_t              lock;
         struct ioreq_server     *server[MAX_NR_IOREQ_SERVERS];
+        /* Sorted ranges of all enabled servers, RCU protected */
+        struct ioreq_range_index *index;
     } ioreq_server;
 #endif
 };
@@ -755,6 +765,7 @@ int  sched_init_domain(struct domain *d, unsigned int poolid);
 void sched_destroy_domain(struct domain *d);
 long sched_adjust(struct domain *, struct xen_domctl_scheduler_op *);
 long sched_adjust_global(struct xen_sysctl_scheduler_op *);
+long sched_stats_get(struct xen_sysctl_sched_stats *);
 int  sched_id(void);
 void vcpu_wake(struct vcpu *v);
 long vcpu_yield(void);
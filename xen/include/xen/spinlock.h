@@ -146,6 +146,36 @@ struct lock_profile_qhead { };
 
 #endif
 
+#ifdef CONFIG_QUEUED_SPINLOCKS
+
+/*
+ * Queued spinlock: the owner is flagged in the locked byte, while waiters
+ * queue up on per-cpu nodes, the tail of the queue being encoded in the
+ * upper half of the lock word as ((cpu + 1) << SPINLOCK_QNODE_BITS) | index
+ * (0 meaning no waiter).  Every release bumps the seq byte, allowing
+ * spin_barrier() to notice the lock being handed over between waiters.
+ */
+typedef union {
+    u32 val;
+    struct {
+        union {
+            u16 locked_seq;
+            struct {
+                u8 locked;
+                u8 seq;
+            };
+        };
+        u16 tail;
+    };
+} spinlock_queue_t;
+
+#define SPINLOCK_QNODE_BITS    2
+#define SPINLOCK_QNODES        (1u << SPINLOCK_QNODE_BITS)
+
+#define spinlock_val(l)        ((l)->queue.val)
+
+#else
+
 typedef union {
     u32 head_tail;
     struct {
@@ -156,8 +186,16 @@ typedef union {
 
 #define SPINLOCK_TICKET_INC { .head_tail = 0x10000, }
 
+#define spinlock_val(l)        ((l)->tickets.head_tail)
+
+#endif
+
 typedef struct spinlock {
+#ifdef CONFIG_QUEUED_SPINLOCKS
+    spinlock_queue_t queue;
+#else
     spinlock_tickets_t tickets;
+#endif
     u16 recurse_cpu:SPINLOCK_CPU_BITS;
 #define SPINLOCK_NO_CPU        ((1u << SPINLOCK_CPU_BITS) - 1)
 #define SPINLOCK_RECURSE_BITS  (16 - SPINLOCK_CPU_BITS)
@@ -40,6 +40,17 @@ int __must_check vpci_add_register(struct vpci *vpci,
 int __must_check vpci_remove_register(struct vpci *vpci, unsigned int offset,
                                       unsigned int size);
 
+/*
+ * Add a handler for a read-only register whose value can't change, like
+ * hardwired identification registers: the read handler is only called on
+ * the first access and the result served from a cache afterwards.  Writes
+ * are ignored.
+ */
+int __must_check vpci_add_cached_register(struct vpci *vpci,
+                                          vpci_read_t *read_handler,
+                                          unsigned int offset,
+                                          unsigned int size, void *data);
+
 /* Generic read/write handlers for the PCI config space. */
 uint32_t vpci_read(pci_sbdf_t sbdf, unsigned int reg, unsigned int size);
 void vpci_write(pci_sbdf_t sbdf, unsigned int reg, unsigned int size,
@@ -60,6 +71,9 @@ bool __must_check vpci_process_pending(struct vcpu *v);
 struct vpci {
     /* List of vPCI handlers for a device. */
     struct list_head handlers;
+    /* First handler within each dword of config space, if any. */
+    struct vpci_register **index;
+    unsigned int index_size;
     spinlock_t lock;
 
 #ifdef __XEN__
@@ -774,6 +774,7 @@ static int flask_sysctl(int cmd)
         return domain_has_xen(current->domain, XEN__TBUFCONTROL);
 
     case XEN_SYSCTL_sched_id:
+    case XEN_SYSCTL_sched_stats:
         return domain_has_xen(current->domain, XEN__GETSCHEDULER);
 
     case XEN_SYSCTL_perfc_op:
@@ -1496,6 +1497,7 @@ static int flask_shadow_control(struct domain *d, uint32_t op)
     case XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
+    case XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET:
         perm = SHADOW__LOGDIRTY;
         break;
     default: